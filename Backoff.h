@@ -0,0 +1,94 @@
+/// \file
+/// Declaration/definition of the Backoff class.
+/// <p>
+/// Copyright (c) 2009 Ross Tyler.
+/// This file may be copied under the terms of the
+/// GNU Lesser General Public License (LGPL).
+/// See COPYING file for details.
+
+#ifndef Backoff_h_
+#define Backoff_h_
+
+#include <map>
+
+#include <boost/thread/mutex.hpp>
+
+#include "Utility.h"
+
+/// A Backoff keeps a record of the failures of whatever is identified by
+/// a Key so that we can back off from trying it again.
+/// Once it has failed threshold times in a row, it is backed off from
+/// for a time that starts at a second and doubles with each further failure
+/// up to a limit.
+/// A success forgets its failures.
+template <typename Key> class Backoff : private boost::mutex {
+private:
+    struct Record {
+	unsigned	failures;	///< Consecutive failures
+	double		until;		///< Back off until (Utility::now())
+    };
+    typedef std::map<Key, Record> Map;
+    Map		map;
+    unsigned	threshold;	///< Failures before backing off
+    double	limit;		///< Longest back off (seconds)
+    unsigned long	failures;	///< Failures ever recorded
+
+public:
+
+    /// Construct a Backoff that, if limit is 0, never backs off.
+    Backoff(unsigned threshold_, double limit_) throw()
+	: map(), threshold(threshold_), limit(limit_), failures(0) {}
+
+    /// Record a failure.
+    void fail(Key key) throw() {
+	boost::mutex::scoped_lock lock(*this);
+	++failures;
+	if (!limit) return;
+	double now = Utility::now();
+	// forget those that have been quiet for as long as we would back off
+	for (typename Map::iterator it = map.begin(); it != map.end();) {
+	    if (it->second.until + limit < now) map.erase(it++); else ++it;
+	}
+	Record & record = map[key];
+	if (++record.failures < threshold) {
+	    record.until = now;
+	} else {
+	    double delay = 1;
+	    for (unsigned i = threshold; i < record.failures && delay < limit;
+		    ++i)
+		delay *= 2;
+	    record.until = now + (delay < limit ? delay : limit);
+	}
+    }
+
+    /// Record a success.
+    void succeed(Key key) throw() {
+	boost::mutex::scoped_lock lock(*this);
+	map.erase(key);
+    }
+
+    /// \return True if we should back off from trying key now.
+    bool backingOff(Key key) throw() {
+	boost::mutex::scoped_lock lock(*this);
+	typename Map::iterator it = map.find(key);
+	return it != map.end() && Utility::now() < it->second.until;
+    }
+
+    /// \return The number of failures ever recorded.
+    unsigned long failed() throw() {
+	boost::mutex::scoped_lock lock(*this);
+	return failures;
+    }
+
+    /// \return The number of keys that we are backing off from now.
+    size_t size() throw() {
+	boost::mutex::scoped_lock lock(*this);
+	double now = Utility::now();
+	size_t size = 0;
+	for (typename Map::iterator it = map.begin(); it != map.end(); ++it)
+	    if (now < it->second.until) ++size;
+	return size;
+    }
+};
+
+#endif
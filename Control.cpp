@@ -0,0 +1,127 @@
+/// \file
+/// Definition of the Control class.
+/// <p>
+/// Copyright (c) 2009 Ross Tyler.
+/// This file may be copied under the terms of the
+/// GNU Lesser General Public License (LGPL).
+/// See COPYING file for details.
+
+#include <cerrno>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Control.h"
+
+static int listenOn(std::string const & path) throw(Exception::Error) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof address.sun_path) {
+	throw Exception::Error(": " + path, ENAMETOOLONG);
+    }
+    strcpy(address.sun_path, path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (-1 == fd) throw Exception::Error(": socket");
+    unlink(address.sun_path);
+    if (-1 == bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof address)
+	    || -1 == listen(fd, 4)) {
+	int error = errno;
+	close(fd);
+	throw Exception::Error(": " + path, error);
+    }
+    return fd;
+}
+
+Control::Control(std::string const & path_, Command const & command_)
+	throw(Exception::Error)
+:
+    path(path_),
+    command(command_),
+    listenFd(listenOn(path)),
+    connectionFd(-1),
+    stopping(false),
+    thread(boost::bind(&Control::run, this))
+{}
+
+Control::~Control() throw() {
+    {
+	boost::mutex::scoped_lock lock(*this);
+	stopping = true;
+	// wake our thread from accept or read
+	shutdown(listenFd, SHUT_RDWR);
+	if (-1 != connectionFd) shutdown(connectionFd, SHUT_RDWR);
+    }
+    thread.join();
+    close(listenFd);
+    unlink(path.c_str());
+}
+
+/// Write size bytes from buffer to fd, retrying short writes.
+/// \return True if successful.
+static bool writeAll(int fd, char const * buffer, size_t size) throw() {
+    while (size) {
+	ssize_t length = send(fd, buffer, size, MSG_NOSIGNAL);
+	if (0 >= length) {
+	    if (-1 == length && EINTR == errno) continue;
+	    return false;
+	}
+	buffer += length;
+	size -= length;
+    }
+    return true;
+}
+
+void Control::serve(int fd) throw() {
+    std::string line;
+    char buffer[4096];
+    for (;;) {
+	ssize_t length = ::read(fd, buffer, sizeof buffer);
+	if (0 >= length) {
+	    if (-1 == length && EINTR == errno) continue;
+	    break;
+	}
+	for (char const * it = buffer; it < buffer + length; ++it) {
+	    if ('\n' != *it) {
+		line += *it;
+		continue;
+	    }
+	    if (!line.empty() && '\r' == line[line.size() - 1]) {
+		line.erase(line.size() - 1);
+	    }
+	    std::string answer = command(line);
+	    line.clear();
+	    if (!writeAll(fd, answer.data(), answer.size())) return;
+	}
+    }
+    // answer a last line that was not terminated
+    if (!line.empty()) {
+	std::string answer = command(line);
+	writeAll(fd, answer.data(), answer.size());
+    }
+}
+
+void Control::run() throw() {
+    for (;;) {
+	int fd = accept4(listenFd, 0, 0, SOCK_CLOEXEC);
+	{
+	    boost::mutex::scoped_lock lock(*this);
+	    if (stopping) {
+		if (-1 != fd) close(fd);
+		return;
+	    }
+	    if (-1 == fd) {
+		if (EINTR == errno || ECONNABORTED == errno) continue;
+		return;
+	    }
+	    connectionFd = fd;
+	}
+	serve(fd);
+	{
+	    boost::mutex::scoped_lock lock(*this);
+	    connectionFd = -1;
+	}
+	close(fd);
+    }
+}
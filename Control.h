@@ -0,0 +1,48 @@
+/// \file
+/// Declaration of the Control class.
+/// <p>
+/// Copyright (c) 2009 Ross Tyler.
+/// This file may be copied under the terms of the
+/// GNU Lesser General Public License (LGPL).
+/// See COPYING file for details.
+
+#ifndef Control_h_
+#define Control_h_
+
+#include <string>
+
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "Exception.h"
+
+/// A Control listens on a unix domain stream socket for connections
+/// and, one connection at a time, answers each line read from it
+/// with what its command handler returns for it.
+/// This lets an administrator inspect and tune a mounted file system.
+class Control : private boost::mutex {
+public:
+    typedef boost::function<std::string (std::string const &)> Command;
+
+private:
+    std::string const path;	///< Of our listening socket
+    Command const command;	///< Answers each line read
+    int listenFd;
+    int connectionFd;		///< Being served or -1
+    bool stopping;
+    boost::thread thread;
+
+    void serve(int fd) throw();
+    void run() throw();
+
+public:
+    /// Listen on a socket at path (replacing whatever might be there).
+    Control(std::string const & path, Command const & command)
+	throw(Exception::Error);
+
+    /// Stop serving and remove our socket.
+    ~Control() throw();
+};
+
+#endif
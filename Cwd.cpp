@@ -10,6 +10,7 @@
 #include <unistd.h>
 
 #include "Cwd.h"
+#include "Metrics.h"
 
 Cwd::Cwd(char const * path_) throw()
 :
@@ -30,6 +31,7 @@ Cwd::~Cwd() throw() {
 /*static*/ unsigned	CwdSynchronized::count	(0);
 
 CwdSynchronized::CwdSynchronized(char const * path_) throw() {
+    Metrics::Timer timer(Metrics::cwdLockSeconds);
     Synchronizable<boost::mutex>::Synchronized synchronized(synchronizable);
     // block until we can create a new cwd or we agree with the existing one
     while (cwd && 0 != path.compare( path_)) {
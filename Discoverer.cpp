@@ -0,0 +1,295 @@
+/// \file
+/// Definition of the Discoverer class.
+/// <p>
+/// Copyright (c) 2009 Ross Tyler.
+/// This file may be copied under the terms of the
+/// GNU Lesser General Public License (LGPL).
+/// See COPYING file for details.
+
+#include <cerrno>
+#include <iostream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/bind/bind.hpp>
+
+#include "Discoverer.h"
+#include "readlink.h"
+
+Discoverer::Properties::Properties() throw()
+    : rate(0), channels(0), bitrate(0), caps() {}
+
+/// The name of the file, in our persist directory, that remembers
+/// what we have discovered.
+static char const persistName[] = "discovered";
+
+Discoverer::Discoverer(int baseFd, size_t countLimit_, int persistFd_,
+	time_t saveInterval_)
+    throw()
+:
+    list(),
+    map(),
+    queue(),
+    queued(),
+    base(),
+    countLimit(countLimit_),
+    persistFd(persistFd_),
+    saveInterval(saveInterval_),
+    changed(false),
+    stop(false),
+    discoverMutex(),
+    discoverer(0),
+    thread()
+{
+    load();
+    try {
+	base = readlink(baseFd).get();
+    } catch (Exception::Error & e) {
+	std::cerr << "discoverer: " << e.what() << std::endl;
+    }
+    thread = boost::thread(boost::bind(&Discoverer::run, this));
+}
+
+Discoverer::~Discoverer() throw() {
+    {
+	Synchronized synchronized(*this);
+	stop = true;
+	synchronized.notify();
+    }
+    thread.join();
+    save();
+    if (discoverer) g_object_unref(discoverer);
+}
+
+bool Discoverer::find(FileIndex fileIndex, Properties & properties) throw() {
+    // callers should have already obtained a lock on *this!
+    Map::iterator it = map.find(fileIndex);
+    if (it == map.end()) return false;
+    // this is now the most recently used
+    list.splice(list.end(), list, it->second);
+    properties = it->second->second;
+    return true;
+}
+
+void Discoverer::remember(FileIndex fileIndex, Properties const & properties)
+	throw() {
+    // callers should have already obtained a lock on *this!
+    if (!countLimit) return;
+    Map::iterator it = map.find(fileIndex);
+    if (it != map.end()) {
+	it->second->second = properties;
+	list.splice(list.end(), list, it->second);
+    } else {
+	map.insert(Map::value_type(fileIndex,
+	    list.insert(list.end(), List::value_type(fileIndex, properties))));
+	// make room for it by forgetting the least recently used
+	if (list.size() > countLimit) {
+	    map.erase(list.front().first);
+	    list.pop_front();
+	}
+    }
+    changed = true;
+}
+
+void Discoverer::load() throw() {
+    if (-1 == persistFd) return;
+    int fd = openat(persistFd, persistName, O_RDONLY);
+    if (-1 == fd) return;
+    std::string content;
+    char tile[8192];
+    ssize_t length;
+    while (0 < (length = read(fd, tile, sizeof tile))
+	    || (-1 == length && EINTR == errno)) {
+	if (0 < length) content.append(tile, length);
+    }
+    close(fd);
+    // each line is a FileIndex, rate, channels and bitrate
+    // followed by the rest of the line (which may be empty) as caps
+    // (least recently used first)
+    std::istringstream in(content);
+    std::string line;
+    Synchronized synchronized(*this);
+    while (std::getline(in, line)) {
+	std::istringstream fields(line);
+	FileIndex fileIndex;
+	Properties properties;
+	if (!(fields >> fileIndex
+		>> properties.rate >> properties.channels
+		>> properties.bitrate))
+	    continue;
+	if (' ' == fields.peek()) fields.get();
+	std::getline(fields, properties.caps);
+	remember(fileIndex, properties);
+    }
+    changed = false;
+}
+
+void Discoverer::save() throw() {
+    if (-1 == persistFd) return;
+    // format a copy so that we are not locked while we write it
+    // (least recently used first, as we load it)
+    List copy;
+    {
+	Synchronized synchronized(*this);
+	if (!changed) return;
+	changed = false;
+	copy = list;
+    }
+    std::ostringstream out;
+    for (List::iterator it = copy.begin(); it != copy.end(); ++it) {
+	FileIndex fileIndex(it->first);
+	Properties const & properties = it->second;
+	out << fileIndex
+	    << ' ' << properties.rate
+	    << ' ' << properties.channels
+	    << ' ' << properties.bitrate
+	    << ' ' << properties.caps
+	    << '\n';
+    }
+    std::string content = out.str();
+    std::string temp = std::string(persistName) + ".tmp";
+    int fd = openat(persistFd, temp.c_str(), O_CREAT | O_TRUNC | O_WRONLY,
+	0666);
+    if (-1 == fd) return;
+    char const * buffer = content.data();
+    size_t size = content.size();
+    while (size) {
+	ssize_t written = write(fd, buffer, size);
+	if (0 >= written) {
+	    if (-1 == written && EINTR == errno) continue;
+	    break;
+	}
+	buffer += written;
+	size -= written;
+    }
+    close(fd);
+    if (!size) {
+	renameat(persistFd, temp.c_str(), persistFd, persistName);
+    } else {
+	unlinkat(persistFd, temp.c_str(), 0);
+    }
+}
+
+bool Discoverer::discovered(
+	FileIndex fileIndex, char const * path, Properties & properties)
+	throw() {
+    Synchronized synchronized(*this);
+    if (find(fileIndex, properties)) return true;
+    // discover it in the background, unless that is already on the way
+    if (queue.size() < countLimit && queued.insert(fileIndex).second) {
+	queue.push_back(Queue::value_type(fileIndex, path));
+	synchronized.notify();
+    }
+    return false;
+}
+
+Discoverer::Properties Discoverer::discover(
+	FileIndex fileIndex, char const * path) throw() {
+    Properties properties;
+    {
+	Synchronized synchronized(*this);
+	if (find(fileIndex, properties)) return properties;
+    }
+    // discover one at a time but, if it was discovered while we waited,
+    // don't do so again
+    boost::mutex::scoped_lock lock(discoverMutex);
+    {
+	Synchronized synchronized(*this);
+	if (find(fileIndex, properties)) return properties;
+    }
+    if (!probe(path, properties)) return properties;
+    Synchronized synchronized(*this);
+    remember(fileIndex, properties);
+    return properties;
+}
+
+bool Discoverer::probe(char const * path, Properties & properties) throw() {
+    // callers should have already obtained a lock on discoverMutex!
+    GError * error = 0;
+    if (!discoverer && !base.empty()) {
+	discoverer = gst_discoverer_new(5 * GST_SECOND, &error);
+	if (error) {
+	    std::cerr << "discoverer: " << error->message << std::endl;
+	    g_error_free(error);
+	    error = 0;
+	}
+    }
+    if (!discoverer) return false;
+
+    // what could not be discovered (perhaps only this time) is not found
+    bool found = false;
+    gchar * uri = gst_filename_to_uri((base + '/' + path).c_str(), &error);
+    if (uri) {
+	GstDiscovererInfo * info
+	    = gst_discoverer_discover_uri(discoverer, uri, &error);
+	if (info) {
+	    if (GST_DISCOVERER_OK == gst_discoverer_info_get_result(info)) {
+		found = true;
+		GList * streams = gst_discoverer_info_get_audio_streams(info);
+		if (streams) {
+		    GstDiscovererAudioInfo * audio
+			= GST_DISCOVERER_AUDIO_INFO(streams->data);
+		    properties.rate
+			= gst_discoverer_audio_info_get_sample_rate(audio);
+		    properties.channels
+			= gst_discoverer_audio_info_get_channels(audio);
+		    properties.bitrate
+			= gst_discoverer_audio_info_get_bitrate(audio);
+		    if (!properties.bitrate) properties.bitrate
+			= gst_discoverer_audio_info_get_max_bitrate(audio);
+		    GstCaps * caps = gst_discoverer_stream_info_get_caps(
+			GST_DISCOVERER_STREAM_INFO(audio));
+		    if (caps) {
+			gchar * string = gst_caps_to_string(caps);
+			properties.caps = string;
+			g_free(string);
+			gst_caps_unref(caps);
+		    }
+		    gst_discoverer_stream_info_list_free(streams);
+		}
+	    }
+	    gst_discoverer_info_unref(info);
+	}
+	g_free(uri);
+    }
+    if (error) {
+	std::cerr << path << ": " << error->message << std::endl;
+	g_error_free(error);
+    }
+    return found;
+}
+
+void Discoverer::run() throw() {
+    boost::system_time saved = boost::get_system_time();
+    for (;;) {
+	Queue::value_type next;
+	bool discovering = false;
+	{
+	    Synchronized synchronized(*this);
+	    boost::system_time due
+		= saved + boost::posix_time::seconds(saveInterval);
+	    while (!stop && queue.empty()
+		    && boost::get_system_time() < due) {
+		synchronized.wait(due);
+	    }
+	    if (stop) return;
+	    if (!queue.empty()) {
+		next = queue.front();
+		queue.pop_front();
+		discovering = true;
+	    }
+	}
+	if (discovering) {
+	    discover(next.first, next.second.c_str());
+	    Synchronized synchronized(*this);
+	    queued.erase(next.first);
+	}
+	if (saved + boost::posix_time::seconds(saveInterval)
+		<= boost::get_system_time()) {
+	    save();
+	    saved = boost::get_system_time();
+	}
+    }
+}
@@ -0,0 +1,97 @@
+/// \file
+/// Declaration of the Discoverer class.
+/// <p>
+/// Copyright (c) 2009 Ross Tyler.
+/// This file may be copied under the terms of the
+/// GNU Lesser General Public License (LGPL).
+/// See COPYING file for details.
+
+#ifndef Discoverer_h_
+#define Discoverer_h_
+
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <gst/pbutils/pbutils.h>
+
+#include "FileIndex.h"
+#include "Synchronizable.h"
+
+/// A Discoverer discovers what the content of source files under a base
+/// directory has (using a GstDiscoverer) so that transcode mappings
+/// can be chosen by it.
+/// What is discovered is cached, for a limited number of files
+/// (forgetting the least recently used), by FileIndex so that it is only
+/// discovered once.
+/// A discovery that fails (or times out) is not cached, so it is tried
+/// again when next needed.
+/// If given a persist directory, what is cached is remembered there
+/// (in a file named discovered) from one Discoverer to the next,
+/// saved periodically (and when destroyed).
+/// Discoveries are made one at a time, without keeping others from
+/// what has been cached, and may be made in the background by our thread
+/// (which also saves) for those that cannot wait.
+class Discoverer : private Synchronizable<boost::mutex> {
+public:
+
+    /// Discoverer::Properties are those of the first audio stream of a
+    /// source file.
+    /// A property that could not be discovered is 0.
+    struct Properties {
+	unsigned	rate;		///< Sample rate
+	unsigned	channels;	///< Number of channels
+	unsigned	bitrate;	///< Bitrate
+	std::string	caps;		///< Capabilities, as a string
+	Properties() throw();
+    };
+
+    Discoverer(int baseFd, size_t countLimit, int persistFd = -1,
+	time_t saveInterval = 5 * 60) throw();
+    ~Discoverer() throw();
+
+    /// Discover the Properties of the source file, relative to our base,
+    /// identified by fileIndex.
+    Properties discover(FileIndex fileIndex, char const * path) throw();
+
+    /// Get the Properties of the source file, relative to our base,
+    /// identified by fileIndex, if they have been discovered.
+    /// If not, they are discovered in the background.
+    /// \return True if they have been.
+    bool discovered(FileIndex fileIndex, char const * path,
+	Properties & properties) throw();
+
+private:
+    typedef std::list<std::pair<FileIndex, Properties> > List;
+    typedef std::map<FileIndex, List::iterator> Map;
+    typedef std::deque<std::pair<FileIndex, std::string> > Queue;
+    List		list;		///< Least Recently Used first
+    Map			map;		///< Those in list by FileIndex
+    Queue		queue;		///< To discover in the background
+    std::set<FileIndex>	queued;		///< Those in queue or being discovered
+    std::string		base;		///< Location of our base directory
+    size_t		countLimit;	///< Cache no more than this
+    int			persistFd;	///< Remember what is cached here
+    time_t		saveInterval;
+    bool		changed;	///< Since we last saved
+    bool		stop;
+    boost::mutex	discoverMutex;	///< Guards discoverer
+    GstDiscoverer *	discoverer;	///< Created when first needed
+    boost::thread	thread;		///< Discovers in background and saves
+
+    bool find(FileIndex fileIndex, Properties & properties) throw();
+    void remember(FileIndex fileIndex, Properties const & properties)
+	throw();
+    bool probe(char const * path, Properties & properties) throw();
+    void load() throw();
+    void save() throw();
+    void run() throw();
+};
+
+#endif
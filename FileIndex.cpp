@@ -8,8 +8,13 @@
 
 #include "FileIndex.h"
 
-FileIndex::FileIndex(struct stat const & st) throw()
-: fileSystem(st.st_dev), inode(st.st_ino), time(st.st_mtime) {}
+FileIndex::FileIndex(struct stat const & st, unsigned variant_) throw()
+:
+    fileSystem(st.st_dev),
+    inode(st.st_ino),
+    time(st.st_mtime),
+    variant(variant_)
+{}
 
 bool FileIndex::operator < (FileIndex const & that) const throw() {
 	return fileSystem < that.fileSystem
@@ -22,7 +27,9 @@ bool FileIndex::operator < (FileIndex const & that) const throw() {
 			? false
 			: time < that.time
 			    ? true
-			    : false;
+			    : time > that.time
+				? false
+				: variant < that.variant;
 
 }
 
@@ -41,6 +48,7 @@ std::ostream & operator <<(std::ostream & s, FileIndex & fileIndex) throw() {
     s		<< fileIndex.fileSystem
 	<< '.'	<< fileIndex.inode
 	<< '.'	<< fileIndex.time;
+    if (fileIndex.variant) s << '.' << fileIndex.variant;
     return s;
 }
 
@@ -49,5 +57,7 @@ std::istream & operator >>(std::istream & s, FileIndex & fileIndex) throw() {
     s		>> fileIndex.fileSystem
 	>> d	>> fileIndex.inode
 	>> d	>> fileIndex.time;
+    fileIndex.variant = 0;
+    if (s && !s.eof() && '.' == s.peek()) s >> d >> fileIndex.variant;
     return s;
 }
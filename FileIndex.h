@@ -18,13 +18,16 @@
 /// This indexing information is constructed directly from a stat(2) struct.
 /// This indexing information is much better than a simple path name
 /// for identifying file content.
+/// A nonzero variant distinguishes one of several targets
+/// made from the same file.
 class FileIndex {
 public:
     dev_t		fileSystem;	///< from stat st_dev
     ino_t		inode;		///< from stat st_ino
     time_t		time;		///< from stat st_mtime
-    FileIndex() throw() : fileSystem(0), inode(0), time(0) {}
-    FileIndex(struct stat const & st) throw();
+    unsigned		variant;	///< target made from the file
+    FileIndex() throw() : fileSystem(0), inode(0), time(0), variant(0) {}
+    FileIndex(struct stat const & st, unsigned variant = 0) throw();
     bool operator < (FileIndex const &) const throw();
 };
 
@@ -13,6 +13,8 @@
 #include <sys/stat.h>
 
 #include "FileReader.h"
+#include "Metrics.h"
+#include "readlink.h"
 
 FileReader::FileReader(FileIndex fileIndex_, int fd_) throw()
 :
@@ -27,7 +29,9 @@ FileReader::FileReader(FileIndex fileIndex_, int fd_) throw()
 /*virtual*/ ssize_t FileReader::read(
 	char * buffer, size_t size, off_t offset) throw() {
     ssize_t result = pread(fd, buffer, size, offset);
-    return -1 == result ? -errno : result;
+    if (-1 == result) return -errno;
+    Metrics::fileReaderBytes += result;
+    return result;
 }
 
 /*virtual*/ size_t FileReader::size(bool wait) throw() {
@@ -35,3 +39,11 @@ FileReader::FileReader(FileIndex fileIndex_, int fd_) throw()
     if (-1 == fstat(fd, &st)) return 0;
     return st.st_size;
 }
+
+/*virtual*/ std::string FileReader::location() throw() {
+    try {
+	return readlink(fd).get();
+    } catch (Exception::Error &) {
+	return std::string();
+    }
+}
@@ -24,6 +24,8 @@ public:
     virtual ssize_t read(char * buffer, size_t size, off_t offset) throw();
 
     virtual size_t size(bool wait) throw();
+
+    virtual std::string location() throw();
 };
 
 #endif
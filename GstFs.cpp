@@ -7,14 +7,23 @@
 /// See COPYING file for details.
 
 #include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <sstream>
 
+#include <unistd.h>
+
 #include <glib.h>
 
 #include "GstFs.h"
+#include "ImageReader.h"
+#include "Metrics.h"
 #include "Utility.h"
 
 static intptr_t getPhysicalMemorySize() {
@@ -22,6 +31,76 @@ static intptr_t getPhysicalMemorySize() {
        *  (intptr_t) sysconf(_SC_PHYS_PAGES);
 }
 
+/// Parse a limit that can be changed while we run (see ReaderFactory::tune)
+/// from arg into the one it names.
+/// \return 0 if parsed, 1 otherwise (as for fuse_opt_proc_t).
+static int limit(char const * arg, size_t & readAheadLimit,
+	size_t & countLimit, unsigned long long & memoryLimit,
+	time_t & timeLimit) throw() {
+    size_t length;
+    if ((length = Utility::match(arg, "readAhead=", 0))) {
+	std::istringstream in(arg + length);
+	size_t readAhead;
+	if (in >> readAhead) {
+	    readAheadLimit = readAhead;
+	    return 0;
+	}
+    }
+    if ((length = Utility::match(arg, "cacheCount=", 0))) {
+	std::istringstream in(arg + length);
+	size_t cacheCount;
+	if (in >> cacheCount) {
+	    char multiplier;
+	    if (in >> multiplier) {
+		switch (tolower(multiplier)) {
+		case 'k': cacheCount *= 1024; break;
+		case 'm': cacheCount *= 1024 * 1024; break;
+		case 'g': cacheCount *= 1024 * 1024 * 1024; break;
+		}
+	    }
+	    countLimit = cacheCount;
+	    return 0;
+	}
+    }
+    if ((length = Utility::match(arg, "cacheMemory=", 0))) {
+	std::istringstream in(arg + length);
+	unsigned long long cacheMemory;
+	if (in >> cacheMemory) {
+	    char multiplier;
+	    if (in >> multiplier) {
+		switch (tolower(multiplier)) {
+		case 'k': cacheMemory *= 1024; break;
+		case 'm': cacheMemory *= 1024 * 1024; break;
+		case 'g': cacheMemory *= 1024 * 1024 * 1024; break;
+		case '%': cacheMemory *= getPhysicalMemorySize() / 100;
+		}
+	    }
+	    memoryLimit = cacheMemory;
+	    return 0;
+	}
+    }
+    if ((length = Utility::match(arg, "cacheTime=", 0))) {
+	std::istringstream in(arg + length);
+	time_t cacheTime;
+	if (in >> cacheTime) {
+	    char multiplier;
+	    if (in >> multiplier) {
+		switch (tolower(multiplier)) {
+		case 's': break;
+		case 'm': cacheTime *= 60; break;
+		case 'h': cacheTime *= 60 * 60; break;
+		case 'd': cacheTime *= 60 * 60 * 24; break;
+		case 'w': cacheTime *= 60 * 60 * 24 * 7; break;
+		case 'y': cacheTime *= 60 * 60 * 24 * 7 * 52; break;
+		}
+	    }
+	    timeLimit = cacheTime;
+	    return 0;
+	}
+    }
+    return 1;
+}
+
 int GstFs::option(char const * arg, int key, fuse_args * args) throw() {
     switch (key) {
     case FUSE_OPT_KEY_OPT:
@@ -44,78 +123,285 @@ int GstFs::option(char const * arg, int key, fuse_args * args) throw() {
 	    }
 	    return 0;
 	}
+	if ((length = Utility::match(arg, "lazy=", 0))) {
+	    std::istringstream in(arg + length);
+	    unsigned grace;
+	    if (in >> grace) {
+		lazy = true;
+		lazyGrace = grace;
+		return 0;
+	    }
+	}
+	if (0 == strcmp(arg, "lazy")) {
+	    lazy = true;
+	    return 0;
+	}
 	if (Utility::match(arg, "trueSize", 0)) {
 	    trueSize = true;
 	    return 0;
 	}
-	if ((length = Utility::match(arg, "readAhead=", 0))) {
+	{
+	    unsigned long long memoryLimit = imageCacheMemoryLimit;
+	    if (0 == limit(arg, readAheadLimit, imageCacheCountLimit,
+		    memoryLimit, imageCacheTimeLimit)) {
+		imageCacheMemoryLimit = memoryLimit;
+		return 0;
+	    }
+	}
+	if (-1 == imageCachePersistFd
+		&& (length = Utility::match(arg, "cachePersist=", 0))) {
+	    imageCachePersistFd = ::open(arg + length, O_RDONLY);
+	    struct stat st;
+	    fstat(imageCachePersistFd, &st);
+	    if (!S_ISDIR(st.st_mode)) {
+		close(imageCachePersistFd);
+		imageCachePersistFd = -1;
+	    }
+	    return 0;
+	}
+	if ((length = Utility::match(arg, "probeHead=", 0))) {
+	    std::istringstream in(arg + length);
+	    size_t probeHead;
+	    if (in >> probeHead) {
+		char multiplier;
+		if (in >> multiplier) {
+		    switch (tolower(multiplier)) {
+		    case 'k': probeHead *= 1024; break;
+		    case 'm': probeHead *= 1024 * 1024; break;
+		    case 'g': probeHead *= 1024 * 1024 * 1024; break;
+		    }
+		}
+		imageEndsHeadSize = probeHead;
+		return 0;
+	    }
+	}
+	if ((length = Utility::match(arg, "probeTail=", 0))) {
+	    std::istringstream in(arg + length);
+	    size_t probeTail;
+	    if (in >> probeTail) {
+		char multiplier;
+		if (in >> multiplier) {
+		    switch (tolower(multiplier)) {
+		    case 'k': probeTail *= 1024; break;
+		    case 'm': probeTail *= 1024 * 1024; break;
+		    case 'g': probeTail *= 1024 * 1024 * 1024; break;
+		    }
+		}
+		imageEndsTailSize = probeTail;
+		return 0;
+	    }
+	}
+	if ((length = Utility::match(arg, "probeCount=", 0))) {
 	    std::istringstream in(arg + length);
-	    size_t readAhead;
-	    if (in >> readAhead) {\
-		readAheadLimit = readAhead;
+	    size_t probeCount;
+	    if (in >> probeCount) {
+		char multiplier;
+		if (in >> multiplier) {
+		    switch (tolower(multiplier)) {
+		    case 'k': probeCount *= 1024; break;
+		    case 'm': probeCount *= 1024 * 1024; break;
+		    case 'g': probeCount *= 1024 * 1024 * 1024; break;
+		    }
+		}
+		imageEndsCountLimit = probeCount;
 		return 0;
 	    }
 	}
-	if ((length = Utility::match(arg, "cacheCount=", 0))) {
+	if ((length = Utility::match(arg, "discoveryCount=", 0))) {
 	    std::istringstream in(arg + length);
-	    size_t cacheCount;
-	    if (in >> cacheCount) {
+	    size_t discoveryCount;
+	    if (in >> discoveryCount) {
 		char multiplier;
 		if (in >> multiplier) {
 		    switch (tolower(multiplier)) {
-		    case 'k': cacheCount *= 1024; break;
-		    case 'm': cacheCount *= 1024 * 1024; break;
-		    case 'g': cacheCount *= 1024 * 1024 * 1024; break;
+		    case 'k': discoveryCount *= 1024; break;
+		    case 'm': discoveryCount *= 1024 * 1024; break;
+		    case 'g': discoveryCount *= 1024 * 1024 * 1024; break;
 		    }
 		}
-		imageCacheCountLimit = cacheCount;
+		discoveryCountLimit = discoveryCount;
 		return 0;
 	    }
 	}
-	if ((length = Utility::match(arg, "cacheMemory=", 0))) {
+	if ((length = Utility::match(arg, "spill=", 0))) {
 	    std::istringstream in(arg + length);
-	    unsigned long long cacheMemory;
-	    if (in >> cacheMemory) {
+	    size_t spill;
+	    if (in >> spill) {
 		char multiplier;
 		if (in >> multiplier) {
 		    switch (tolower(multiplier)) {
-		    case 'k': cacheMemory *= 1024; break;
-		    case 'm': cacheMemory *= 1024 * 1024; break;
-		    case 'g': cacheMemory *= 1024 * 1024 * 1024; break;
-		    case '%': cacheMemory *= getPhysicalMemorySize() / 100;
+		    case 'k': spill *= 1024; break;
+		    case 'm': spill *= 1024 * 1024; break;
+		    case 'g': spill *= 1024 * 1024 * 1024; break;
 		    }
 		}
-		imageCacheMemoryLimit = cacheMemory;
+		imageSpillSize = spill;
+		return 0;
+	    }
+	}
+	if ((length = Utility::match(arg, "finish=", 0))) {
+	    std::istringstream in(arg + length);
+	    double finish;
+	    if (in >> finish) {
+		finishProgress = finish / 100;
 		return 0;
 	    }
 	}
-	if ((length = Utility::match(arg, "cacheTime=", 0))) {
+	if ((length = Utility::match(arg, "finishTime=", 0))) {
 	    std::istringstream in(arg + length);
-	    time_t cacheTime;
-	    if (in >> cacheTime) {
+	    double finishTime;
+	    if (in >> finishTime) {
 		char multiplier;
 		if (in >> multiplier) {
 		    switch (tolower(multiplier)) {
 		    case 's': break;
-		    case 'm': cacheTime *= 60; break;
-		    case 'h': cacheTime *= 60 * 60; break;
-		    case 'd': cacheTime *= 60 * 60 * 24; break;
-		    case 'w': cacheTime *= 60 * 60 * 24 * 7; break;
-		    case 'y': cacheTime *= 60 * 60 * 24 * 7 * 52; break;
+		    case 'm': finishTime *= 60; break;
+		    case 'h': finishTime *= 60 * 60; break;
 		    }
 		}
-		imageCacheTimeLimit = cacheTime;
+		finishRemaining = finishTime;
 		return 0;
 	    }
 	}
-	if (-1 == imageCachePersistFd
-		&& (length = Utility::match(arg, "cachePersist=", 0))) {
-	    imageCachePersistFd = ::open(arg + length, O_RDONLY);
+	if ((length = Utility::match(arg, "backoff=", 0))) {
+	    std::istringstream in(arg + length);
+	    double backoff;
+	    if (in >> backoff) {
+		char multiplier;
+		if (in >> multiplier) {
+		    switch (tolower(multiplier)) {
+		    case 's': break;
+		    case 'm': backoff *= 60; break;
+		    case 'h': backoff *= 60 * 60; break;
+		    }
+		}
+		backoffLimit = backoff;
+		return 0;
+	    }
+	}
+	if (0 == strcmp(arg, "fallback")) {
+	    fallback = true;
+	    return 0;
+	}
+	if (0 == strcmp(arg, "timing")) {
+	    timing = true;
+	    return 0;
+	}
+	if ((length = Utility::match(arg, "control=", 0))) {
+	    controlPath = arg + length;
+	    // we might daemonize and change our working directory
+	    // so resolve a relative path now.
+	    if ('/' != controlPath[0]) {
+		char cwd[PATH_MAX];
+		if (getcwd(cwd, sizeof cwd)) {
+		    controlPath = std::string(cwd) + '/' + controlPath;
+		}
+	    }
+	    return 0;
+	}
+	if ((length = Utility::match(arg, "popularity=", 0))) {
+	    popularityPath = arg + length;
+	    if ('/' != popularityPath[0]) {
+		char cwd[PATH_MAX];
+		if (getcwd(cwd, sizeof cwd)) {
+		    popularityPath = std::string(cwd) + '/' + popularityPath;
+		}
+	    }
+	    return 0;
+	}
+	if ((length = Utility::match(arg, "popularityHalfLife=", 0))) {
+	    std::istringstream in(arg + length);
+	    double halfLife;
+	    if (in >> halfLife) {
+		char multiplier;
+		if (in >> multiplier) {
+		    switch (tolower(multiplier)) {
+		    case 's': break;
+		    case 'm': halfLife *= 60; break;
+		    case 'h': halfLife *= 60 * 60; break;
+		    case 'd': halfLife *= 24 * 60 * 60; break;
+		    }
+		}
+		popularityHalfLife = halfLife;
+		return 0;
+	    }
+	}
+	if ((length = Utility::match(arg, "warmup=", 0))) {
+	    std::istringstream in(arg + length);
+	    size_t warmup;
+	    if (in >> warmup) {
+		warmupCount = warmup;
+		return 0;
+	    }
+	}
+	if ((length = Utility::match(arg, "warmupJobs=", 0))) {
+	    std::istringstream in(arg + length);
+	    unsigned jobs;
+	    if (in >> jobs) {
+		warmupJobs = jobs;
+		return 0;
+	    }
+	}
+	if ((length = Utility::match(arg, "warmupMemory=", 0))) {
+	    std::istringstream in(arg + length);
+	    unsigned long long memory;
+	    if (in >> memory) {
+		char multiplier;
+		if (in >> multiplier) {
+		    switch (tolower(multiplier)) {
+		    case 'k': memory *= 1024; break;
+		    case 'm': memory *= 1024 * 1024; break;
+		    case 'g': memory *= 1024 * 1024 * 1024; break;
+		    case '%': memory *= getPhysicalMemorySize() / 100;
+		    }
+		}
+		warmupMemory = memory;
+		return 0;
+	    }
+	}
+	if ((length = Utility::match(arg, "handoff=", 0))) {
+	    handoffPath = arg + length;
+	    if ('/' != handoffPath[0]) {
+		char cwd[PATH_MAX];
+		if (getcwd(cwd, sizeof cwd)) {
+		    handoffPath = std::string(cwd) + '/' + handoffPath;
+		}
+	    }
+	    return 0;
+	}
+	if ((length = Utility::match(arg, "handoffTime=", 0))) {
+	    std::istringstream in(arg + length);
+	    time_t handoffTime_;
+	    if (in >> handoffTime_) {
+		char multiplier;
+		if (in >> multiplier) {
+		    switch (tolower(multiplier)) {
+		    case 's': break;
+		    case 'm': handoffTime_ *= 60; break;
+		    }
+		}
+		handoffTime = handoffTime_;
+		return 0;
+	    }
+	}
+	if ((length = Utility::match(arg, "record=", 0))) {
+	    recordPath = arg + length;
+	    if ('/' != recordPath[0]) {
+		char cwd[PATH_MAX];
+		if (getcwd(cwd, sizeof cwd)) {
+		    recordPath = std::string(cwd) + '/' + recordPath;
+		}
+	    }
+	    return 0;
+	}
+	if (-1 == imageSpillFd
+		&& (length = Utility::match(arg, "spillDirectory=", 0))) {
+	    imageSpillFd = ::open(arg + length, O_RDONLY);
 	    struct stat st;
-	    fstat(imageCachePersistFd, &st);
+	    fstat(imageSpillFd, &st);
 	    if (!S_ISDIR(st.st_mode)) {
-		close(imageCachePersistFd);
-		imageCachePersistFd = -1;
+		close(imageSpillFd);
+		imageSpillFd = -1;
 	    }
 	    return 0;
 	}
@@ -156,7 +442,34 @@ GstFs::GstFs(int argc_, char ** argv_) throw(std::runtime_error)
     imageCacheMemoryLimit(getPhysicalMemorySize() / 4),
     imageCacheTimeLimit(60 * 60),
     imageCachePersistFd(-1),
-    readerFactory(0)
+    imageEndsHeadSize(64 * 1024),
+    imageEndsTailSize(128),
+    imageEndsCountLimit(1024),
+    imageSpillSize(0),
+    imageSpillFd(-1),
+    finishProgress(1),
+    finishRemaining(0),
+    lazy(false),
+    lazyGrace(0),
+    backoffLimit(60 * 60),
+    fallback(false),
+    discoveryCountLimit(4096),
+    timing(false),
+    controlPath(),
+    recordPath(),
+    popularityPath(),
+    popularityHalfLife(24 * 60 * 60),
+    warmupCount(50),
+    warmupJobs(1),
+    // (by default) half of imageCacheMemoryLimit, as it will be
+    warmupMemory(std::numeric_limits<unsigned long long>::max()),
+    handoffPath(),
+    handoffTime(10),
+    readerFactory(0),
+    control(0),
+    recorder(0),
+    popularity(0),
+    handoff(0)
 {
     fuse_args args = FUSE_ARGS_INIT(argc, argv);
     fuse_opt_parse(&args, this, 0, option_);
@@ -169,16 +482,31 @@ GstFs::GstFs(int argc_, char ** argv_) throw(std::runtime_error)
     if (transcodeMapping.builder.pending()) {
 	throw std::runtime_error("transcode mapping specification incomplete");
     }
+    // parse every pipeline now, before we might daemonize,
+    // so that mistakes are reported where they can be seen
+    // and so that the plugins they need are loaded before first use.
+    if (transcodeMapping.prepare(std::cerr, timing)) {
+	throw std::runtime_error("transcode pipeline specification invalid");
+    }
     argc = args.argc;
     argv = args.argv;
 }
 
 /*virtual*/ GstFs::~GstFs() throw() {
+    // stop taking commands for our readerFactory before it goes
+    if (control) delete control;
+    if (recorder) delete recorder;
+    // stop adopting images into our readerFactory before it goes
+    if (handoff) handoff->stopTaking();
     if (readerFactory) delete readerFactory;
+    // after our readerFactory, which uses them
+    if (popularity) delete popularity;
+    if (handoff) delete handoff;
     if (loopThread) delete loopThread;
     if (base) free(const_cast<char *>(base));
     close(baseFd);
     close(imageCachePersistFd);
+    close(imageSpillFd);
 }
 
 int GstFs::main() throw() {
@@ -191,6 +519,9 @@ int GstFs::main() throw() {
     ops.release		= release_;
     ops.releasedir	= releasedir_;
     ops.read		= read_;
+    ops.getxattr	= getxattr_;
+    ops.listxattr	= listxattr_;
+    ops.setxattr	= setxattr_;
     return fuse_main(argc, argv, &ops, this);
 }
 
@@ -198,12 +529,104 @@ static GstFs * that() throw() {
     return reinterpret_cast<GstFs *>(fuse_get_context()->private_data);
 }
 
+/// The (hidden) directory of our virtual files,
+/// the path of our metrics file in it and its name there.
+static char const virtualDirectory[] = ".gstfs";
+static char const metricsPath[] = ".gstfs/metrics";
+static char const * const metricsName = metricsPath + sizeof virtualDirectory;
+
+Reader * GstFs::metrics() throw() {
+    // take a snapshot of our metrics in an image to be read
+    std::ostringstream out;
+    Metrics::write(out);
+    readerFactory->metrics(out);
+    std::string text = out.str();
+    Image * image = new Image(0);
+    image->append(text.data(), text.size());
+    return new ImageReader(FileIndex(), ImageConstPointer(image));
+}
+
+std::string GstFs::command(std::string const & line) throw() {
+    std::istringstream in(line);
+    std::string verb;
+    in >> verb;
+    std::string argument;
+    std::getline(in >> std::ws, argument);
+    // paths are relative to our mount point
+    char const * path = argument.c_str();
+    while ('/' == *path) ++path;
+    std::ostringstream out;
+    if (verb.empty()) {
+	return std::string();
+    } else if ("status" == verb) {
+	readerFactory->status(out);
+    } else if ("set" == verb) {
+	// only what our readerFactory can change while it runs.
+	// our own options are not ours to change now (they are not guarded)
+	// so change a copy of what it uses.
+	size_t readAheadLimit;
+	size_t countLimit;
+	unsigned long long memoryLimit;
+	time_t timeLimit;
+	readerFactory->tuning(readAheadLimit,
+	    countLimit, memoryLimit, timeLimit);
+	if (limit(path, readAheadLimit, countLimit, memoryLimit, timeLimit)) {
+	    return "error: cannot set " + argument + "\n";
+	}
+	readerFactory->tune(readAheadLimit, countLimit, memoryLimit, timeLimit);
+    } else if ("pin" == verb || "unpin" == verb) {
+	if (!readerFactory->pin(path, "pin" == verb)) {
+	    return "error: " + argument + " is not cached"
+		+ ("pin" == verb ? "" : " and pinned") + "\n";
+	}
+    } else if ("evict" == verb) {
+	if (!readerFactory->evict(path)) {
+	    return "error: " + argument + " is not cached\n";
+	}
+    } else if ("flush" == verb) {
+	readerFactory->flush();
+    } else if ("help" == verb) {
+	out << "status\n"
+	    "set readAhead=N|cacheCount=N|cacheMemory=N|cacheTime=N\n"
+	    "pin PATH\n"
+	    "unpin PATH\n"
+	    "evict PATH\n"
+	    "flush\n";
+    } else {
+	return "error: unknown command " + verb + "\n";
+    }
+    out << "ok\n";
+    return out.str();
+}
+
 int GstFs::getattr(char const * path, struct stat * st) throw() {
     ++path;
+    if (0 == strcmp(path, virtualDirectory)
+	    || 0 == strcmp(path, metricsPath)) {
+	// our virtual files are owned as our base is
+	if (-1 == fstat(baseFd, st)) return -errno;
+	if (0 == strcmp(path, metricsPath)) {
+	    // its size is not known until it is opened
+	    st->st_mode = S_IFREG | 0444;
+	    st->st_nlink = 1;
+	    st->st_size = 0;
+	    st->st_mtime = time(0);
+	} else {
+	    st->st_mode = S_IFDIR | 0555;
+	}
+	return 0;
+    }
     return readerFactory->stat(path, st);
 }
 /*static*/ int GstFs::getattr_(char const * path, struct stat * st) throw() {
-    return that()->getattr(path, st);
+    Metrics::Timer timer(Metrics::getattrSeconds);
+    GstFs * gstFs = that();
+    double began = Utility::now();
+    int result = gstFs->getattr(path, st);
+    if (gstFs->recorder) {
+	gstFs->recorder->record(Recorder::GETATTR, path, began, result);
+    }
+    return result;
 }
 
 void GstFs::LoopThread::run() throw() {
@@ -236,8 +659,65 @@ void * GstFs::init(fuse_conn_info * conn) throw() {
 	imageCacheCountLimit,
 	imageCacheMemoryLimit,
 	imageCacheTimeLimit,
-	imageCachePersistFd);
+	imageCachePersistFd,
+	imageEndsHeadSize,
+	imageEndsTailSize,
+	imageEndsCountLimit,
+	imageSpillSize,
+	// spill to the spillDirectory or, by default, the cachePersist one
+	!imageSpillSize
+	    ? -1
+	    : -1 != imageSpillFd
+		? imageSpillFd
+		: imageCachePersistFd,
+	finishProgress,
+	finishRemaining,
+	lazy,
+	lazyGrace,
+	backoffLimit,
+	fallback,
+	discoveryCountLimit);
+    if (!handoffPath.empty()) {
+	// take the images of a predecessor (in the background)
+	// then offer ours in turn
+	try {
+	    handoff = new Handoff(handoffPath, handoffTime,
+		boost::bind(&ReaderFactory::adopt, readerFactory,
+		    boost::placeholders::_1, boost::placeholders::_2,
+		    boost::placeholders::_3, boost::placeholders::_4));
+	    readerFactory->handOffTo(handoff);
+	} catch (std::exception & e) {
+	    std::cerr << "handoff: " << e.what() << std::endl;
+	}
+    }
+    // our readerFactory knows which transcode mappings to select
+    transcodeMapping.select = boost::bind(&ReaderFactory::select,
+	readerFactory, boost::placeholders::_1, boost::placeholders::_2,
+	boost::placeholders::_3);
     loopThread = new LoopThread();
+    if (!popularityPath.empty()) {
+	// warm what was popular (with our loopThread to run transcodings)
+	popularity = new Popularity(popularityPath, popularityHalfLife);
+	readerFactory->popular(popularity, warmupCount, warmupJobs,
+	    std::numeric_limits<unsigned long long>::max() == warmupMemory
+		? imageCacheMemoryLimit / 2
+		: warmupMemory);
+    }
+    if (!controlPath.empty()) {
+	try {
+	    control = new Control(controlPath,
+		boost::bind(&GstFs::command, this, boost::placeholders::_1));
+	} catch (std::exception & e) {
+	    std::cerr << "control: " << e.what() << std::endl;
+	}
+    }
+    if (!recordPath.empty()) {
+	try {
+	    recorder = new Recorder(recordPath);
+	} catch (std::exception & e) {
+	    std::cerr << "record: " << e.what() << std::endl;
+	}
+    }
     return this;
 }
 /*static*/ void * GstFs::init_(fuse_conn_info * conn) throw() {
@@ -247,6 +727,11 @@ void * GstFs::init(fuse_conn_info * conn) throw() {
 int GstFs::opendir(
 	char const * path, fuse_file_info * info) throw() {
     ++path;
+    if (0 == strcmp(path, virtualDirectory)) {
+	// it is listed without a DIR
+	info->fh = 0;
+	return 0;
+    }
     // if there is no path then we need to reopen the base directory
     // we cannot use a dup of baseFd because all readers would end up sharing
     // the same file offset!
@@ -264,12 +749,19 @@ int GstFs::opendir(
 }
 /*static*/ int GstFs::opendir_(
 	char const* path, fuse_file_info * info) throw() {
+    Metrics::Timer timer(Metrics::opendirSeconds);
     return that()->opendir(path, info);
 }
 
 int GstFs::open(char const * path, fuse_file_info * info) throw() {
     if (O_RDONLY != (info->flags & O_ACCMODE)) return -EACCES;
     ++path;
+    if (0 == strcmp(path, metricsPath)) {
+	info->fh = reinterpret_cast<intptr_t>(metrics());
+	// read it to its end, regardless of its (unknown) size
+	info->direct_io = 1;
+	return 0;
+    }
     if (!*path
 	    || !(info->fh = reinterpret_cast<intptr_t>(
 		readerFactory->open(path))))
@@ -277,7 +769,15 @@ int GstFs::open(char const * path, fuse_file_info * info) throw() {
     return 0;
 }
 /*static*/ int GstFs::open_(char const * path, fuse_file_info * info) throw() {
-    return that()->open(path, info);
+    Metrics::Timer timer(Metrics::openSeconds);
+    GstFs * gstFs = that();
+    double began = Utility::now();
+    int result = gstFs->open(path, info);
+    if (gstFs->recorder) {
+	gstFs->recorder->record(Recorder::OPEN, path, began, result,
+	    0, 0, result ? 0 : info->fh);
+    }
+    return result;
 }
 
 int GstFs::read(
@@ -288,52 +788,212 @@ int GstFs::read(
 /*static*/ int GstFs::read_(
 	char const * path, char * buffer, size_t size, off_t offset,
 	fuse_file_info * info) throw() {
-    return that()->read(path, buffer, size, offset, info);
+    Metrics::Timer timer(Metrics::readSeconds);
+    GstFs * gstFs = that();
+    double began = Utility::now();
+    int result = gstFs->read(path, buffer, size, offset, info);
+    if (gstFs->recorder) {
+	gstFs->recorder->record(Recorder::READ, path, began, result,
+	    offset, size, info->fh);
+    }
+    return result;
 }
 
 int GstFs::readdir(
 	char const * path, void * buffer, fuse_fill_dir_t filler, off_t offset,
 	fuse_file_info * info) throw() {
     ++path;
+    if (0 == strcmp(path, virtualDirectory)) {
+	// (it is not listed in our root so it stays hidden)
+	char const * const names[] = {".", "..", metricsName};
+	for (size_t i = 0; i < sizeof names / sizeof *names; ++i) {
+	    if (filler(buffer, names[i], 0, 0)) break;
+	}
+	return 0;
+    }
     DIR * dir = reinterpret_cast<DIR *>(info->fh);
+    // the source path of each entry (relative to base) is built in
+    // sourcePath after path and its target path is mapped from it.
+    char sourcePath[PATH_MAX];
+    char targetPath[PATH_MAX];
+    size_t pathLength = *path
+	? snprintf(sourcePath, sizeof sourcePath, "%s/", path) : 0;
     while (dirent * dirent = ::readdir(dir)) {
-	boost::shared_ptr<char const> target(
-	    transcodeMapping.targetFrom(dirent->d_name, 0));
-	if (target.get() != dirent->d_name) {
-	    std::string targetPath(path);
-	    targetPath += '/';
-	    targetPath += target.get();
-	    readerFactory->readAhead(targetPath.c_str());
-	}
+	char const * name = dirent->d_name;
+	size_t nameLength = strlen(name);
 	struct stat st;
 	memset(&st, 0, sizeof st);
 	st.st_ino = dirent->d_ino;
-	if (filler(buffer, target.get(), &st, 0)) break;
+	if (pathLength + nameLength < sizeof sourcePath) {
+	    memcpy(sourcePath + pathLength, name, nameLength + 1);
+	    // a source may map to several targets.
+	    // only the first is read ahead.
+	    size_t position = 0;
+	    char const * target = transcodeMapping.targetFrom(sourcePath,
+		targetPath, sizeof targetPath, 0, &position);
+	    if (target != sourcePath) {
+		readerFactory->readAhead(target);
+		do {
+		    if (filler(buffer, target + pathLength, &st, 0)) return 0;
+		    target = transcodeMapping.targetFrom(sourcePath,
+			targetPath, sizeof targetPath, 0, &position);
+		} while (target != sourcePath);
+		continue;
+	    }
+	}
+	if (filler(buffer, name, &st, 0)) break;
     }
     return 0;
 }
 /*static*/ int GstFs::readdir_(
 	char const * path, void * buffer, fuse_fill_dir_t filler, off_t offset,
 	fuse_file_info * info) throw() {
-    return that()->readdir(path, buffer, filler, offset, info);
+    Metrics::Timer timer(Metrics::readdirSeconds);
+    GstFs * gstFs = that();
+    double began = Utility::now();
+    int result = gstFs->readdir(path, buffer, filler, offset, info);
+    if (gstFs->recorder) {
+	gstFs->recorder->record(Recorder::READDIR, path, began, result);
+    }
+    return result;
 }
 
 int GstFs::release(
 	char const * path, fuse_file_info * info) throw() {
+    if (0 == strcmp(path + 1, metricsPath)) {
+	// our readerFactory knows nothing of it
+	delete reinterpret_cast<Reader *>(info->fh);
+	return 0;
+    }
     readerFactory->release(reinterpret_cast<Reader *>(info->fh));
     return 0;
 }
 /*static*/ int GstFs::release_(
 	char const * path, fuse_file_info * info) throw() {
-    return that()->release(path, info);
+    Metrics::Timer timer(Metrics::releaseSeconds);
+    GstFs * gstFs = that();
+    double began = Utility::now();
+    int result = gstFs->release(path, info);
+    if (gstFs->recorder) {
+	gstFs->recorder->record(Recorder::RELEASE, path, began, result,
+	    0, 0, info->fh);
+    }
+    return result;
 }
 
 int GstFs::releasedir(
 	char const * path, fuse_file_info * info) throw() {
+    // our virtual directory has no DIR
+    if (!info->fh) return 0;
     return -1 == closedir(reinterpret_cast<DIR *>(info->fh))
 	? -errno : 0;
 }
 /*static*/ int GstFs::releasedir_(
 	char const * path, fuse_file_info * info) throw() {
+    Metrics::Timer timer(Metrics::releasedirSeconds);
     return that()->releasedir(path, info);
 }
+
+/// The names of our extended attributes.
+static char const xattrState[]		= "user.gstfs.state";
+static char const xattrProgress[]	= "user.gstfs.progress";
+static char const xattrTrueSize[]	= "user.gstfs.true_size";
+static char const xattrEta[]		= "user.gstfs.eta";
+static char const xattrPrefetch[]	= "user.gstfs.prefetch";
+
+/// Copy value to buffer of size, if there is room.
+/// A size of 0 asks only for how much room is needed.
+/// \return The size of value or -ERANGE if there is not enough room
+static int xattrCopy(std::string const & value, char * buffer, size_t size)
+	throw() {
+    if (!size) return value.size();
+    if (size < value.size()) return -ERANGE;
+    memcpy(buffer, value.data(), value.size());
+    return value.size();
+}
+
+int GstFs::getxattr(
+	char const * path, char const * name, char * value, size_t size)
+	throw() {
+    ReaderFactory::State state;
+    if (!readerFactory->state(path + 1, state)) return -ENODATA;
+    std::ostringstream out;
+    if (0 == strcmp(name, xattrState)) {
+	out << state.name;
+    } else if (0 == strcmp(name, xattrProgress)) {
+	out << state.progress;
+    } else if (0 == strcmp(name, xattrTrueSize) && 0 <= state.size) {
+	out << state.size;
+    } else if (0 == strcmp(name, xattrEta) && state.remaining < HUGE_VAL) {
+	out << static_cast<unsigned long>(state.remaining + .5);
+    } else {
+	return -ENODATA;
+    }
+    return xattrCopy(out.str(), value, size);
+}
+/*static*/ int GstFs::getxattr_(
+	char const * path, char const * name, char * value, size_t size)
+	throw() {
+    Metrics::Timer timer(Metrics::getxattrSeconds);
+    GstFs * gstFs = that();
+    double began = Utility::now();
+    int result = gstFs->getxattr(path, name, value, size);
+    if (gstFs->recorder) {
+	gstFs->recorder->record(Recorder::GETXATTR, path, began, result,
+	    0, size, 0, name);
+    }
+    return result;
+}
+
+int GstFs::listxattr(char const * path, char * list, size_t size) throw() {
+    ReaderFactory::State state;
+    if (!readerFactory->state(path + 1, state)) return 0;
+    // list only those that getxattr would answer now
+    std::string names;
+    names.append(xattrState, sizeof xattrState);
+    names.append(xattrProgress, sizeof xattrProgress);
+    if (0 <= state.size) names.append(xattrTrueSize, sizeof xattrTrueSize);
+    if (state.remaining < HUGE_VAL) names.append(xattrEta, sizeof xattrEta);
+    return xattrCopy(names, list, size);
+}
+/*static*/ int GstFs::listxattr_(char const * path, char * list, size_t size)
+	throw() {
+    Metrics::Timer timer(Metrics::listxattrSeconds);
+    GstFs * gstFs = that();
+    double began = Utility::now();
+    int result = gstFs->listxattr(path, list, size);
+    if (gstFs->recorder) {
+	gstFs->recorder->record(Recorder::LISTXATTR, path, began, result,
+	    0, size);
+    }
+    return result;
+}
+
+int GstFs::setxattr(
+	char const * path, char const * name, char const * value, size_t size,
+	int flags) throw() {
+    if (0 != strcmp(name, xattrPrefetch)) return -ENOTSUP;
+    ReaderFactory::State state;
+    if (!readerFactory->state(path + 1, state)) return -ENOTSUP;
+    // whatever its value, start transcoding it in the background
+    // (regardless of our readAhead limit) if it is cold
+    // (or might be, once what its source has is discovered).
+    if (0 == strcmp(state.name, "cold")
+	    || 0 == strcmp(state.name, "discovering")) {
+	readerFactory->readAhead(path + 1, true);
+    }
+    return 0;
+}
+/*static*/ int GstFs::setxattr_(
+	char const * path, char const * name, char const * value, size_t size,
+	int flags) throw() {
+    Metrics::Timer timer(Metrics::setxattrSeconds);
+    GstFs * gstFs = that();
+    double began = Utility::now();
+    int result = gstFs->setxattr(path, name, value, size, flags);
+    if (gstFs->recorder) {
+	gstFs->recorder->record(Recorder::SETXATTR, path, began, result,
+	    0, size, 0, name);
+    }
+    return result;
+}
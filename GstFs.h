@@ -10,6 +10,7 @@
 #define GstFs_h
 
 #include <map>
+#include <string>
 
 #include <dirent.h>
 
@@ -19,7 +20,11 @@
 #include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
+#include "Control.h"
+#include "Handoff.h"
+#include "Popularity.h"
 #include "ReaderFactory.h"
+#include "Recorder.h"
 #include "Transcode.h"
 
 class GstFs {
@@ -50,7 +55,33 @@ private:
     size_t imageCacheMemoryLimit;
     time_t imageCacheTimeLimit;
     int imageCachePersistFd;
+    size_t imageEndsHeadSize;
+    size_t imageEndsTailSize;
+    size_t imageEndsCountLimit;
+    size_t imageSpillSize;
+    int imageSpillFd;
+    double finishProgress;
+    double finishRemaining;
+    bool lazy;
+    unsigned lazyGrace;
+    double backoffLimit;
+    bool fallback;
+    size_t discoveryCountLimit;
+    bool timing;	///< Report how long preparing pipelines takes
+    std::string controlPath;	///< Of our Control socket, if any
+    std::string recordPath;	///< Of our Recorder's trace, if any
+    std::string popularityPath;	///< Of our Popularity's file, if any
+    double popularityHalfLife;
+    size_t warmupCount;
+    unsigned warmupJobs;
+    unsigned long long warmupMemory;
+    std::string handoffPath;	///< Of our Handoff socket, if any
+    time_t handoffTime;		///< To wait for a successor
     ReaderFactory * readerFactory;
+    Control * control;
+    Recorder * recorder;
+    Popularity * popularity;
+    Handoff * handoff;
 
     int option(
 	char const * arg, int key, fuse_args * args) throw();
@@ -60,6 +91,10 @@ private:
     void * init(fuse_conn_info *) throw();
     static void * init_(fuse_conn_info *) throw();
 
+    Reader * metrics() throw();
+
+    std::string command(std::string const & line) throw();
+
     int getattr(char const * path, struct stat * st) throw();
     static int getattr_(char const * path, struct stat * st) throw();
 
@@ -91,6 +126,23 @@ private:
     static int releasedir_(
 	char const * path, fuse_file_info * info) throw();
 
+    int getxattr(
+	char const * path, char const * name, char * value, size_t size)
+	throw();
+    static int getxattr_(
+	char const * path, char const * name, char * value, size_t size)
+	throw();
+
+    int listxattr(char const * path, char * list, size_t size) throw();
+    static int listxattr_(char const * path, char * list, size_t size) throw();
+
+    int setxattr(
+	char const * path, char const * name, char const * value, size_t size,
+	int flags) throw();
+    static int setxattr_(
+	char const * path, char const * name, char const * value, size_t size,
+	int flags) throw();
+
 public:
     GstFs(int argc, char ** argv) throw(std::runtime_error);
     virtual ~GstFs() throw();
@@ -0,0 +1,220 @@
+/// \file
+/// Definition of the Handoff class.
+/// <p>
+/// Copyright (c) 2009 Ross Tyler.
+/// This file may be copied under the terms of the
+/// GNU Lesser General Public License (LGPL).
+/// See COPYING file for details.
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include <poll.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <boost/bind/bind.hpp>
+
+#include "Handoff.h"
+#include "Metrics.h"
+
+/// What is sent with (the file descriptor of) each Image.
+struct Message {
+    char	fileIndex[64];	///< As written by operator <<
+    uint64_t	size;		///< Of the Image
+    uint8_t	resident;	///< Its file is in memory
+};
+
+static sockaddr_un addressOf(std::string const & path)
+	throw(Exception::Error) {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof address.sun_path) {
+	throw Exception::Error(": " + path, ENAMETOOLONG);
+    }
+    strcpy(address.sun_path, path.c_str());
+    return address;
+}
+
+/// Make I/O on fd time out after seconds.
+static void timeOut(int fd, int option, time_t seconds) throw() {
+    timeval timeout = {seconds, 0};
+    setsockopt(fd, SOL_SOCKET, option, &timeout, sizeof timeout);
+}
+
+Handoff::Handoff(std::string const & path_, time_t timeLimit_,
+	Adopt const & adopt_)
+	throw(Exception::Error)
+:
+    path(path_),
+    timeLimit(timeLimit_),
+    adopt(adopt_),
+    takeFd(-1),
+    listenFd(-1),
+    inode(0),
+    fd(-1),
+    thread()
+{
+    sockaddr_un address = addressOf(path);
+    // announce ourselves to a predecessor listening there, if any,
+    // before we listen there ourselves
+    takeFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (-1 != takeFd && -1 == connect(takeFd,
+	    reinterpret_cast<sockaddr *>(&address), sizeof address)) {
+	close(takeFd);
+	takeFd = -1;
+    }
+    listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (-1 == listenFd) {
+	int error = errno;
+	if (-1 != takeFd) close(takeFd);
+	throw Exception::Error(": socket", error);
+    }
+    unlink(address.sun_path);
+    struct stat st;
+    if (-1 == bind(listenFd,
+		reinterpret_cast<sockaddr *>(&address), sizeof address)
+	    || -1 == listen(listenFd, 1)
+	    || -1 == stat(address.sun_path, &st)) {
+	int error = errno;
+	close(listenFd);
+	if (-1 != takeFd) close(takeFd);
+	throw Exception::Error(": " + path, error);
+    }
+    inode = st.st_ino;
+    // take what our predecessor offers without holding up our mount
+    if (-1 != takeFd) {
+	thread = boost::thread(boost::bind(&Handoff::take, this));
+    }
+}
+
+Handoff::~Handoff() throw() {
+    stopTaking();
+    // our successor takes the end of our connection as the end of our offer
+    if (-1 != fd) close(fd);
+    close(listenFd);
+    unlinkPath();
+}
+
+void Handoff::stopTaking() throw() {
+    if (-1 == takeFd) return;
+    // wake our thread from recvmsg
+    shutdown(takeFd, SHUT_RDWR);
+    thread.join();
+    close(takeFd);
+    takeFd = -1;
+}
+
+void Handoff::unlinkPath() throw() {
+    // our successor may already be listening there
+    struct stat st;
+    if (inode && 0 == stat(path.c_str(), &st) && inode == st.st_ino) {
+	unlink(path.c_str());
+    }
+    inode = 0;
+}
+
+bool Handoff::accept() throw() {
+    if (-1 != fd) return true;
+    // a successor announces itself by connecting before we are told to
+    // hand off, so we need not wait for one that may never come
+    pollfd listening = {listenFd, POLLIN, 0};
+    int ready;
+    while (-1 == (ready = poll(&listening, 1, 0)) && EINTR == errno) {}
+    if (1 != ready) return false;
+    fd = accept4(listenFd, 0, 0, SOCK_CLOEXEC);
+    if (-1 == fd) return false;
+    timeOut(fd, SO_SNDTIMEO, timeLimit);
+    // our successor will listen there next
+    unlinkPath();
+    return true;
+}
+
+bool Handoff::offer(FileIndex fileIndex, ImageConst * image) throw() {
+    if (-1 == fd) return false;
+    Message message = {};
+    std::ostringstream name;
+    name << fileIndex;
+    strncpy(message.fileIndex, name.str().c_str(),
+	sizeof message.fileIndex - 1);
+    message.size = image->size();
+    bool resident;
+    int imageFd = image->share(resident);
+    if (-1 == imageFd) return false;
+    message.resident = resident;
+
+    iovec iov = {&message, sizeof message};
+    char control[CMSG_SPACE(sizeof imageFd)] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+    cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof imageFd);
+    memcpy(CMSG_DATA(cmsg), &imageFd, sizeof imageFd);
+    ssize_t sent;
+    while (-1 == (sent = sendmsg(fd, &msg, MSG_NOSIGNAL)) && EINTR == errno) {}
+    close(imageFd);
+    if (static_cast<ssize_t>(sizeof message) != sent) {
+	// don't offer any more to a successor that is not taking them
+	close(fd);
+	fd = -1;
+	return false;
+    }
+    ++Metrics::cacheHandedOff;
+    return true;
+}
+
+void Handoff::take() throw() {
+    // wait as long as our predecessor is listening for it to offer
+    // the first (it ends our connection if it goes without doing so)
+    // and no more than timeLimit for each next
+    size_t count = 0;
+    bool offering = false;
+    for (;;) {
+	Message message;
+	iovec iov = {&message, sizeof message};
+	int imageFd = -1;
+	char control[CMSG_SPACE(sizeof imageFd)];
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof control;
+	ssize_t received = recvmsg(takeFd, &msg, MSG_CMSG_CLOEXEC);
+	if (-1 == received && EINTR == errno) continue;
+	if (0 >= received) break;	// the end of what is offered
+	if (!offering) {
+	    offering = true;
+	    timeOut(takeFd, SO_RCVTIMEO, timeLimit);
+	}
+	cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && SOL_SOCKET == cmsg->cmsg_level
+		&& SCM_RIGHTS == cmsg->cmsg_type) {
+	    memcpy(&imageFd, CMSG_DATA(cmsg), sizeof imageFd);
+	}
+	if (-1 == imageFd) continue;
+	message.fileIndex[sizeof message.fileIndex - 1] = 0;
+	std::istringstream name(message.fileIndex);
+	FileIndex fileIndex;
+	if (static_cast<ssize_t>(sizeof message) != received
+		|| !(name >> fileIndex)) {
+	    close(imageFd);
+	    continue;
+	}
+	adopt(fileIndex, imageFd, message.size, message.resident);
+	++Metrics::cacheAdopted;
+	++count;
+    }
+    if (count) {
+	std::cerr << "handoff: adopted " << count << " images" << std::endl;
+    }
+}
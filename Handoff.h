@@ -0,0 +1,80 @@
+/// \file
+/// Declaration of the Handoff class.
+/// <p>
+/// Copyright (c) 2009 Ross Tyler.
+/// This file may be copied under the terms of the
+/// GNU Lesser General Public License (LGPL).
+/// See COPYING file for details.
+
+#ifndef Handoff_h_
+#define Handoff_h_
+
+#include <string>
+
+#include <sys/types.h>
+
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+
+#include "Exception.h"
+#include "FileIndex.h"
+#include "Image.h"
+
+/// A Handoff passes the cached images of a process that is going
+/// to the one that replaces it, so that they need not be transcoded again
+/// (or persisted on the way out).
+/// Each image is passed as a file descriptor (see Image::share)
+/// over a unix domain (sequenced packet) socket.
+/// The content of one that is spilled is passed as is but that of one
+/// in memory is held in a rope rather than a memfd, so it is copied
+/// to one, one Image after another, when it is offered.
+/// <p>
+/// The going process listens at a path for the life of its Handoff.
+/// The one that replaces it announces itself by connecting there
+/// (before the going one is told to hand off) and listens there in turn
+/// while a thread of its own takes what is offered (if anything).
+/// The going process, when told to, hands off only to one that has.
+class Handoff {
+public:
+    /// Adopt the content of size bytes in fd (see Image::share),
+    /// which is held in memory if resident, by FileIndex.
+    typedef boost::function<void (FileIndex, int fd, size_t size,
+	bool resident)> Adopt;
+
+private:
+    std::string const path;	///< Of our listening socket
+    time_t const timeLimit;	///< To wait for each Image to be taken
+    Adopt const adopt;		///< What our predecessor offers
+    int takeFd;			///< Connected to our predecessor or -1
+    int listenFd;
+    ino_t inode;		///< Of our socket at path
+    int fd;			///< Connected to our successor or -1
+    boost::thread thread;	///< Taking from our predecessor
+
+    void unlinkPath() throw();
+    void take() throw();
+
+public:
+    /// Announce ourselves to a predecessor listening on a socket at path
+    /// (if any) and take what it offers to adopt in the background
+    /// while we listen there (replacing whatever might be there).
+    Handoff(std::string const & path, time_t timeLimit, Adopt const & adopt)
+	throw(Exception::Error);
+
+    /// Stop taking and listening and remove our socket (if it is still ours).
+    ~Handoff() throw();
+
+    /// Stop taking from our predecessor, so that what we adopt into
+    /// may go.
+    void stopTaking() throw();
+
+    /// Accept a successor that has connected (without waiting for one).
+    /// \return False if none has.
+    bool accept() throw();
+
+    /// Offer an Image to our successor.
+    /// \return False if it was not taken.
+    bool offer(FileIndex, ImageConst *) throw();
+};
+
+#endif
@@ -0,0 +1,252 @@
+/// \file
+/// Definition of the Image class.
+/// <p>
+/// Copyright (c) 2009 Ross Tyler.
+/// This file may be copied under the terms of the
+/// GNU Lesser General Public License (LGPL).
+/// See COPYING file for details.
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "Image.h"
+
+Image::Budget::Budget(
+    size_t spillSize_, int spillFd_, unsigned long long memoryLimit_) throw()
+:
+    spillSize(spillSize_),
+    spillFd(spillFd_),
+    memoryLimit(memoryLimit_),
+    memory(0)
+{}
+
+bool Image::Budget::reserve(size_t have, size_t more) throw() {
+    boost::mutex::scoped_lock lock(*this);
+    // the memory is reserved whether we are within budget or not.
+    // it is up to the Image to unreserve it if it spills.
+    memory += more;
+    if (-1 == spillFd) return true;
+    return have + more <= spillSize && memory <= memoryLimit;
+}
+
+bool Image::Budget::fits(size_t size) throw() {
+    boost::mutex::scoped_lock lock(*this);
+    if (-1 == spillFd) return true;
+    return size <= spillSize && memory + size <= memoryLimit;
+}
+
+void Image::Budget::unreserve(size_t less) throw() {
+    boost::mutex::scoped_lock lock(*this);
+    memory -= less;
+}
+
+void Image::Budget::limit(unsigned long long memoryLimit_) throw() {
+    boost::mutex::scoped_lock lock(*this);
+    memoryLimit = memoryLimit_;
+}
+
+int Image::Budget::open() throw() {
+    if (-1 == spillFd) return -1;
+    // prefer a file that never has a name
+    int fd = openat(spillFd, ".", O_TMPFILE | O_RDWR, 0600);
+    if (-1 != fd) return fd;
+    // otherwise, unlink a uniquely named one as soon as it is created
+    static unsigned serial = 0;
+    std::ostringstream name;
+    {
+	boost::mutex::scoped_lock lock(*this);
+	name << ".spill." << getpid() << '.' << serial++;
+    }
+    fd = openat(spillFd, name.str().c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (-1 == fd) {
+	std::cerr << name.str() << ": " << strerror(errno) << std::endl;
+	return -1;
+    }
+    unlinkat(spillFd, name.str().c_str(), 0);
+    return fd;
+}
+
+Image::Image(Budget * budget_) throw()
+:
+    budget(budget_),
+    rope(),
+    fd(-1),
+    resident(false),
+    length(0),
+    start(0)
+{}
+
+Image::Image(int fd_, size_t size, bool resident_, Budget * budget_) throw()
+:
+    budget(budget_),
+    rope(),
+    fd(fd_),
+    resident(resident_),
+    length(size),
+    start(0)
+{
+    if (resident && budget && !budget->reserve(0, length)) spill();
+}
+
+Image::~Image() throw() {
+    if (budget) budget->unreserve(memory());
+    if (-1 != fd) close(fd);
+}
+
+size_t Image::size() const throw() {
+    return length;
+}
+
+size_t Image::begin() const throw() {
+    return start;
+}
+
+size_t Image::memory() const throw() {
+    return resident ? length - start : rope.size();
+}
+
+/// Write size bytes from buffer to fd at offset, retrying short writes.
+/// \return True if successful.
+static bool pwriteAll(
+	int fd, char const * buffer, size_t size, off_t offset) throw() {
+    while (size) {
+	ssize_t length = pwrite(fd, buffer, size, offset);
+	if (0 >= length) {
+	    if (-1 == length && EINTR == errno) continue;
+	    return false;
+	}
+	buffer += length;
+	size -= length;
+	offset += length;
+    }
+    return true;
+}
+
+void Image::spill() throw() {
+    int spillFd = budget->open();
+    if (-1 == spillFd) return;	// stay in memory
+    char tile[65536];
+    for (size_t offset = start; offset < length; offset += sizeof tile) {
+	size_t size = length - offset < sizeof tile
+	    ? length - offset : sizeof tile;
+	copy(offset, size, tile);
+	if (!pwriteAll(spillFd, tile, size, offset)) {
+	    close(spillFd);
+	    return;		// stay in memory
+	}
+    }
+    budget->unreserve(memory());
+    if (-1 != fd) close(fd);	// our memfd
+    rope = __gnu_cxx::crope();
+    fd = spillFd;
+    resident = false;
+}
+
+void Image::append(char const * buffer, size_t size) throw() {
+    if (-1 != fd) {
+	if (pwriteAll(fd, buffer, size, length)) {
+	    length += size;
+	    if (resident && budget) budget->reserve(0, size);
+	    return;
+	}
+	// we could not write to our spill file.
+	// bring what we have back into memory and continue there.
+	std::cerr << "spill: " << strerror(errno) << std::endl;
+	if (budget && !resident) budget->reserve(0, length - start);
+	char tile[65536];
+	for (size_t offset = start; offset < length; offset += sizeof tile) {
+	    size_t copy = length - offset < sizeof tile
+		? length - offset : sizeof tile;
+	    this->copy(offset, copy, tile);
+	    rope.append(tile, copy);
+	}
+	close(fd);
+	fd = -1;
+	resident = false;
+    }
+    bool withinBudget = !budget || budget->reserve(length - start, size);
+    rope.append(buffer, size);
+    length += size;
+    if (!withinBudget) spill();
+}
+
+void Image::copy(size_t offset, size_t size, char * buffer) const throw() {
+    if (-1 == fd) {
+	rope.copy(offset - start, size, buffer);
+	return;
+    }
+    while (size) {
+	ssize_t length = pread(fd, buffer, size, offset);
+	if (0 >= length) {
+	    if (-1 == length && EINTR == errno) continue;
+	    // this should not happen but we must not return garbage
+	    memset(buffer, 0, size);
+	    return;
+	}
+	buffer += length;
+	size -= length;
+	offset += length;
+    }
+}
+
+void Image::drop(size_t offset) throw() {
+    if (offset <= start) return;
+    if (offset > length) offset = length;
+    size_t size = offset - start;
+    if (-1 == fd) {
+	rope = rope.substr(size, rope.size() - size);
+	if (budget) budget->unreserve(size);
+    } else {
+	// give back the space used by what was dropped, if we can
+	fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, size);
+	if (resident && budget) budget->unreserve(size);
+    }
+    start = offset;
+}
+
+bool Image::write(int out) const throw() {
+    char tile[65536];
+    for (size_t offset = start; offset < length; offset += sizeof tile) {
+	size_t size = length - offset < sizeof tile
+	    ? length - offset : sizeof tile;
+	copy(offset, size, tile);
+	char const * buffer = tile;
+	while (size) {
+	    ssize_t written = ::write(out, buffer, size);
+	    if (0 >= written) {
+		if (-1 == written && EINTR == errno) continue;
+		return false;
+	    }
+	    buffer += written;
+	    size -= written;
+	}
+    }
+    return true;
+}
+
+int Image::share(bool & resident_) const throw() {
+    if (-1 != fd) {
+	resident_ = resident;
+	return fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    }
+    int memfd = memfd_create("gstfs-ng image", MFD_CLOEXEC);
+    if (-1 == memfd) return -1;
+    char tile[65536];
+    for (size_t offset = start; offset < length; offset += sizeof tile) {
+	size_t size = length - offset < sizeof tile
+	    ? length - offset : sizeof tile;
+	rope.copy(offset - start, size, tile);
+	if (!pwriteAll(memfd, tile, size, offset)) {
+	    close(memfd);
+	    return -1;
+	}
+    }
+    resident_ = true;
+    return memfd;
+}
@@ -1,5 +1,5 @@
 /// \file
-/// Declarations of the Image type and relations.
+/// Declarations of the Image class and relations.
 /// <p>
 /// Copyright (c) 2009 Ross Tyler.
 /// This file may be copied under the terms of the
@@ -10,15 +10,109 @@
 #define Image_h
 
 #include <ext/rope>
+
 #include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
 
-/// An Image is an STL rope
+/// An Image is the product of a transcoding that is built as a sequence
+/// of many pieces.
+/// While it is small, its content is held in memory as an STL rope
 /// which is a heavyweight string involving the use of a concatenation tree
 /// representation.
-/// This is perfect for representing images that are built as a sequence
-/// of many pieces.
 /// For this purpose, a rope performs _much_ better than a std::string.
-typedef __gnu_cxx::crope Image;
+/// Should it grow beyond what its Budget allows, its content spills to
+/// an anonymous file and is appended to/copied from there instead.
+/// Its content may be shared, as a file, with another process
+/// which may adopt it as an Image of its own.
+class Image {
+public:
+
+    /// An Image::Budget limits the memory used by all of the Images
+    /// that share it.
+    /// An Image that would grow beyond the spillSize or push the memory
+    /// used by all Images beyond the memoryLimit is spilled to an anonymous
+    /// file in the spill directory.
+    /// Without a spill directory, Images are never spilled.
+    class Budget : private boost::mutex {
+    private:
+	size_t			spillSize;	///< Spill an Image larger than this
+	int			spillFd;	///< Spill to this directory
+	unsigned long long	memoryLimit;	///< Spill when memory would exceed
+	unsigned long long	memory;		///< Memory used by all Images
+    public:
+	Budget(size_t spillSize, int spillFd, unsigned long long memoryLimit)
+	    throw();
+
+	/// Reserve more memory for an Image that already has some.
+	/// \return False if the Image should spill instead.
+	bool reserve(size_t have, size_t more) throw();
+
+	/// \return True if an Image of size would be held in memory
+	/// (rather than spill) were it appended now.
+	bool fits(size_t size) throw();
+
+	/// Return memory that was reserved for an Image.
+	void unreserve(size_t) throw();
+
+	/// Change our memoryLimit.
+	void limit(unsigned long long memoryLimit) throw();
+
+	/// Open an anonymous file in the spill directory.
+	/// \return The file descriptor or -1 if none.
+	int open() throw();
+    };
+
+    Image(Budget * budget = 0) throw();
+
+    /// Adopt the content of size bytes in fd (see share)
+    /// which, if resident, is held in memory (by a memfd)
+    /// that is accountable to the budget like content we append.
+    Image(int fd, size_t size, bool resident, Budget * budget = 0) throw();
+
+    ~Image() throw();
+
+    /// Return the size of the content.
+    size_t size() const throw();
+
+    /// Return the offset of the first content that has not been dropped.
+    size_t begin() const throw();
+
+    /// Return the memory used to hold the content.
+    size_t memory() const throw();
+
+    /// Copy size bytes of content at offset to buffer.
+    void copy(size_t offset, size_t size, char * buffer) const throw();
+
+    /// Append size bytes from buffer to the content.
+    void append(char const * buffer, size_t size) throw();
+
+    /// Drop the content before offset.
+    /// Dropped content no longer uses resources and may not be copied.
+    void drop(size_t offset) throw();
+
+    /// Write all of the content to fd.
+    /// \return True if successful.
+    bool write(int fd) const throw();
+
+    /// Share the content (at the same offsets) as a file
+    /// that another process may adopt, without copying it if it spilled.
+    /// Content in memory is copied to a memfd, which is resident.
+    /// \return A file descriptor that the caller must close or -1.
+    int share(bool & resident) const throw();
+
+private:
+    Budget *		budget;	///< Budget we are accountable to, if any
+    __gnu_cxx::crope	rope;	///< Content while in memory
+    int			fd;	///< Content when spilled, otherwise -1
+    bool		resident; ///< Content in fd is in memory
+    size_t		length;	///< Size of the content
+    size_t		start;	///< Offset of the content not dropped
+
+    void spill() throw();
+
+    Image(Image const &);
+    Image & operator =(Image const &);
+};
 
 typedef Image const ImageConst;
 
@@ -6,16 +6,18 @@
 /// This file may be copied under the terms of the
 /// GNU Lesser General Public License (LGPL).
 /// See COPYING file for details.
+#include <cstring>
 #include <limits>
 #include <set>
 
-#include <ext/stdio_filebuf.h>
-
 #include "fcntl.h"
 
 #include "FileReader.h"
 #include "FindFile.h"
+#include "Handoff.h"
 #include "ImageReader.h"
+#include "Metrics.h"
+#include "Trace.h"
 #include "Utility.h"
 
 #include "ImageCache.h"
@@ -60,7 +62,9 @@ namespace ImageCache {
 		std::istringstream in(location->name);
 		FileIndex fileIndex;
 		if (in >> fileIndex && in.eof()) {
-		    // a FileIndex can be built from the location name
+		    // a FileIndex can be built from the location name.
+		    // every variant of a referenced file is referenced.
+		    fileIndex.variant = 0;
 		    if (references.end() == references.find(fileIndex)) {
 			// remove the file because it is not referenced
 			unlinkat(location->parent->fd, location->name, 0);
@@ -81,8 +85,40 @@ namespace ImageCache {
     LruIndex::LruIndex() throw() : count(0), time(::time(0)) {}
 
     Value::Value(
-	FileIndex const & fileIndex_, ImageConst * image_) throw()
-    : fileIndex(fileIndex_), lruIndex(), image(image_) {}
+	FileIndex const & fileIndex_, ImageConst * image_, bool complete_)
+	throw()
+    : fileIndex(fileIndex_), lruIndex(), image(image_), complete(complete_) {}
+
+    Ends::Ends(ImageConst * image, size_t headSize, size_t tailSize) throw()
+    :
+	size(image->size()),
+	head(),
+	tail()
+    {
+	if (headSize > size) headSize = size;
+	if (tailSize > size) tailSize = size;
+	head.resize(headSize);
+	image->copy(0, headSize, &head[0]);
+	tail.resize(tailSize);
+	image->copy(size - tailSize, tailSize, &tail[0]);
+    }
+
+    ssize_t Ends::read(char * buffer, size_t size_, size_t offset) const
+	    throw() {
+	if (offset >= size) return 0;
+	if (offset + size_ <= head.size()) {
+	    memcpy(buffer, head.data() + offset, size_);
+	    return size_;
+	}
+	size_t tailOffset = size - tail.size();
+	if (offset >= tailOffset) {
+	    // a read of the tail may ask for more than there is
+	    if (size_ > size - offset) size_ = size - offset;
+	    memcpy(buffer, tail.data() + offset - tailOffset, size_);
+	    return size_;
+	}
+	return -1;
+    }
 
     bool LruIndex::operator < (LruIndex const & that) const throw() {
 	return count < that.count
@@ -95,24 +131,28 @@ namespace ImageCache {
     }
 
     void Container::run() throw() {
-	if (std::numeric_limits<time_t>::max() == timeLimit) return;
-	// we need to be interruptible.
-	// this could be implemented best by using boost 1.3.5 interruptible
-	// threads but we don't want to depend on this availability (yet).
-	// it could be implemented better by interrupting a blocked system
-	// call with pthread_kill but this would assume boost threads
-	// are based on posix threads (is that bad?) and is a little ugly.
-	// until there is felt to be a need/capability to do otherwise,
-	// we will just poll to find out when to stop.
-	time_t when = time(0) + timeLimit;
+	// cull every timeLimit seconds (if we have one) until we stop.
+	// we are woken to stop or when our timeLimit is changed (see limit).
+	Metrics::TimedLock lock(*this, Metrics::cacheLockSeconds);
+	time_t limit = std::numeric_limits<time_t>::max();
+	time_t when = 0;
 	while (!stop) {
+	    if (std::numeric_limits<time_t>::max() == timeLimit) {
+		limit = timeLimit;
+		wake.wait(lock);
+		continue;
+	    }
 	    time_t now = time(0);
-	    if (now > when) {
-		boost::mutex::scoped_lock lock(*this);
+	    if (limit != timeLimit) {
+		limit = timeLimit;
+		when = now + limit;
+	    }
+	    if (now >= when) {
 		cull();
-		when = now + timeLimit;
+		when = now + limit;
 	    }
-	    sleep(5);
+	    wake.timed_wait(lock, boost::get_system_time()
+		+ boost::posix_time::seconds(when > now ? when - now : 1));
 	}
     }
 
@@ -121,7 +161,10 @@ namespace ImageCache {
 	unsigned long long memoryLimit_,
 	time_t timeLimit_,
 	int baseFd_,
-	int persistFd_) throw()
+	int persistFd_,
+	size_t endsHeadSize_,
+	size_t endsTailSize_,
+	size_t endsCountLimit_) throw()
     :
 	countLimit(countLimit_),
 	memoryLimit(memoryLimit_),
@@ -130,8 +173,16 @@ namespace ImageCache {
 	persistFd(persistFd_),
 	count(0),
 	memory(0),
+	wake(),
 	stop(0),
-	thread(boost::bind(&Container::run, this))
+	thread(boost::bind(&Container::run, this)),
+	endsHeadSize(endsHeadSize_),
+	endsTailSize(endsTailSize_),
+	endsCountLimit(endsCountLimit_),
+	endsList(),
+	endsMap(),
+	pinned(),
+	handoff(0)
     {
 	if (-1 == persistFd) return;
 	try {
@@ -143,27 +194,55 @@ namespace ImageCache {
     }
 
     Container::~Container() throw() {
-	stop = true;
+	{
+	    Metrics::TimedLock lock(*this, Metrics::cacheLockSeconds);
+	    stop = true;
+	    wake.notify_all();
+	}
 	thread.join();
+	// if a successor takes our complete images, it need not wait for
+	// them to be persisted (least recently used first, as it will cull).
+	bool handingOff = handoff && handoff->accept();
 	ByLruIndex & byLruIndex = get<LruIndex>();
 	for (ByLruIndex::iterator it = byLruIndex.begin();
 		it != byLruIndex.end(); ++it) {
-	    persist(it->fileIndex, it->image);
+	    if (it->complete
+		    && !(handingOff && handoff->offer(it->fileIndex, it->image)))
+		persist(it->fileIndex, it->image);
 	    delete it->image;
 	}
     }
 
-    void Container::add(FileIndex fileIndex, ImageConst * image) throw() {
-	boost::mutex::scoped_lock lock(*this);
-	bool inserted = get<LruIndex>().insert(Value(fileIndex, image)).second;
+    void Container::add(
+	    FileIndex fileIndex, ImageConst * image, bool complete) throw() {
+	Metrics::TimedLock lock(*this, Metrics::cacheLockSeconds);
+	TRACE_FILE_BYTES2(cache__add, fileIndex, image->size(), complete);
+	if (complete) keepEnds(fileIndex, image);
+	ByFileIndex & byFileIndex = get<FileIndex>();
+	ByFileIndex::iterator it = byFileIndex.find(fileIndex);
+	if (it != byFileIndex.end()) {
+	    // keep what we have if it is in use, complete or a longer prefix
+	    if (it->lruIndex.count
+		    || it->complete
+		    || (!complete && it->image->size() >= image->size())) {
+		delete image;
+		return;
+	    }
+	    --count;
+	    memory -= it->image->memory();
+	    delete it->image;
+	    byFileIndex.erase(it);
+	}
+	bool inserted = get<LruIndex>().insert(Value(fileIndex, image, complete))
+	    .second;
 	assert(inserted);
 	++count;
-	memory += image->size();
+	memory += image->memory();
 	cull();
     }
 
     void Container::release(FileIndex fileIndex) throw() {
-	boost::mutex::scoped_lock lock(*this);
+	Metrics::TimedLock lock(*this, Metrics::cacheLockSeconds);
 	ByFileIndex & byFileIndex = get<FileIndex>();
 	ByFileIndex::iterator it = byFileIndex.find(fileIndex);
 	if (it == byFileIndex.end()) return;
@@ -175,16 +254,17 @@ namespace ImageCache {
 	if (!value.lruIndex.count) cull();
     }
 
-    /// Acquire the Image associated with the FileIndex.
+    /// Acquire the complete (or prefix) Image associated with the FileIndex.
     /// A copy of a ImageConstPointer is returned and when the
     /// last copy of this smart pointer is destroyed the image will
     /// be automatically released by calling our private release method.
     /// \return A smart pointer that references the image or 0 if none.
-    ImageConstPointer Container::acquire(FileIndex fileIndex) throw() {
+    ImageConstPointer Container::acquire(FileIndex fileIndex, bool complete)
+	    throw() {
 	// callers should have already obtained a lock on *this!
 	ByFileIndex & byFileIndex = get<FileIndex>();
 	ByFileIndex::iterator it = byFileIndex.find(fileIndex);
-	if (it == byFileIndex.end()) {
+	if (it == byFileIndex.end() || it->complete != complete) {
 	    return ImageConstPointer(
 		static_cast<ImageConst *>(0), Utility::NoDeleter());
 	}
@@ -192,6 +272,7 @@ namespace ImageCache {
 	Value value = *it;
 	++value.lruIndex.count;
 	byFileIndex.replace(it, value);
+	TRACE_FILE_BYTES(cache__acquire, fileIndex, value.image->size());
 	return ImageConstPointer(value.image,
 	    boost::bind(&Container::release, this, fileIndex));
     }
@@ -202,31 +283,80 @@ namespace ImageCache {
 	return name.str();
     }
 
-    Reader * Container::open(FileIndex fileIndex) throw() {
-	boost::mutex::scoped_lock lock(*this);
+    Reader * Container::open(FileIndex fileIndex, bool counted) throw() {
+	Metrics::TimedLock lock(*this, Metrics::cacheLockSeconds);
 	// if there is an image cached for this FileIndex,
 	// return a new ImageReader constructed with it.
-	ImageConstPointer imageConstPointer = acquire(fileIndex);
-	if (imageConstPointer)
+	ImageConstPointer imageConstPointer = acquire(fileIndex, true);
+	if (imageConstPointer) {
+	    if (counted) ++Metrics::cacheMemoryHits;
 	    return new ImageReader(fileIndex, imageConstPointer);
-	if (-1 == persistFd) return 0;
-	int fd = openat(persistFd, persistName(fileIndex).c_str(), O_RDONLY);
-	if (-1 == fd) return 0;
+	}
+	int fd = -1 == persistFd ? -1
+	    : openat(persistFd, persistName(fileIndex).c_str(), O_RDONLY);
+	if (-1 == fd) {
+	    if (counted) ++Metrics::cacheMisses;
+	    return 0;
+	}
+	if (counted) ++Metrics::cacheDiskHits;
 	return new FileReader(fileIndex, fd);
     }
 
-    ssize_t Container::sizeOf(FileIndex fileIndex) throw() {
-	boost::mutex::scoped_lock lock(*this);
+    ImageConstPointer Container::prefix(FileIndex fileIndex) throw() {
+	Metrics::TimedLock lock(*this, Metrics::cacheLockSeconds);
+	return acquire(fileIndex, false);
+    }
+
+    ssize_t Container::sizeOf(FileIndex fileIndex, bool * persisted) throw() {
+	Metrics::TimedLock lock(*this, Metrics::cacheLockSeconds);
+	if (persisted) *persisted = false;
 	ByFileIndex & byFileIndex = get<FileIndex>();
 	ByFileIndex::iterator it = byFileIndex.find(fileIndex);
-	if (byFileIndex.end() != it) return it->image->size();
+	if (byFileIndex.end() != it && it->complete) return it->image->size();
 	if (-1 == persistFd) return -1;
 	struct stat st;
-	if (-1 != fstatat(persistFd, persistName(fileIndex).c_str(), &st, 0))
+	if (-1 != fstatat(persistFd, persistName(fileIndex).c_str(), &st, 0)) {
+	    if (persisted) *persisted = true;
 	    return st.st_size;
+	}
 	return -1;
     }
 
+    EndsConstPointer Container::ends(FileIndex fileIndex) throw() {
+	Metrics::TimedLock lock(*this, Metrics::cacheLockSeconds);
+	EndsMap::iterator it = endsMap.find(fileIndex);
+	if (it == endsMap.end()) return EndsConstPointer();
+	// this is now the most recently used
+	endsList.splice(endsList.end(), endsList, it->second);
+	return it->second->second;
+    }
+
+    void Container::forgetEnds(FileIndex fileIndex) throw() {
+	Metrics::TimedLock lock(*this, Metrics::cacheLockSeconds);
+	EndsMap::iterator it = endsMap.find(fileIndex);
+	if (it == endsMap.end()) return;
+	endsList.erase(it->second);
+	endsMap.erase(it);
+    }
+
+    void Container::keepEnds(FileIndex fileIndex, ImageConst * image) throw() {
+	// callers should have already obtained a lock on *this!
+	if (!endsCountLimit || !(endsHeadSize || endsTailSize)) return;
+	EndsConstPointer ends(new Ends(image, endsHeadSize, endsTailSize));
+	EndsMap::iterator it = endsMap.find(fileIndex);
+	if (it != endsMap.end()) {
+	    it->second->second = ends;
+	    endsList.splice(endsList.end(), endsList, it->second);
+	    return;
+	}
+	endsMap.insert(EndsMap::value_type(fileIndex,
+	    endsList.insert(endsList.end(), EndsList::value_type(fileIndex, ends))));
+	if (endsList.size() > endsCountLimit) {
+	    endsMap.erase(endsList.front().first);
+	    endsList.pop_front();
+	}
+    }
+
     void Container::cull() throw() {
 	// callers should have already obtained a lock on *this!
 	time_t now = time(0);
@@ -239,8 +369,10 @@ namespace ImageCache {
 		    || memoryLimit < memory
 		    || (it->lruIndex.time < latest))) {
 	    --count;
-	    memory -= it->image->size();
-	    persist(it->fileIndex, it->image);
+	    memory -= it->image->memory();
+	    ++Metrics::cacheEvictions;
+	    TRACE_FILE_BYTES(cache__cull, it->fileIndex, it->image->size());
+	    if (it->complete) persist(it->fileIndex, it->image);
 	    delete it->image;
 	    it = byLruIndex.erase(it);
 	}
@@ -253,17 +385,103 @@ namespace ImageCache {
 	std::string temp = name + ".tmp";
 	int fd = openat(persistFd, temp.c_str(), O_CREAT | O_WRONLY, 0666);
 	if (-1 == fd) return;
-	bool success;
-	{
-	    __gnu_cxx::stdio_filebuf<char> buffer(fd, std::ios::out);
-	    std::ostream out(&buffer);
-	    success = (out << *image).good();
-	    // stdio_filebuf destructor will close fd
-	}
+	bool success = image->write(fd);
+	close(fd);
 	if (success) {
 	    renameat(persistFd, temp.c_str(), persistFd, name.c_str());
+	    ++Metrics::cachePersisted;
+	    TRACE_FILE_BYTES(cache__persist, fileIndex, image->size());
+	    Metrics::cachePersistedBytes += image->size();
 	} else {
 	    unlinkat(persistFd, temp.c_str(), 0);
 	}
     }
+
+    void Container::metrics(std::ostream & out) throw() {
+	Metrics::TimedLock lock(*this, Metrics::cacheLockSeconds);
+	Metrics::write(out, "gstfs_cache_images", "gauge",
+	    "Images (and prefixes) cached in memory.", count);
+	Metrics::write(out, "gstfs_cache_memory_bytes", "gauge",
+	    "Memory used by images cached in memory.", memory);
+	Metrics::write(out, "gstfs_cache_ends", "gauge",
+	    "Ends kept of images completed.", endsMap.size());
+    }
+
+    void Container::limit(size_t countLimit_,
+	    unsigned long long memoryLimit_, time_t timeLimit_) throw() {
+	Metrics::TimedLock lock(*this, Metrics::cacheLockSeconds);
+	countLimit = countLimit_;
+	memoryLimit = memoryLimit_;
+	timeLimit = timeLimit_;
+	cull();
+	wake.notify_all();
+    }
+
+    void Container::limits(size_t & countLimit_,
+	    unsigned long long & memoryLimit_, time_t & timeLimit_) throw() {
+	Metrics::TimedLock lock(*this, Metrics::cacheLockSeconds);
+	countLimit_ = countLimit;
+	memoryLimit_ = memoryLimit;
+	timeLimit_ = timeLimit;
+    }
+
+    bool Container::pin(FileIndex fileIndex) throw() {
+	Metrics::TimedLock lock(*this, Metrics::cacheLockSeconds);
+	ByFileIndex & byFileIndex = get<FileIndex>();
+	ByFileIndex::iterator it = byFileIndex.find(fileIndex);
+	if (it == byFileIndex.end() || !it->complete
+		|| !pinned.insert(fileIndex).second)
+	    return false;
+	// a pinned image is in use (by us) so it will not be culled
+	Value value = *it;
+	++value.lruIndex.count;
+	byFileIndex.replace(it, value);
+	return true;
+    }
+
+    bool Container::unpin(FileIndex fileIndex) throw() {
+	{
+	    Metrics::TimedLock lock(*this, Metrics::cacheLockSeconds);
+	    if (!pinned.erase(fileIndex)) return false;
+	}
+	release(fileIndex);
+	return true;
+    }
+
+    bool Container::evict(FileIndex fileIndex) throw() {
+	Metrics::TimedLock lock(*this, Metrics::cacheLockSeconds);
+	bool evicted = false;
+	ByFileIndex & byFileIndex = get<FileIndex>();
+	ByFileIndex::iterator it = byFileIndex.find(fileIndex);
+	if (it != byFileIndex.end() && !it->lruIndex.count) {
+	    --count;
+	    memory -= it->image->memory();
+	    delete it->image;
+	    byFileIndex.erase(it);
+	    evicted = true;
+	}
+	EndsMap::iterator ends = endsMap.find(fileIndex);
+	if (ends != endsMap.end()) {
+	    endsList.erase(ends->second);
+	    endsMap.erase(ends);
+	    evicted = true;
+	}
+	if (-1 != persistFd
+		&& 0 == unlinkat(persistFd, persistName(fileIndex).c_str(), 0))
+	    evicted = true;
+	return evicted;
+    }
+
+    void Container::flush() throw() {
+	Metrics::TimedLock lock(*this, Metrics::cacheLockSeconds);
+	size_t countLimit_ = countLimit;
+	countLimit = 0;
+	cull();
+	countLimit = countLimit_;
+    }
+
+    void Container::handOffTo(Handoff * handoff_) throw() {
+	Metrics::TimedLock lock(*this, Metrics::cacheLockSeconds);
+	handoff = handoff_;
+    }
 }
@@ -9,6 +9,9 @@
 /// recently used ones are culled to maintain a cache with limited
 /// entries and/or memory footprint and/or lifetime.
 /// <p>
+/// The ends (head and tail) of complete images are kept on the side,
+/// for a limited number of them, and outlive the images themselves.
+/// <p>
 /// Copyright (c) 2009 Ross Tyler.
 /// This file may be copied under the terms of the
 /// GNU Lesser General Public License (LGPL).
@@ -17,6 +20,12 @@
 #ifndef ImageCache_h_
 #define ImageCache_h_
 
+#include <list>
+#include <map>
+#include <ostream>
+#include <set>
+#include <string>
+
 #include <sys/stat.h>
 
 #include <boost/multi_index_container.hpp>
@@ -25,13 +34,18 @@
 #include <boost/multi_index/member.hpp>
 #include <boost/multi_index/tag.hpp>
 
+#include <boost/shared_ptr.hpp>
+
 #include <boost/thread.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
 
 #include "FileIndex.h"
 #include "Image.h"
 #include "Reader.h"
 
+class Handoff;
+
 namespace ImageCache {
 
     /// ImageCache::Container uses LruIndex
@@ -45,14 +59,36 @@ namespace ImageCache {
     };
 
     /// ImageCache::Value has a FileIndex, an LruIndex and an image
+    /// that is either complete or only a prefix of what it would be.
     class Value {
     public:
 	FileIndex 	fileIndex;
 	LruIndex	lruIndex;
 	ImageConst *	image;
-	Value(FileIndex const &, ImageConst *) throw();
+	bool		complete;
+	Value(FileIndex const &, ImageConst *, bool complete) throw();
+    };
+
+    /// ImageCache::Ends are the head and tail of a complete image
+    /// and its size.
+    /// Readers that only probe a file (e.g. for its tags) can be answered
+    /// from them without the image.
+    class Ends {
+    public:
+	size_t		size;		///< Size of the image
+	std::string	head;		///< First bytes of the image
+	std::string	tail;		///< Last bytes of the image
+	Ends(ImageConst *, size_t headSize, size_t tailSize) throw();
+
+	/// Copy what the image has at offset to buffer
+	/// if it is all within our head or tail.
+	/// \return The number of bytes copied (0 at end of image)
+	/// or -1 if not within.
+	ssize_t read(char * buffer, size_t size, size_t offset) const throw();
     };
 
+    typedef boost::shared_ptr<Ends const> EndsConstPointer;
+
     /// ImageCache::Container uses both
     /// &Value::fileIndex and &Value::lruIndex Value members
     /// to order its Value objects.
@@ -81,23 +117,78 @@ namespace ImageCache {
 	    unsigned long long memoryLimit,
 	    time_t timeLimit,
 	    int baseFd,
-	    int persistFd) throw();
+	    int persistFd,
+	    size_t endsHeadSize = 0,
+	    size_t endsTailSize = 0,
+	    size_t endsCountLimit = 0) throw();
 
 	~Container() throw();
 
 	/// Add the image indexed by FileIndex to this container.
-	/// This container assumes ownership of the image.
-	/// \return True if the image was added successfully.
-	void add(FileIndex const, ImageConst * image) throw();
-
-	/// Open a Reader to the Image associated with the FileIndex.
+	/// An image that is not complete is only a prefix of what it would be.
+	/// It replaces a shorter prefix but not a complete image or one
+	/// that is in use.
+	/// This container assumes ownership of the image
+	/// and will delete it if it is not added.
+	void add(FileIndex const, ImageConst * image, bool complete = true)
+	    throw();
+
+	/// Open a Reader to the complete Image associated with the FileIndex.
 	/// The caller is responsible for releasing the reader when done.
+	/// Unless counted, this is not counted as a hit or miss in our
+	/// metrics (as when we open it for ourselves).
 	/// \return The Reader if the image is cached; otherwise 0
-	Reader * open(FileIndex) throw();
+	Reader * open(FileIndex, bool counted = true) throw();
+
+	/// Acquire the prefix Image associated with the FileIndex.
+	/// \return A smart pointer that references the prefix or 0 if none.
+	ImageConstPointer prefix(FileIndex) throw();
 
-	/// Return the size of the Image associated with FileIndex or
+	/// Return the size of the complete Image associated with FileIndex or
 	/// -1 if none.
-	ssize_t sizeOf(FileIndex) throw();
+	/// If persisted, it is set to whether the image is only persisted.
+	ssize_t sizeOf(FileIndex, bool * persisted = 0) throw();
+
+	/// Return the Ends of the complete Image associated with FileIndex,
+	/// whether it is still cached or not.
+	/// \return A smart pointer that references the Ends or 0 if none.
+	EndsConstPointer ends(FileIndex) throw();
+
+	/// Forget the Ends of the Image associated with FileIndex
+	/// (a transcoding did not reproduce them).
+	void forgetEnds(FileIndex) throw();
+
+	/// Write our metrics (see Metrics) to out.
+	void metrics(std::ostream & out) throw();
+
+	/// Change our limits and cull to them.
+	void limit(size_t countLimit, unsigned long long memoryLimit,
+	    time_t timeLimit) throw();
+
+	/// Get our limits.
+	void limits(size_t & countLimit, unsigned long long & memoryLimit,
+	    time_t & timeLimit) throw();
+
+	/// Pin the complete Image associated with the FileIndex so that it
+	/// is not culled.
+	/// \return False if there is none or it is already pinned.
+	bool pin(FileIndex) throw();
+
+	/// Unpin the Image associated with the FileIndex.
+	/// \return False if it was not pinned.
+	bool unpin(FileIndex) throw();
+
+	/// Forget the Image associated with the FileIndex (unless it is in use)
+	/// and any persisted image and Ends of it.
+	/// \return False if there was nothing to forget.
+	bool evict(FileIndex) throw();
+
+	/// Cull every Image that is not in use (persisting what is complete).
+	void flush() throw();
+
+	/// When destroyed, offer our complete images through handoff
+	/// (if a successor takes them) instead of persisting them.
+	void handOffTo(Handoff * handoff) throw();
 
     private:
 	typedef index<FileIndex>::type	ByFileIndex;
@@ -110,12 +201,23 @@ namespace ImageCache {
 	size_t			count;	///< Number of Values in Container
 	unsigned long long	memory;	///< Memory used by all images
 	void cull() throw();
+	boost::condition wake;		///< Our thread, to stop or re-time
 	bool volatile stop;
 	boost::thread thread;		///< Periodic cull thread
 	void run() throw();
-	ImageConstPointer acquire(FileIndex) throw();
+	ImageConstPointer acquire(FileIndex, bool complete) throw();
 	void release(FileIndex) throw();
 	void persist(FileIndex const, ImageConst * image) throw();
+	typedef std::list<std::pair<FileIndex, EndsConstPointer> > EndsList;
+	typedef std::map<FileIndex, EndsList::iterator> EndsMap;
+	size_t	endsHeadSize;		///< Size of Ends head to keep
+	size_t	endsTailSize;		///< Size of Ends tail to keep
+	size_t	endsCountLimit;		///< Cull LRU Ends beyond this count
+	EndsList	endsList;	///< Ends, Least Recently Used first
+	EndsMap		endsMap;	///< Ends in endsList by FileIndex
+	void keepEnds(FileIndex const, ImageConst * image) throw();
+	std::set<FileIndex>	pinned;	///< In use until unpinned
+	Handoff *	handoff;	///< To offer our images to, if any
     };
 }
 
@@ -0,0 +1,221 @@
+/// \file
+/// A micro-benchmark of the ImageCache::Container with synthetic images.
+/// <p>
+/// For entry counts that scale by ten from a thousand (to a million, by
+/// default) it measures adding images, culling them and, for thread counts
+/// that double from one (to 64, by default), asking for their size and
+/// reading them through an ImageReader.
+/// For each, it reports operations per second, the 99th percentile latency
+/// and, when adding, the memory overhead per entry beyond its image.
+/// <p>
+/// Copyright (c) 2009 Ross Tyler.
+/// This file may be copied under the terms of the
+/// GNU Lesser General Public License (LGPL).
+/// See COPYING file for details.
+
+#include <algorithm>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include <malloc.h>
+#include <unistd.h>
+
+#include <boost/bind/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+
+#include "ImageCache.h"
+#include "Utility.h"
+
+/// \return The bytes allocated (and not freed) by this process.
+static long long allocatedBytes() throw() {
+    return mallinfo2().uordblks;
+}
+
+/// \return The synthetic FileIndex of entry i.
+static FileIndex fileIndexOf(size_t i) throw() {
+    FileIndex fileIndex;
+    fileIndex.fileSystem = 1;
+    fileIndex.inode = i + 1;
+    fileIndex.time = 1;
+    return fileIndex;
+}
+
+/// \return A new synthetic image of size bytes.
+static Image * newImage(size_t size) throw() {
+    static std::string const content(size, 'x');
+    Image * image = new Image(0);
+    image->append(content.data(), content.size());
+    return image;
+}
+
+/// The latencies (in seconds) of the operations measured.
+typedef std::vector<double> Latencies;
+
+/// Write a line reporting ops operations taking seconds
+/// with latencies and, if not negative, overhead bytes per entry.
+static void report(char const * operation, size_t entries, unsigned threads,
+	size_t ops, double seconds, Latencies & latencies,
+	double overhead = -1) throw() {
+    double p99 = 0;
+    if (!latencies.empty()) {
+	Latencies::iterator it = latencies.begin() + latencies.size() * 99 / 100;
+	std::nth_element(latencies.begin(), it, latencies.end());
+	p99 = *it;
+    }
+    std::cout << std::left << std::setw(8) << operation << std::right
+	<< std::setw(10) << entries
+	<< std::setw(8) << threads
+	<< std::fixed << std::setprecision(0)
+	<< std::setw(14) << (seconds ? ops / seconds : 0)
+	<< std::setprecision(2)
+	<< std::setw(12) << p99 * 1e6;
+    if (0 <= overhead) {
+	std::cout << std::setprecision(0) << std::setw(14) << overhead;
+    }
+    std::cout << std::endl;
+}
+
+/// What each thread measuring lookups does.
+struct Lookup {
+    ImageCache::Container *	cache;
+    size_t			entries;
+    size_t			ops;
+    size_t			imageSize;
+    bool			read;	///< ... or only ask for size
+    boost::barrier *		barrier;
+    Latencies			latencies;
+
+    void run(unsigned seed) throw() {
+	std::minstd_rand random(seed);
+	std::vector<char> buffer(imageSize);
+	latencies.reserve(ops);
+	barrier->wait();
+	for (size_t i = 0; i < ops; ++i) {
+	    FileIndex fileIndex = fileIndexOf(random() % entries);
+	    double began = Utility::now();
+	    if (read) {
+		// acquire, read and release the image
+		Reader * reader = cache->open(fileIndex);
+		if (reader) {
+		    reader->read(&buffer[0], buffer.size(), 0);
+		    delete reader;
+		}
+	    } else {
+		cache->sizeOf(fileIndex);
+	    }
+	    latencies.push_back(Utility::now() - began);
+	}
+    }
+};
+
+/// Measure lookups of entries in cache by threads.
+static void lookups(ImageCache::Container & cache, size_t entries,
+	unsigned threads, size_t ops, size_t imageSize, bool read) throw() {
+    std::vector<Lookup> lookups(threads);
+    boost::barrier barrier(threads + 1);
+    boost::thread_group group;
+    for (unsigned i = 0; i < threads; ++i) {
+	Lookup & lookup = lookups[i];
+	lookup.cache = &cache;
+	lookup.entries = entries;
+	lookup.ops = ops / threads;
+	lookup.imageSize = imageSize;
+	lookup.read = read;
+	lookup.barrier = &barrier;
+	group.create_thread(boost::bind(&Lookup::run, &lookup, i + 1));
+    }
+    barrier.wait();
+    double began = Utility::now();
+    group.join_all();
+    double seconds = Utility::now() - began;
+    Latencies latencies;
+    for (unsigned i = 0; i < threads; ++i) {
+	latencies.insert(latencies.end(),
+	    lookups[i].latencies.begin(), lookups[i].latencies.end());
+    }
+    report(read ? "read" : "sizeOf", entries, threads,
+	latencies.size(), seconds, latencies);
+}
+
+/// Measure a cache of entries.
+static void bench(size_t entries, unsigned maxThreads, size_t ops,
+	size_t imageSize) throw() {
+    // no periodic culling (and no waiting for its thread)
+    time_t const never = std::numeric_limits<time_t>::max();
+    ImageCache::Container cache(entries,
+	std::numeric_limits<unsigned long long>::max(), never, -1, -1);
+
+    // add
+    Latencies latencies;
+    latencies.reserve(entries);
+    long long allocated = allocatedBytes();
+    double began = Utility::now();
+    for (size_t i = 0; i < entries; ++i) {
+	Image * image = newImage(imageSize);
+	double added = Utility::now();
+	cache.add(fileIndexOf(i), image);
+	latencies.push_back(Utility::now() - added);
+    }
+    double seconds = Utility::now() - began;
+    double overhead = static_cast<double>(allocatedBytes() - allocated)
+	/ entries - imageSize;
+    report("add", entries, 1, entries, seconds, latencies,
+	overhead > 0 ? overhead : 0);
+
+    for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+	lookups(cache, entries, threads, ops, imageSize, false);
+    }
+    for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+	lookups(cache, entries, threads, ops, imageSize, true);
+    }
+
+    // add beyond our limit so that each add culls the least recently used
+    latencies.clear();
+    began = Utility::now();
+    for (size_t i = entries; i < 2 * entries; ++i) {
+	Image * image = newImage(imageSize);
+	double added = Utility::now();
+	cache.add(fileIndexOf(i), image);
+	latencies.push_back(Utility::now() - added);
+    }
+    seconds = Utility::now() - began;
+    report("cull", entries, 1, entries, seconds, latencies);
+}
+
+/// The main function.
+int main(int argc, char ** argv) throw() {
+    size_t maxEntries = 1000000;
+    unsigned maxThreads = 64;
+    size_t ops = 1000000;
+    size_t imageSize = 64;
+    int option;
+    while (-1 != (option = getopt(argc, argv, "e:t:o:s:"))) {
+	switch (option) {
+	case 'e': maxEntries = strtoul(optarg, 0, 0); break;
+	case 't': maxThreads = strtoul(optarg, 0, 0); break;
+	case 'o': ops = strtoul(optarg, 0, 0); break;
+	case 's': imageSize = strtoul(optarg, 0, 0); break;
+	default:
+	    std::cerr << "usage: " << argv[0]
+		<< " [-e maxEntries] [-t maxThreads] [-o opsPerRun]"
+		" [-s imageSize]" << std::endl;
+	    return 2;
+	}
+    }
+    if (!imageSize) imageSize = 1;
+    std::cout << std::left << std::setw(8) << "op" << std::right
+	<< std::setw(10) << "entries"
+	<< std::setw(8) << "threads"
+	<< std::setw(14) << "ops/s"
+	<< std::setw(12) << "p99(us)"
+	<< std::setw(14) << "overhead(B)" << std::endl;
+    for (size_t entries = 1000; entries <= maxEntries; entries *= 10) {
+	bench(entries, maxThreads, ops, imageSize);
+    }
+    return 0;
+}
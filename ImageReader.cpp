@@ -9,6 +9,7 @@
 #include <errno.h>
 
 #include "ImageReader.h"
+#include "Metrics.h"
 
 ImageReader::ImageReader(
     FileIndex fileIndex_, ImageConstPointer imageConstPointer_) throw()
@@ -26,6 +27,7 @@ ImageReader::ImageReader(
     size_t available = imageConstPointer->size() - offset;
     size_t copy = size < available ? size : available;
     imageConstPointer->copy(offset, copy, buffer);
+    Metrics::imageReaderBytes += copy;
     return copy;
 }
 
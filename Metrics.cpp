@@ -0,0 +1,281 @@
+/// \file
+/// Definitions in the Metrics namespace.
+/// <p>
+/// Copyright (c) 2009 Ross Tyler.
+/// This file may be copied under the terms of the
+/// GNU Lesser General Public License (LGPL).
+/// See COPYING file for details.
+
+#include <map>
+#include <sstream>
+
+#include "Metrics.h"
+
+namespace Metrics {
+
+    Histogram::Histogram() throw() : microseconds(0) {
+	for (size_t i = 0; i < buckets; ++i) counts[i] = 0;
+    }
+
+    void Histogram::record(double seconds) throw() {
+	unsigned long long duration
+	    = seconds > 0 ? static_cast<unsigned long long>(seconds * 1e6) : 0;
+	// bucket i counts durations less than 2 ** i microseconds
+	size_t i = 0;
+	while (duration >> i && i < buckets - 1) ++i;
+	++counts[i];
+	microseconds += duration;
+    }
+
+    void Histogram::write(std::ostream & out, char const * name,
+	    char const * labels) const throw() {
+	std::string prefix = labels ? std::string(labels) + "," : "";
+	std::string bucket = std::string(name) + "_bucket";
+	unsigned long long count = 0;
+	for (size_t i = 0; i < buckets; ++i) {
+	    count += counts[i];
+	    std::ostringstream le;
+	    le.precision(15);
+	    le << prefix << "le=\"";
+	    if (i < buckets - 1) {
+		le << static_cast<double>(1ULL << i) / 1e6;
+	    } else {
+		le << "+Inf";
+	    }
+	    le << '"';
+	    sample(out, bucket.c_str(), count, le.str().c_str());
+	}
+	sample(out, (std::string(name) + "_sum").c_str(),
+	    microseconds / 1e6, labels);
+	sample(out, (std::string(name) + "_count").c_str(), count, labels);
+    }
+
+    Counter	fileReaderBytes(0);
+    Counter	imageReaderBytes(0);
+    Counter	transcodeFileReaderBytes(0);
+    Gauge	transcodes(0);
+    Counter	transcodesStarted(0);
+    Counter	cacheMemoryHits(0);
+    Counter	cacheDiskHits(0);
+    Counter	cacheMisses(0);
+    Counter	cacheEvictions(0);
+    Counter	cachePersisted(0);
+    Counter	cachePersistedBytes(0);
+    Counter	cacheHandedOff(0);
+    Counter	cacheAdopted(0);
+    Counter	warmupTranscodes(0);
+    Counter	warmupPromotions(0);
+
+    Histogram	getattrSeconds;
+    Histogram	openSeconds;
+    Histogram	readSeconds;
+    Histogram	releaseSeconds;
+    Histogram	opendirSeconds;
+    Histogram	readdirSeconds;
+    Histogram	releasedirSeconds;
+    Histogram	getxattrSeconds;
+    Histogram	listxattrSeconds;
+    Histogram	setxattrSeconds;
+
+    Histogram	factoryLockSeconds;
+    Histogram	cacheLockSeconds;
+    Histogram	cwdLockSeconds;
+
+    Histogram	parseSeconds;
+    Histogram	playSeconds;
+    Histogram	firstByteSeconds;
+    Histogram	eosSeconds;
+
+    Usage::Usage() throw()
+    :
+	cpuSeconds(0),
+	wallSeconds(0),
+	mediaSeconds(0),
+	sourceBytes(0),
+	imageBytes(0),
+	peakBytes(0)
+    {}
+
+    /// The Usage of each mapping (by its labels) accumulated
+    /// over how many transcodings.
+    struct Account : Usage {
+	unsigned long long	count;
+	Account() throw() : count(0) {}
+    };
+    typedef std::map<std::string, Account> Accounts;
+    static Accounts accounts;
+    static boost::mutex accountsMutex;
+
+    void account(std::string const & labels, Usage const & usage) throw() {
+	boost::mutex::scoped_lock lock(accountsMutex);
+	Account & account = accounts[labels];
+	++account.count;
+	account.cpuSeconds	+= usage.cpuSeconds;
+	account.wallSeconds	+= usage.wallSeconds;
+	account.mediaSeconds	+= usage.mediaSeconds;
+	account.sourceBytes	+= usage.sourceBytes;
+	account.imageBytes	+= usage.imageBytes;
+	if (account.peakBytes < usage.peakBytes)
+	    account.peakBytes = usage.peakBytes;
+    }
+
+    /// What is written of each Account.
+    static double count(Account const & a) throw() {return a.count;}
+    static double cpu(Account const & a) throw() {return a.cpuSeconds;}
+    static double wall(Account const & a) throw() {return a.wallSeconds;}
+    static double media(Account const & a) throw() {return a.mediaSeconds;}
+    static double source(Account const & a) throw() {return a.sourceBytes;}
+    static double image(Account const & a) throw() {return a.imageBytes;}
+    static double peak(Account const & a) throw() {return a.peakBytes;}
+    static double realtime(Account const & a) throw() {
+	return a.wallSeconds ? a.mediaSeconds / a.wallSeconds : 0;
+    }
+
+    /// Write the accounts of each mapping.
+    static void writeAccounts(std::ostream & out) throw() {
+	static struct {
+	    char const * name;
+	    char const * type;
+	    char const * help;
+	    double (*value)(Account const &);
+	} const metrics[] = {
+	    {"gstfs_mapping_transcodes_total", "counter",
+		"Transcodings accounted for, by mapping.", count},
+	    {"gstfs_mapping_cpu_seconds_total", "counter",
+		"CPU used by pipeline and image builder threads.", cpu},
+	    {"gstfs_mapping_wall_seconds_total", "counter",
+		"Time from launch to end of each transcoding.", wall},
+	    {"gstfs_mapping_media_seconds_total", "counter",
+		"Duration of the media transcoded (when known).", media},
+	    {"gstfs_mapping_source_bytes_total", "counter",
+		"Bytes read from sources.", source},
+	    {"gstfs_mapping_image_bytes_total", "counter",
+		"Bytes of images built.", image},
+	    {"gstfs_mapping_peak_image_bytes", "gauge",
+		"Most image bytes retained by one transcoding at once.", peak},
+	    {"gstfs_mapping_realtime_factor", "gauge",
+		"Media seconds transcoded per wall second.", realtime},
+	};
+	boost::mutex::scoped_lock lock(accountsMutex);
+	if (accounts.empty()) return;
+	for (size_t i = 0; i < sizeof metrics / sizeof *metrics; ++i) {
+	    header(out, metrics[i].name, metrics[i].type, metrics[i].help);
+	    for (Accounts::const_iterator it = accounts.begin();
+		    it != accounts.end(); ++it) {
+		sample(out, metrics[i].name,
+		    metrics[i].value(it->second), it->first.c_str());
+	    }
+	}
+    }
+
+    void header(std::ostream & out,
+	    char const * name, char const * type, char const * help) throw() {
+	out << "# HELP " << name << ' ' << help << '\n'
+	    << "# TYPE " << name << ' ' << type << '\n';
+    }
+
+    void sample(std::ostream & out,
+	    char const * name, double value, char const * labels) throw() {
+	// counts of bytes need more than the default precision
+	std::streamsize precision = out.precision(15);
+	out << name;
+	if (labels) out << '{' << labels << '}';
+	out << ' ' << value << '\n';
+	out.precision(precision);
+    }
+
+    void write(std::ostream & out,
+	    char const * name, char const * type, char const * help,
+	    double value) throw() {
+	header(out, name, type, help);
+	sample(out, name, value);
+    }
+
+    void write(std::ostream & out) throw() {
+	header(out, "gstfs_read_bytes_total", "counter",
+	    "Bytes read, by reader type.");
+	sample(out, "gstfs_read_bytes_total",
+	    fileReaderBytes, "reader=\"FileReader\"");
+	sample(out, "gstfs_read_bytes_total",
+	    imageReaderBytes, "reader=\"ImageReader\"");
+	sample(out, "gstfs_read_bytes_total",
+	    transcodeFileReaderBytes, "reader=\"TranscodeFileReader\"");
+	write(out, "gstfs_transcodes", "gauge",
+	    "Transcodings in progress or waiting to be started.",
+	    transcodes);
+	write(out, "gstfs_transcodes_started_total", "counter",
+	    "Transcoding pipelines started.", transcodesStarted);
+	header(out, "gstfs_cache_opens_total", "counter",
+	    "Opens of cached images, by tier (or miss).");
+	sample(out, "gstfs_cache_opens_total",
+	    cacheMemoryHits, "tier=\"memory\"");
+	sample(out, "gstfs_cache_opens_total",
+	    cacheDiskHits, "tier=\"disk\"");
+	sample(out, "gstfs_cache_opens_total",
+	    cacheMisses, "tier=\"miss\"");
+	write(out, "gstfs_cache_evictions_total", "counter",
+	    "Images culled from memory.", cacheEvictions);
+	write(out, "gstfs_cache_persisted_total", "counter",
+	    "Images persisted to disk when culled.", cachePersisted);
+	write(out, "gstfs_cache_persisted_bytes_total", "counter",
+	    "Bytes of images persisted to disk when culled.",
+	    cachePersistedBytes);
+	header(out, "gstfs_cache_handoffs_total", "counter",
+	    "Images handed off between processes, by direction.");
+	sample(out, "gstfs_cache_handoffs_total",
+	    cacheHandedOff, "direction=\"offered\"");
+	sample(out, "gstfs_cache_handoffs_total",
+	    cacheAdopted, "direction=\"adopted\"");
+	header(out, "gstfs_warmups_total", "counter",
+	    "Popular images warmed when mounted, by how.");
+	sample(out, "gstfs_warmups_total",
+	    warmupTranscodes, "how=\"transcode\"");
+	sample(out, "gstfs_warmups_total",
+	    warmupPromotions, "how=\"promote\"");
+
+	header(out, "gstfs_operation_seconds", "histogram",
+	    "Durations of FUSE operations.");
+	getattrSeconds.write(out, "gstfs_operation_seconds",
+	    "operation=\"getattr\"");
+	openSeconds.write(out, "gstfs_operation_seconds",
+	    "operation=\"open\"");
+	readSeconds.write(out, "gstfs_operation_seconds",
+	    "operation=\"read\"");
+	releaseSeconds.write(out, "gstfs_operation_seconds",
+	    "operation=\"release\"");
+	opendirSeconds.write(out, "gstfs_operation_seconds",
+	    "operation=\"opendir\"");
+	readdirSeconds.write(out, "gstfs_operation_seconds",
+	    "operation=\"readdir\"");
+	releasedirSeconds.write(out, "gstfs_operation_seconds",
+	    "operation=\"releasedir\"");
+	getxattrSeconds.write(out, "gstfs_operation_seconds",
+	    "operation=\"getxattr\"");
+	listxattrSeconds.write(out, "gstfs_operation_seconds",
+	    "operation=\"listxattr\"");
+	setxattrSeconds.write(out, "gstfs_operation_seconds",
+	    "operation=\"setxattr\"");
+
+	header(out, "gstfs_lock_wait_seconds", "histogram",
+	    "Waits for locks (0 if uncontended).");
+	factoryLockSeconds.write(out, "gstfs_lock_wait_seconds",
+	    "lock=\"ReaderFactory\"");
+	cacheLockSeconds.write(out, "gstfs_lock_wait_seconds",
+	    "lock=\"ImageCache\"");
+	cwdLockSeconds.write(out, "gstfs_lock_wait_seconds",
+	    "lock=\"Cwd\"");
+
+	header(out, "gstfs_transcode_phase_seconds", "histogram",
+	    "Durations of transcoding phases, from when each began.");
+	parseSeconds.write(out, "gstfs_transcode_phase_seconds",
+	    "phase=\"parse\"");
+	playSeconds.write(out, "gstfs_transcode_phase_seconds",
+	    "phase=\"play\"");
+	firstByteSeconds.write(out, "gstfs_transcode_phase_seconds",
+	    "phase=\"first_byte\"");
+	eosSeconds.write(out, "gstfs_transcode_phase_seconds",
+	    "phase=\"eos\"");
+
+	writeAccounts(out);
+    }
+}
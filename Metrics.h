@@ -0,0 +1,152 @@
+/// \file
+/// Declarations in the Metrics namespace.
+/// <p>
+/// Copyright (c) 2009 Ross Tyler.
+/// This file may be copied under the terms of the
+/// GNU Lesser General Public License (LGPL).
+/// See COPYING file for details.
+
+#ifndef Metrics_h
+#define Metrics_h
+
+#include <atomic>
+#include <ostream>
+#include <string>
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "Utility.h"
+
+/// Metrics are counted, without locks, where things happen.
+/// They (and gauges sampled from those that own them) are rendered in the
+/// Prometheus text exposition format.
+namespace Metrics {
+
+    typedef std::atomic<unsigned long long> Counter;
+    typedef std::atomic<long long> Gauge;
+
+    /// A Histogram counts durations in buckets whose bounds double
+    /// from a microsecond to over a minute.
+    /// Recording one costs a couple of atomic increments.
+    class Histogram {
+    public:
+	static size_t const buckets = 28;	///< The last is unbounded
+	Histogram() throw();
+
+	/// Record a duration.
+	void record(double seconds) throw();
+
+	/// Write our samples, with labels (if any), as those of the
+	/// histogram metric name.
+	void write(std::ostream & out, char const * name,
+	    char const * labels = 0) const throw();
+
+    private:
+	Counter counts[buckets];	///< Durations in each bucket
+	Counter microseconds;		///< Sum of durations
+    };
+
+    /// A Timer records the duration of its scope in a Histogram.
+    class Timer {
+    private:
+	Histogram &	histogram;
+	double		began;
+    public:
+	Timer(Histogram & histogram_) throw()
+	    : histogram(histogram_), began(Utility::now()) {}
+	~Timer() throw() {
+	    histogram.record(Utility::now() - began);
+	}
+    };
+
+    /// A TimedLock is a scoped lock on a mutex that records how long it
+    /// waited for it in a Histogram.
+    /// An uncontended lock is not timed.
+    class TimedLock : public boost::unique_lock<boost::mutex> {
+    public:
+	TimedLock(boost::mutex & mutex, Histogram & waits) throw()
+	:
+	    boost::unique_lock<boost::mutex>(mutex, boost::try_to_lock)
+	{
+	    if (owns_lock()) {
+		waits.record(0);
+		return;
+	    }
+	    Timer timer(waits);
+	    lock();
+	}
+    };
+
+    /// Durations of each FUSE operation
+    extern Histogram	getattrSeconds;
+    extern Histogram	openSeconds;
+    extern Histogram	readSeconds;
+    extern Histogram	releaseSeconds;
+    extern Histogram	opendirSeconds;
+    extern Histogram	readdirSeconds;
+    extern Histogram	releasedirSeconds;
+    extern Histogram	getxattrSeconds;
+    extern Histogram	listxattrSeconds;
+    extern Histogram	setxattrSeconds;
+
+    /// Waits for locks
+    extern Histogram	factoryLockSeconds;	///< On a ReaderFactory
+    extern Histogram	cacheLockSeconds;	///< On an ImageCache
+    extern Histogram	cwdLockSeconds;		///< On a CwdSynchronized
+
+    /// Durations of each phase of a transcoding
+    extern Histogram	parseSeconds;		///< gst_parse_launch
+    extern Histogram	playSeconds;		///< Until PLAYING
+    extern Histogram	firstByteSeconds;	///< Until first byte built
+    extern Histogram	eosSeconds;		///< Until end of stream
+
+    extern Counter	fileReaderBytes;	///< Read by FileReaders
+    extern Counter	imageReaderBytes;	///< Read by ImageReaders
+    extern Counter	transcodeFileReaderBytes; ///< ... TranscodeFileReaders
+    extern Gauge	transcodes;		///< TranscodeFileReaders now
+    extern Counter	transcodesStarted;	///< Pipelines started
+    extern Counter	cacheMemoryHits;	///< Opened from memory
+    extern Counter	cacheDiskHits;		///< Opened from persisted files
+    extern Counter	cacheMisses;		///< Not opened from either
+    extern Counter	cacheEvictions;		///< Culled from memory
+    extern Counter	cachePersisted;		///< Persisted when culled
+    extern Counter	cachePersistedBytes;	///< ... bytes of them
+    extern Counter	cacheHandedOff;		///< To a successor
+    extern Counter	cacheAdopted;		///< From a predecessor
+    extern Counter	warmupTranscodes;	///< Read ahead when mounted
+    extern Counter	warmupPromotions;	///< Persisted copied to memory
+
+    /// The Usage of resources by a transcoding.
+    struct Usage {
+	double			cpuSeconds;	///< By all of its threads
+	double			wallSeconds;	///< From launch to end
+	double			mediaSeconds;	///< Of media transcoded
+	unsigned long long	sourceBytes;	///< Read from its source
+	unsigned long long	imageBytes;	///< Built into its images
+	unsigned long long	peakBytes;	///< Most retained at once
+	Usage() throw();
+    };
+
+    /// Account for the Usage of a transcoding
+    /// along with others of the mapping with these labels.
+    void account(std::string const & labels, Usage const &) throw();
+
+    /// Write the HELP and TYPE (counter or gauge) of the metric name.
+    void header(std::ostream & out,
+	char const * name, char const * type, char const * help) throw();
+
+    /// Write a sample of the metric name with its value and labels, if any.
+    void sample(std::ostream & out,
+	char const * name, double value, char const * labels = 0) throw();
+
+    /// Write the header and sample of a metric without labels.
+    void write(std::ostream & out,
+	char const * name, char const * type, char const * help,
+	double value) throw();
+
+    /// Write what is counted here.
+    void write(std::ostream & out) throw();
+}
+
+#endif
@@ -0,0 +1,164 @@
+/// \file
+/// Definition of the Popularity class.
+/// <p>
+/// Copyright (c) 2009 Ross Tyler.
+/// This file may be copied under the terms of the
+/// GNU Lesser General Public License (LGPL).
+/// See COPYING file for details.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+
+#include <boost/bind/bind.hpp>
+
+#include "Popularity.h"
+
+Popularity::Popularity(std::string const & path_, double halfLife_,
+	size_t countLimit_, time_t saveInterval_) throw()
+:
+    path(path_),
+    halfLife(0 < halfLife_ ? halfLife_ : 1),
+    countLimit(countLimit_),
+    saveInterval(saveInterval_),
+    map(),
+    stop(false),
+    thread()
+{
+    load();
+    thread = boost::thread(boost::bind(&Popularity::run, this));
+}
+
+Popularity::~Popularity() throw() {
+    {
+	Synchronized synchronized(*this);
+	stop = true;
+	synchronized.notify();
+    }
+    thread.join();
+    save();
+}
+
+double Popularity::scoreOf(Entry const & entry, time_t now) const throw() {
+    return now > entry.time
+	? entry.score * exp2(-(now - entry.time) / halfLife)
+	: entry.score;
+}
+
+void Popularity::load() throw() {
+    std::ifstream in(path.c_str());
+    std::string line;
+    while (std::getline(in, line)) {
+	std::istringstream fields(line);
+	Entry entry;
+	FileIndex fileIndex;
+	if (fields >> entry.score >> entry.time >> fileIndex
+		&& std::getline(fields >> std::ws, entry.path)
+		&& !entry.path.empty()) {
+	    map[fileIndex] = entry;
+	}
+    }
+}
+
+void Popularity::prune(size_t count, time_t now) throw() {
+    if (map.size() <= count) return;
+    // find the score of the count'th most popular and forget those below it
+    std::vector<double> scores;
+    scores.reserve(map.size());
+    for (Map::const_iterator it = map.begin(); it != map.end(); ++it) {
+	scores.push_back(scoreOf(it->second, now));
+    }
+    std::nth_element(scores.begin(), scores.begin() + count, scores.end(),
+	std::greater<double>());
+    double least = scores[count];
+    Map::iterator it = map.begin();
+    while (it != map.end() && count < map.size()) {
+	if (scoreOf(it->second, now) <= least) {
+	    map.erase(it++);
+	} else {
+	    ++it;
+	}
+    }
+}
+
+void Popularity::save() throw() {
+    // write a copy so that we are not locked while we do
+    Map copy;
+    {
+	Synchronized synchronized(*this);
+	prune(countLimit, time(0));
+	copy = map;
+    }
+    // replace our file atomically so that a crash cannot leave half of it
+    std::string temp = path + ".tmp";
+    {
+	std::ofstream out(temp.c_str());
+	for (Map::iterator it = copy.begin(); it != copy.end(); ++it) {
+	    FileIndex fileIndex = it->first;
+	    out << it->second.score << ' ' << it->second.time << ' '
+		<< fileIndex << ' ' << it->second.path << '\n';
+	}
+	out.close();
+	if (!out) {
+	    std::cerr << "popularity: cannot save " << path << std::endl;
+	    remove(temp.c_str());
+	    return;
+	}
+    }
+    rename(temp.c_str(), path.c_str());
+}
+
+void Popularity::run() throw() {
+    for (;;) {
+	{
+	    Synchronized synchronized(*this);
+	    if (!stop) {
+		synchronized.wait(boost::get_system_time()
+		    + boost::posix_time::seconds(saveInterval));
+	    }
+	    if (stop) return;
+	}
+	save();
+    }
+}
+
+void Popularity::touch(FileIndex const & fileIndex, char const * path_)
+	throw() {
+    // a path that cannot be saved on a line of its own is not remembered
+    if (strchr(path_, '\n')) return;
+    time_t now = time(0);
+    Synchronized synchronized(*this);
+    Entry & entry = map[fileIndex];
+    entry.score = scoreOf(entry, now) + 1;
+    entry.time = now;
+    if (entry.path != path_) entry.path = path_;
+    // don't let those that are opened only once grow us without limit
+    if (2 * countLimit < map.size()) prune(countLimit, now);
+}
+
+void Popularity::hottest(size_t count, Hottest & hottest) throw() {
+    time_t now = time(0);
+    std::vector<std::pair<double, Map::const_iterator> > scores;
+    Synchronized synchronized(*this);
+    scores.reserve(map.size());
+    for (Map::const_iterator it = map.begin(); it != map.end(); ++it) {
+	scores.push_back(std::make_pair(scoreOf(it->second, now), it));
+    }
+    count = std::min(count, scores.size());
+    std::partial_sort(scores.begin(), scores.begin() + count, scores.end(),
+	boost::bind(&std::pair<double, Map::const_iterator>::first,
+	    boost::placeholders::_1)
+	> boost::bind(&std::pair<double, Map::const_iterator>::first,
+	    boost::placeholders::_2));
+    hottest.clear();
+    for (size_t i = 0; i < count; ++i) {
+	hottest.push_back(std::make_pair(scores[i].second->first,
+	    scores[i].second->second.path));
+    }
+}
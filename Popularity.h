@@ -0,0 +1,74 @@
+/// \file
+/// Declaration of the Popularity class.
+/// <p>
+/// Copyright (c) 2009 Ross Tyler.
+/// This file may be copied under the terms of the
+/// GNU Lesser General Public License (LGPL).
+/// See COPYING file for details.
+
+#ifndef Popularity_h_
+#define Popularity_h_
+
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "FileIndex.h"
+#include "Synchronizable.h"
+
+/// A Popularity keeps a score for each target file (by FileIndex, with its
+/// path) that counts how often it is opened, decayed by half every halfLife
+/// seconds, so that what has been popular can be warmed when next mounted.
+/// It is loaded from its file when constructed, saved to it periodically
+/// (and when destroyed) and remembers no more than countLimit files,
+/// forgetting the least popular.
+/// <p>
+/// Each line of its file is a score, when it was last opened (seconds
+/// since the epoch), the FileIndex and the path of a file.
+class Popularity : private Synchronizable<boost::mutex> {
+public:
+    /// Files, hottest first, by FileIndex and path.
+    typedef std::vector<std::pair<FileIndex, std::string> > Hottest;
+
+private:
+    struct Entry {
+	double		score;		///< As of time
+	time_t		time;		///< Last opened
+	std::string	path;
+    };
+    typedef std::map<FileIndex, Entry> Map;
+
+    std::string const path;	///< Of our file
+    double const halfLife;
+    size_t const countLimit;
+    time_t const saveInterval;
+    Map map;
+    bool stop;
+    boost::thread thread;	///< Periodic save thread
+
+    double scoreOf(Entry const &, time_t now) const throw();
+    void load() throw();
+    void prune(size_t count, time_t now) throw();
+    void save() throw();
+    void run() throw();
+
+public:
+    /// Load our table from the file at path, if there is one.
+    Popularity(std::string const & path, double halfLife,
+	size_t countLimit = 10000, time_t saveInterval = 5 * 60) throw();
+
+    /// Save our table.
+    ~Popularity() throw();
+
+    /// Count an opening of the file by FileIndex and path.
+    void touch(FileIndex const &, char const * path) throw();
+
+    /// Get (at most) count of the hottest files.
+    void hottest(size_t count, Hottest & hottest) throw();
+};
+
+#endif
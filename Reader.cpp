@@ -15,6 +15,20 @@ Reader::~Reader() throw() {}
 
 ImageConst * Reader::getImage() throw() {return 0;}
 
+bool Reader::building() throw() {return false;}
+
+double Reader::progress() throw() {return 1;}
+
+double Reader::remaining() throw() {return 0;}
+
+double Reader::elapsed() throw() {return 0;}
+
+std::string Reader::location() throw() {return std::string();}
+
+bool Reader::transcodes() throw() {return false;}
+
+void Reader::abandon() throw() {}
+
 Reader::operator unsigned() throw() {return count;}
 
 Reader & Reader::operator ++() throw() {++count; return *this;}
@@ -9,6 +9,8 @@
 #ifndef Reader_h
 #define Reader_h
 
+#include <string>
+
 #include <unistd.h>
 
 #include "FileIndex.h"
@@ -36,6 +38,30 @@ public:
     /// Return complete target image or 0 if none.
     virtual ImageConst * getImage() throw();
 
+    /// Return true if a target image is being built that #getImage
+    /// will offer when it is complete.
+    virtual bool building() throw();
+
+    /// Return the fraction of the target that is complete.
+    virtual double progress() throw();
+
+    /// Return the estimated number of seconds until the target is complete.
+    virtual double remaining() throw();
+
+    /// Return the number of seconds spent building the target so far.
+    virtual double elapsed() throw();
+
+    /// Return the location of what is read, if known.
+    virtual std::string location() throw();
+
+    /// Return true if what we read is transcoded
+    /// (rather than passed through or read from a cache).
+    virtual bool transcodes() throw();
+
+    /// Tell us that we have been released for good
+    /// (no one can find us any more) and are about to be destroyed.
+    virtual void abandon() throw();
+
     operator unsigned() throw();
     Reader & operator ++() throw();
     Reader & operator --() throw();
@@ -6,10 +6,30 @@
 /// GNU Lesser General Public License (LGPL).
 /// See COPYING file for details.
 
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <list>
+#include <iomanip>
+#include <utility>
+
 #include "ImageReader.h"
 #include "FileReader.h"
+#include "Metrics.h"
 #include "ReaderFactory.h"
+#include "Trace.h"
 #include "TranscodeFileReader.h"
+#include "Utility.h"
+
+/// Return the FileIndex variant for transcoding with the transcodeElement.
+/// Only one whose source file may also be transcoded by others
+/// (whose decoding may be shared or whose source extension overlaps theirs)
+/// needs one (to tell its image from theirs).
+static unsigned variantOf(Transcode::Element const & transcodeElement)
+	throw() {
+    return transcodeElement.decode || transcodeElement.shared
+	? transcodeElement.variant : 0;
+}
 
 ReaderFactory::ReadAheadRelease::ReadAheadRelease(
     ReaderFactory & readerFactory_) throw()
@@ -36,13 +56,17 @@ Reader * ReaderFactory::ReadAheadRelease::pop() throw() {
 	    deque.pop_front();
 	    return reader;
 	}
-	if (!readerFactory.readAheadCount && stop) return 0;
+	// readAheadCount is ours to read only when we are stopping:
+	// nothing more is read ahead and only push (with our lock) changes it.
+	if (stop && !readerFactory.readAheadCount) return 0;
 	synchronized.wait();
     }
 }
 
 void ReaderFactory::ReadAheadRelease::push(Reader * reader) throw() {
     Synchronized synchronized(*this);
+    // our caller holds a lock on readerFactory too
+    --readerFactory.readAheadCount;
     deque.push_back(reader);
     synchronized.notify();
 }
@@ -53,43 +77,238 @@ void ReaderFactory::ReadAheadRelease::run() throw() {
     }
 }
 
+ReaderFactory::Reaper::Reaper(size_t limit_) throw()
+:
+    limit(limit_),
+    stop(false),
+    count(0),
+    total(0),
+    longest(0),
+    thread(boost::bind(&Reaper::run, this))
+{}
+
+ReaderFactory::Reaper::~Reaper() throw() {
+    {
+	Synchronized synchronized(*this);
+	stop = true;
+	synchronized.notify();
+    }
+    thread.join();
+}
+
+Reader * ReaderFactory::Reaper::pop() throw() {
+    Synchronized synchronized(*this);
+    for (;;) {
+	if (deque.size()) {
+	    Reader * reader = deque.front();
+	    deque.pop_front();
+	    return reader;
+	}
+	if (stop) return 0;
+	synchronized.wait();
+    }
+}
+
+void ReaderFactory::Reaper::push(Reader * reader) throw() {
+    // nothing should start what is waiting to be destroyed
+    reader->abandon();
+    {
+	Synchronized synchronized(*this);
+	if (deque.size() < limit) {
+	    deque.push_back(reader);
+	    synchronized.notify();
+	    return;
+	}
+    }
+    // our queue is full, so the caller must wait for it
+    reap(reader);
+}
+
+void ReaderFactory::Reaper::reap(Reader * reader) throw() {
+    double began = Utility::now();
+    delete reader;
+    double elapsed = Utility::now() - began;
+    Synchronized synchronized(*this);
+    ++count;
+    total += elapsed;
+    if (longest < elapsed) longest = elapsed;
+}
+
+void ReaderFactory::Reaper::run() throw() {
+    while (Reader * reader = pop()) {
+	reap(reader);
+    }
+}
+
+void ReaderFactory::Reaper::stats(
+	unsigned long & count_, double & total_, double & longest_,
+	size_t & queued) throw() {
+    Synchronized synchronized(*this);
+    count_ = count;
+    total_ = total;
+    longest_ = longest;
+    queued = deque.size();
+}
+
+ReaderFactory::Warmup::Warmup(ReaderFactory & readerFactory_, size_t count_,
+	unsigned jobs_, unsigned long long memory_) throw()
+:
+    readerFactory(readerFactory_),
+    count(count_),
+    jobs(jobs_ ? jobs_ : 1),
+    memory(memory_),
+    stop(false),
+    thread(boost::bind(&Warmup::run, this))
+{}
+
+ReaderFactory::Warmup::~Warmup() throw() {
+    {
+	Synchronized synchronized(*this);
+	stop = true;
+	synchronized.notify();
+    }
+    thread.join();
+}
+
+/// \return False if we should stop
+bool ReaderFactory::Warmup::pause() throw() {
+    Synchronized synchronized(*this);
+    if (!stop) {
+	synchronized.wait(boost::get_system_time()
+	    + boost::posix_time::seconds(1));
+    }
+    return !stop;
+}
+
+void ReaderFactory::Warmup::run() throw() {
+    Popularity::Hottest hottest;
+    readerFactory.popularity->hottest(count, hottest);
+    typedef std::list<std::pair<std::string, ssize_t> > Warming;
+    Warming warming;			///< Read ahead for us, with estimates
+    unsigned long long warmed = 0;	///< Bytes of images warmed
+    unsigned long long reserved = 0;	///< ... and estimated for warming
+    for (Popularity::Hottest::iterator it = hottest.begin();
+	    it != hottest.end() && warmed < memory;) {
+	// account for those that are no longer transcoding
+	State state;
+	for (Warming::iterator warm = warming.begin();
+		warm != warming.end();) {
+	    bool known = readerFactory.state(warm->first.c_str(), state);
+	    if (known && 0 == strcmp(state.name, "transcoding")) {
+		++warm;
+		continue;
+	    }
+	    reserved -= warm->second;
+	    if (known && 0 == strcmp(state.name, "memory")) {
+		warmed += state.size;
+	    }
+	    warming.erase(warm++);
+	}
+	// wait for room beside others
+	if (!(warming.size() < jobs) || !readerFactory.roomToReadAhead()) {
+	    if (!pause()) return;
+	    continue;
+	}
+
+	// skip what is gone, has changed since, is already warm
+	// or would not fit (by its size or, if that is not known yet,
+	// as estimated by that of its source)
+	char const * path = it->second.c_str();
+	FileIndex fileIndex;
+	if (!readerFactory.fileIndexOf(path, fileIndex)
+		|| fileIndex < it->first || it->first < fileIndex
+		|| !readerFactory.state(path, state)) {
+	    ++it;
+	    continue;
+	}
+	ssize_t estimate = 0 <= state.size ? state.size : state.sourceSize;
+	if (memory < warmed + reserved + estimate) {
+	    ++it;
+	    continue;
+	}
+	if (0 == strcmp(state.name, "disk")) {
+	    if (readerFactory.promote(fileIndex, state.size)) {
+		++Metrics::warmupPromotions;
+		warmed += state.size;
+	    }
+	} else if (0 == strcmp(state.name, "cold")) {
+	    // it might not be (if it is backed off from or others have
+	    // just filled our readAheadLimit), in which case we move on.
+	    readerFactory.readAhead(path);
+	    if (readerFactory.state(path, state)
+		    && 0 == strcmp(state.name, "transcoding")) {
+		++Metrics::warmupTranscodes;
+		warming.push_back(std::make_pair(it->second, estimate));
+		reserved += estimate;
+	    }
+	}
+	++it;
+    }
+}
+
 ReaderFactory::ReaderFactory(
     int baseFd_,
     Transcode::Mapping * transcodeMapping_,
     bool trueSize_,
     size_t readAheadLimit_,
-    size_t countLimit, size_t memoryLimit, time_t timeLimit, int persistFd)
+    size_t countLimit, size_t memoryLimit, time_t timeLimit, int persistFd,
+    size_t endsHeadSize, size_t endsTailSize, size_t endsCountLimit,
+    size_t spillSize, int spillFd,
+    double finishProgress_, double finishRemaining_,
+    bool lazy_, unsigned lazyGrace_,
+    double backoffLimit, bool fallback_, size_t discoveryCountLimit)
 throw()
 :
     baseFd(baseFd_),
     transcodeMapping(transcodeMapping_),
     trueSize(trueSize_),
     readAheadLimit(readAheadLimit_),
-    imageCache(countLimit, memoryLimit, timeLimit, baseFd, persistFd),
+    imageBudget(spillSize, spillFd, memoryLimit),
+    imageCache(countLimit, memoryLimit, timeLimit, baseFd, persistFd,
+	endsHeadSize, endsTailSize, endsCountLimit),
     readAheadCount(0),
-    readAheadRelease(*this)
+    finishProgress(finishProgress_),
+    finishRemaining(finishRemaining_),
+    lazy(lazy_),
+    lazyGrace(lazyGrace_),
+    // back off from a file as soon as it fails
+    // but from a pipeline only if it fails for a few files in a row
+    fileBackoff(1, backoffLimit),
+    pipelineBackoff(3, backoffLimit),
+    fallback(fallback_),
+    discoverer(baseFd, discoveryCountLimit, persistFd),
+    reaper(64),
+    readAheadRelease(*this),
+    popularity(0),
+    warmup(0)
 {}
 
 ReaderFactory::~ReaderFactory() throw() {
-    // we should not have to (and we don't) explicitly do anything.
+    // stop warming before anything it uses goes.
+    if (warmup) delete warmup;
+    // otherwise, we should not have to (and we don't) explicitly do anything.
     // all files explicitly opened we expect to have been explicitly released.
     // implicit readAhead readers will be released as part of
     // implicit destruction of our readAheadRelease member.
+    // released readers will be destroyed as part of
+    // implicit destruction of our reaper member, which follows.
 }
 
-/// For use as a custom deleter for a boost::shared_ptr
-/// when we want nothing to happen.
-struct Noop {
-    void operator()(void const *) const {}
-};
-
 Reader * ReaderFactory::open(char const * path) throw() {
     // with the cooperation of a potential Reader to be constructed
     // guarantee a call to this->readAheadIsDone(Reader *)
     // after we release our lock on this
     boost::shared_ptr<void const> doneGuarantee(static_cast<void const *>(0));
+
+    // find the source for this reader.
+    // this may need to discover what sources have so do it without our lock.
+    Transcode::Element transcodeElement;
+    char sourceBuffer[PATH_MAX];
+    char const * source = transcodeMapping->sourceFrom(path,
+	sourceBuffer, sizeof sourceBuffer, &transcodeElement);
+    bool passThrough = source != path && pass(transcodeElement, source);
     {
-	boost::mutex::scoped_lock lock(*this);
+	Metrics::TimedLock lock(*this, Metrics::factoryLockSeconds);
 
 	bool exists;
 	struct stat st;
@@ -100,14 +319,11 @@ Reader * ReaderFactory::open(char const * path) throw() {
 		&& S_ISDIR(st.st_mode))
 	    return 0;
 
-	// find the source for this reader and if different stat the source
-	Transcode::Element transcodeElement;
-	boost::shared_ptr<char const> source(
-	    transcodeMapping->sourceFrom(path, &transcodeElement));
-	if (source.get() != path) {
+	// if the source is different, stat the source
+	if (source != path) {
 	    // there is a mapping to this target
 	    struct stat st_;
-	    if (-1 != fstatat(baseFd, source.get(), &st_, 0)) {
+	    if (-1 != fstatat(baseFd, source, &st_, 0)) {
 		// there is a source for this mapping, use its stat
 		st = st_;
 	    } else {
@@ -117,12 +333,17 @@ Reader * ReaderFactory::open(char const * path) throw() {
 		    return 0;
 		}
 		// revert to path under base as source
-		source.reset(path, Noop());
+		source = path;
 	    }
 	}
 
 	// this is how we will index the file
-	FileIndex fileIndex(st);
+	FileIndex fileIndex(st,
+	    source == path ? 0 : variantOf(transcodeElement));
+	TRACE_FILE(factory__open, fileIndex);
+	if (popularity && source != path && !passThrough) {
+	    popularity->touch(fileIndex, path);
+	}
 
 	// if there is currently a Reader for this FileIndex, we will use it
 	Map::iterator it = map.find(fileIndex);
@@ -135,26 +356,36 @@ Reader * ReaderFactory::open(char const * path) throw() {
 		// we can not read from the imageCache
 
 		// if we cannot open the file, we are done.
-		int fileFd = openat(baseFd, source.get(), O_RDONLY);
+		int fileFd = openat(baseFd, source, O_RDONLY);
 		if (-1 == fileFd) return 0;
 
-		if (source.get() == path) {
+		if (source == path || passThrough) {
+		    reader = new FileReader(fileIndex, fileFd);
+		} else if (backingOff(fileIndex, transcodeElement)) {
+		    // transcoding has been failing
+		    if (!fallback) {
+			close(fileFd);
+			return 0;
+		    }
+		    // pass the source through instead
 		    reader = new FileReader(fileIndex, fileFd);
 		} else {
-		    if (readAheadCount < readAheadLimit) {
+		    // an image streamed through a window is never complete
+		    // so there is no point in reading it ahead.
+		    // if lazy, we don't want to start it until it is read.
+		    if (!lazy && !transcodeElement.window
+			    && readAheadCount < readAheadLimit) {
 			// the caller and readAheadRelease are responsible for it
-			reader = new TranscodeFileReader(fileIndex, fileFd,
-			    transcodeElement.pipeline,
-			    doneGuarantee,
-			    boost::bind(&ReaderFactory::readAheadIsDone, this, boost::placeholders::_1));
+			reader = newTranscodeFileReader(fileIndex, fileFd, source,
+			    transcodeElement, doneGuarantee,
+			    &ReaderFactory::readAheadIsDone);
 			++*reader;
 			++readAheadCount;
 		    } else {
 			// only the caller is responsible for it
-			reader = new TranscodeFileReader(fileIndex, fileFd,
-			    transcodeElement.pipeline,
-			    doneGuarantee,
-			    boost::bind(&ReaderFactory::nonReadAheadIsDone, this, boost::placeholders::_1));
+			reader = newTranscodeFileReader(fileIndex, fileFd, source,
+			    transcodeElement, doneGuarantee,
+			    &ReaderFactory::nonReadAheadIsDone, lazy);
 		    }
 		}
 	    }
@@ -169,26 +400,170 @@ Reader * ReaderFactory::open(char const * path) throw() {
     }
 }
 
+Reader * ReaderFactory::newTranscodeFileReader(
+	FileIndex fileIndex, int fileFd, char const * source,
+	Transcode::Element const & transcodeElement,
+	boost::shared_ptr<void const> & doneGuarantee,
+	void (ReaderFactory::*done)(Reader *),
+	bool lazy) throw() {
+    // callers should have already obtained a lock on *this!
+    // if we are to resume from a prefix retained in our imageCache
+    // then we will retain any prefix of our own there.
+    ImageConstPointer prefix;
+    boost::function<void (ImageConst *)> retain;
+    boost::function<void (bool)> outcome = boost::bind(&ReaderFactory::outcome,
+	this, fileIndex, transcodeElement.pipeline, boost::placeholders::_1);
+    if (transcodeElement.resume) {
+	prefix = imageCache.prefix(fileIndex);
+	retain = boost::bind(&ImageCache::Container::add, &imageCache,
+	    fileIndex, boost::placeholders::_1, false);
+    }
+    // fan out to those that share our decoding
+    // unless they already have (or are building) an image of their own.
+    std::vector<Transcode::Element> siblings;
+    boost::function<void (unsigned, ImageConst *)> warm;
+    if (transcodeElement.decode) {
+	std::vector<Transcode::Element> elements
+	    = transcodeMapping->fanOut(transcodeElement, source);
+	for (size_t i = 1; i < elements.size(); ++i) {
+	    FileIndex sibling(fileIndex);
+	    sibling.variant = elements[i].variant;
+	    if (0 <= imageCache.sizeOf(sibling)
+		    || map.find(sibling) != map.end())
+		continue;
+	    siblings.push_back(elements[i]);
+	}
+	if (siblings.size()) {
+	    warm = boost::bind(&ReaderFactory::warm, this, fileIndex,
+		boost::placeholders::_1, boost::placeholders::_2);
+	}
+    }
+    return new TranscodeFileReader(fileIndex, fileFd,
+	transcodeElement,
+	doneGuarantee,
+	boost::bind(done, this, boost::placeholders::_1),
+	&imageBudget,
+	prefix,
+	retain,
+	outcome,
+	imageCache.ends(fileIndex),
+	boost::bind(&ImageCache::Container::forgetEnds, &imageCache, fileIndex),
+	lazy,
+	lazyGrace,
+	siblings,
+	warm);
+}
+
 void ReaderFactory::release(Reader * reader) throw() {
-    boost::mutex::scoped_lock lock(*this);
+    TRACE_FILE(factory__release, reader->fileIndex);
+    {
+	Metrics::TimedLock lock(*this, Metrics::factoryLockSeconds);
 
-    if (!--*reader) {
+	if (--*reader) return;
 	if (ImageConst * image = reader->getImage()) {
 	    imageCache.add(reader->fileIndex, image);
+	} else if (finish(reader)) {
+	    return;
 	}
 	map.erase(reader->fileIndex);
-	delete reader;
+    }
+    // no one else can find the reader now.
+    // tearing it down (and its pipeline) can take a while,
+    // so let our reaper do it without our lock.
+    reaper.push(reader);
+}
+
+bool ReaderFactory::finish(Reader * reader) throw() {
+    // callers should have already obtained a lock on *this!
+    if (!(readAheadCount < readAheadLimit)) return false;
+    // we must decide before the reader can be done
+    // (and call nonReadAheadIsDone) or not at all.
+    boost::mutex::scoped_lock lock(finishingMutex);
+    if (!reader->building()) return false;
+    if (!(finishProgress <= reader->progress()
+	    || finishRemaining >= reader->remaining()))
+	return false;
+    finishing.insert(reader);
+    // readAheadRelease is responsible for it
+    ++*reader;
+    ++readAheadCount;
+    return true;
+}
+
+void ReaderFactory::outcome(
+	FileIndex fileIndex, char const * pipeline, bool success) throw() {
+    // we may be called with or without a lock on *this
+    if (success) {
+	fileBackoff.succeed(fileIndex);
+	pipelineBackoff.succeed(pipeline);
+    } else {
+	fileBackoff.fail(fileIndex);
+	pipelineBackoff.fail(pipeline);
     }
 }
 
+void ReaderFactory::warm(
+	FileIndex fileIndex, unsigned variant, ImageConst * image) throw() {
+    // we are called without a lock on *this as a reader is destroyed
+    fileIndex.variant = variant;
+    imageCache.add(fileIndex, image);
+}
+
+bool ReaderFactory::pass(
+	Transcode::Element & transcodeElement, char const * source,
+	bool * undecided) throw() {
+    // we may need to discover what the source has so
+    // we should be called without a lock on *this
+    if (transcodeElement.identity()) return true;
+    if (!transcodeElement.probesPass()) return false;
+    struct stat st;
+    if (-1 == fstatat(baseFd, source, &st, 0) || S_ISDIR(st.st_mode))
+	return false;
+    Discoverer::Properties properties;
+    if (!undecided) {
+	properties = discoverer.discover(FileIndex(st), source);
+    } else if (!discoverer.discovered(FileIndex(st), source, properties)) {
+	*undecided = true;
+	return false;
+    }
+    if (!transcodeElement.passes(
+	    properties.bitrate, properties.caps.c_str()))
+	return false;
+    if (!transcodeElement.remux) return true;
+    // remux the source instead of transcoding it (on its own)
+    transcodeElement.pipeline = transcodeElement.remux;
+    transcodeElement.decode = 0;
+    return false;
+}
+
+bool ReaderFactory::backingOff(
+	FileIndex fileIndex, Transcode::Element const & transcodeElement)
+	throw() {
+    return fileBackoff.backingOff(fileIndex)
+	|| pipelineBackoff.backingOff(transcodeElement.pipeline);
+}
+
 int ReaderFactory::stat(char const * path, struct stat * st) throw() {
     Reader * reader;
+    Transcode::Element transcodeElement;
     // with the cooperation of a potential Reader to be constructed
     // guarantee a call to this->readAheadIsDone(Reader *)
     // after we release our lock on this
     boost::shared_ptr<void const> doneGuarantee(static_cast<void const *>(0));
+
+    // find the source for this target.
+    // this may need to know what sources have but we don't wait for that
+    // to be discovered (each stat of a library scan would).
+    char sourceBuffer[PATH_MAX];
+    bool undecided = false;
+    char const * source = *path
+	? transcodeMapping->sourceFrom(path,
+	    sourceBuffer, sizeof sourceBuffer, &transcodeElement, &undecided)
+	: path;
+    bool passThrough = source != path && !undecided
+	&& pass(transcodeElement, source, &undecided);
     {
-	boost::mutex::scoped_lock lock(*this);
+	Metrics::TimedLock lock(*this, Metrics::factoryLockSeconds);
 
 	if (!*path) {
 	    return -1 == fstat(baseFd, st) ? -errno : 0;
@@ -203,14 +578,11 @@ int ReaderFactory::stat(char const * path, struct stat * st) throw() {
 	    return 0;
 
 	// if there is no mapping to this target, return what we have
-	Transcode::Element transcodeElement;
-	boost::shared_ptr<char const> source(
-	    transcodeMapping->sourceFrom(path, &transcodeElement));
-	if (source.get() == path) return exists ? 0 : -errno;
+	if (source == path) return exists ? 0 : -errno;
 
 	// there is a mapping to this target
 	struct stat st_;
-	if (-1 != fstatat(baseFd, source.get(), &st_, 0)) {
+	if (-1 != fstatat(baseFd, source, &st_, 0)) {
 	    // there is a source for this mapping, use its stat
 	    *st = st_;
 	} else {
@@ -218,8 +590,13 @@ int ReaderFactory::stat(char const * path, struct stat * st) throw() {
 	    return exists ? 0: -errno;
 	}
 
+	// a source passed through is its own size.
+	// until we know how it will be transcoded, so is one that is not.
+	if (passThrough || undecided) return 0;
+
 	// this is how we will index the file
-	FileIndex fileIndex(*st);
+	FileIndex fileIndex(*st, variantOf(transcodeElement));
+	TRACE_FILE(factory__stat, fileIndex);
 
 	// if there is an image cached for this FileIndex,
 	// return stat with its size.
@@ -229,6 +606,14 @@ int ReaderFactory::stat(char const * path, struct stat * st) throw() {
 	    return 0;
 	}
 
+	// if the ends of an image were kept for this FileIndex,
+	// return stat with the size of that image.
+	ImageCache::EndsConstPointer ends = imageCache.ends(fileIndex);
+	if (ends) {
+	    st->st_size = ends->size;
+	    return 0;
+	}
+
 	Map::iterator it = map.find(fileIndex);
 	if (it != map.end()) {
 	    // there is a Reader for this FileIndex
@@ -236,24 +621,28 @@ int ReaderFactory::stat(char const * path, struct stat * st) throw() {
 	    // we are responsible for it
 	    ++*reader;
 
-	} else if (trueSize
-		|| readAheadCount < readAheadLimit) {
+	} else if (!transcodeElement.window
+		&& (trueSize
+		    || readAheadCount < readAheadLimit)
+		&& !backingOff(fileIndex, transcodeElement)) {
 	    // there is no Reader for this FileIndex
-	    // but we could use one.
+	    // but we could use one
+	    // (unless its image is streamed through a window, which is
+	    // never complete, so we won't wait for it or read it ahead,
+	    // or its transcoding has been failing).
 
 	    // if we cannot open the file,
 	    // return error and stat with a size of 0.
-	    int fileFd = openat(baseFd, source.get(), O_RDONLY);
+	    int fileFd = openat(baseFd, source, O_RDONLY);
 	    if (-1 == fileFd) {
 		st->st_size = 0;
 		return -errno;
 	    }
 
 	    // construct a new TranscodeFileReader
-	    reader = new TranscodeFileReader(fileIndex, fileFd,
-		transcodeElement.pipeline,
-		doneGuarantee,
-		boost::bind(&ReaderFactory::readAheadIsDone, this, boost::placeholders::_1));
+	    reader = newTranscodeFileReader(fileIndex, fileFd, source,
+		transcodeElement, doneGuarantee,
+		&ReaderFactory::readAheadIsDone);
 	    map.insert(Map::value_type(fileIndex, reader));
 
 	    // readAheadRelease is responsible for it ...
@@ -273,22 +662,35 @@ int ReaderFactory::stat(char const * path, struct stat * st) throw() {
     }
 
     // read (true?) size and release our hold on the reader
-    st->st_size = reader->size(trueSize);
+    st->st_size = reader->size(trueSize && !transcodeElement.window);
     release(reader);
 
     return 0;
 }
 
-void ReaderFactory::readAhead(char const * path) throw() {
+void ReaderFactory::readAhead(char const * path, bool force) throw() {
     // with the cooperation of a potential Reader to be constructed
     // guarantee a call to this->readAheadIsDone(Reader *)
     // after we release our lock on this
     boost::shared_ptr<void const> doneGuarantee(static_cast<void const *>(0));
+
+    // if there is no mapping to this target, return.
+    // this may need to know what sources have, which (unless forced)
+    // we don't wait for: until it has been discovered, return.
+    Transcode::Element transcodeElement;
+    char sourceBuffer[PATH_MAX];
+    bool undecided = false;
+    bool * undecidedIfAny = force ? 0 : &undecided;
+    char const * source = transcodeMapping->sourceFrom(path,
+	sourceBuffer, sizeof sourceBuffer, &transcodeElement, undecidedIfAny);
+    if (source == path || undecided
+	    || pass(transcodeElement, source, undecidedIfAny) || undecided)
+	return;
     {
-	boost::mutex::scoped_lock lock(*this);
+	Metrics::TimedLock lock(*this, Metrics::factoryLockSeconds);
 
 	// if we are at the readAheadLimit then return
-	if (!(readAheadCount < readAheadLimit)) return;
+	if (!force && !(readAheadCount < readAheadLimit)) return;
 
 	struct stat st;
 
@@ -298,17 +700,14 @@ void ReaderFactory::readAhead(char const * path) throw() {
 		&& S_ISDIR(st.st_mode))
 	    return;
 
-	// if there is no mapping to this target, return
-	Transcode::Element transcodeElement;
-	boost::shared_ptr<char const> source(
-	    transcodeMapping->sourceFrom(path, &transcodeElement));
-	if (source.get() == path) return;
+	// an image streamed through a window is never complete, return
+	if (transcodeElement.window) return;
 
 	// if we cannot stat the source, return
-	if (-1 == fstatat(baseFd, source.get(), &st, 0)) return;
+	if (-1 == fstatat(baseFd, source, &st, 0)) return;
 
 	// this is how we will index the file
-	FileIndex fileIndex(st);
+	FileIndex fileIndex(st, variantOf(transcodeElement));
 
 	// if there is an image cached for this FileIndex, return
 	if (0 <= imageCache.sizeOf(fileIndex)) return;
@@ -316,15 +715,18 @@ void ReaderFactory::readAhead(char const * path) throw() {
 	// if there is currently a Reader for this FileIndex, return
 	if (map.find(fileIndex) != map.end()) return;
 
+	// if its transcoding has been failing, return
+	if (backingOff(fileIndex, transcodeElement)) return;
+
 	// if we cannot open the file, return
-	int fileFd = ::openat(baseFd, source.get(), O_RDONLY);
+	int fileFd = ::openat(baseFd, source, O_RDONLY);
 	if (-1 == fileFd) return;
 
 	// construct a new TranscodeFileReader
-	Reader * reader = new TranscodeFileReader(fileIndex, fileFd,
-	    transcodeElement.pipeline,
-	    doneGuarantee,
-	    boost::bind(&ReaderFactory::readAheadIsDone, this, boost::placeholders::_1));
+	TRACE_FILE(factory__read__ahead, fileIndex);
+	Reader * reader = newTranscodeFileReader(fileIndex, fileFd, source,
+	    transcodeElement, doneGuarantee,
+	    &ReaderFactory::readAheadIsDone);
 	map.insert(Map::value_type(fileIndex, reader));
 
 	// readAheadRelease is responsible for it
@@ -333,10 +735,268 @@ void ReaderFactory::readAhead(char const * path) throw() {
     }
 }
 
+bool ReaderFactory::select(
+	Transcode::Element const & transcodeElement, char const * source,
+	bool * undecided) throw() {
+    // we may be called with or without a lock on *this
+    struct stat st;
+    if (-1 == fstatat(baseFd, source, &st, 0) || S_ISDIR(st.st_mode))
+	return false;
+    if (!transcodeElement.probes()) return true;
+    Discoverer::Properties properties;
+    if (!undecided) {
+	properties = discoverer.discover(FileIndex(st), source);
+    } else if (!discoverer.discovered(FileIndex(st), source, properties)) {
+	*undecided = true;
+	return false;
+    }
+    return transcodeElement.admits(
+	properties.rate, properties.channels, properties.bitrate);
+}
+
+void ReaderFactory::metrics(std::ostream & out) throw() {
+    {
+	Metrics::TimedLock lock(*this, Metrics::factoryLockSeconds);
+	Metrics::write(out, "gstfs_readers", "gauge",
+	    "Readers open (or left to finish).", map.size());
+	Metrics::write(out, "gstfs_read_ahead", "gauge",
+	    "Transcodings read ahead (or left to finish).", readAheadCount);
+	Metrics::write(out, "gstfs_read_ahead_limit", "gauge",
+	    "Limit of transcodings read ahead.", readAheadLimit);
+    }
+    imageCache.metrics(out);
+    Metrics::write(out, "gstfs_transcode_failures_total", "counter",
+	"Transcodings that failed.", fileBackoff.failed());
+    Metrics::header(out, "gstfs_backing_off", "gauge",
+	"Files and pipelines being backed off from.");
+    Metrics::sample(out, "gstfs_backing_off", fileBackoff.size(),
+	"of=\"file\"");
+    Metrics::sample(out, "gstfs_backing_off", pipelineBackoff.size(),
+	"of=\"pipeline\"");
+    unsigned long count;
+    double total, longest;
+    size_t queued;
+    reaper.stats(count, total, longest, queued);
+    Metrics::write(out, "gstfs_reaped_total", "counter",
+	"Readers destroyed after release.", count);
+    Metrics::write(out, "gstfs_reaped_seconds_total", "counter",
+	"Seconds spent destroying readers.", total);
+    Metrics::write(out, "gstfs_reaped_seconds_max", "gauge",
+	"Longest time spent destroying a reader.", longest);
+    Metrics::write(out, "gstfs_reaper_queued", "gauge",
+	"Readers waiting to be destroyed.", queued);
+}
+
+void ReaderFactory::status(std::ostream & out) throw() {
+    Metrics::TimedLock lock(*this, Metrics::factoryLockSeconds);
+    for (Map::iterator it = map.begin(); it != map.end(); ++it) {
+	Reader * reader = it->second;
+	double elapsed = reader->elapsed();
+	double progress = reader->progress();
+	if (!elapsed || 1 <= progress) continue;
+	size_t size = reader->size(false);
+	double remaining = reader->remaining();
+	out << std::fixed
+	    << std::setprecision(1) << std::setw(5) << progress * 100 << "% "
+	    << std::setw(12) << size << ' '
+	    << std::setprecision(0) << std::setw(10) << size / elapsed
+	    << "B/s ";
+	if (remaining < 1e6) {
+	    out << std::setw(6) << remaining << "s ";
+	} else {
+	    out << std::setw(7) << "? ";
+	}
+	out << reader->location() << '\n';
+    }
+}
+
+void ReaderFactory::tune(size_t readAheadLimit_,
+	size_t imageCacheCountLimit,
+	unsigned long long imageCacheMemoryLimit,
+	time_t imageCacheTimeLimit) throw() {
+    // one tuning at a time
+    Metrics::TimedLock lock(*this, Metrics::factoryLockSeconds);
+    readAheadLimit = readAheadLimit_;
+    // images being built spill sooner (or later) as cached ones are culled
+    imageBudget.limit(imageCacheMemoryLimit);
+    imageCache.limit(
+	imageCacheCountLimit, imageCacheMemoryLimit, imageCacheTimeLimit);
+}
+
+void ReaderFactory::tuning(size_t & readAheadLimit_,
+	size_t & imageCacheCountLimit,
+	unsigned long long & imageCacheMemoryLimit,
+	time_t & imageCacheTimeLimit) throw() {
+    Metrics::TimedLock lock(*this, Metrics::factoryLockSeconds);
+    readAheadLimit_ = readAheadLimit;
+    imageCache.limits(
+	imageCacheCountLimit, imageCacheMemoryLimit, imageCacheTimeLimit);
+}
+
+bool ReaderFactory::state(char const * path, State & state) throw() {
+    // find the source for this target without our lock (see stat)
+    Transcode::Element transcodeElement;
+    char sourceBuffer[PATH_MAX];
+    bool undecided = false;
+    char const * source = transcodeMapping->sourceFrom(path,
+	sourceBuffer, sizeof sourceBuffer, &transcodeElement, &undecided);
+    struct stat st;
+    if (source == path || -1 == fstatat(baseFd, source, &st, 0)
+	    || S_ISDIR(st.st_mode))
+	return false;
+    state.progress = 1;
+    state.remaining = 0;
+    state.size = state.sourceSize = st.st_size;
+
+    // a source passed through is its own image
+    bool passThrough = !undecided
+	&& pass(transcodeElement, source, &undecided);
+    if (passThrough) {
+	state.name = "pass";
+	return true;
+    }
+
+    // until what the source has is discovered we don't know
+    // how it will be transcoded (if at all)
+    if (undecided) {
+	state.name = "discovering";
+	state.progress = 0;
+	state.remaining = HUGE_VAL;
+	state.size = -1;
+	return true;
+    }
+
+    FileIndex fileIndex(st, variantOf(transcodeElement));
+    bool persisted;
+    if (0 <= (state.size = imageCache.sizeOf(fileIndex, &persisted))) {
+	state.name = persisted ? "disk" : "memory";
+	return true;
+    }
+    {
+	Metrics::TimedLock lock(*this, Metrics::factoryLockSeconds);
+	Map::iterator it = map.find(fileIndex);
+	if (it != map.end()) {
+	    Reader * reader = it->second;
+	    // one that passes its source through (while we back off from
+	    // transcoding it) has no image of its own
+	    if (!reader->transcodes()) {
+		state.name = "pass";
+		state.size = st.st_size;
+		return true;
+	    }
+	    state.progress = reader->progress();
+	    if (1 > state.progress) {
+		state.name = "transcoding";
+		state.remaining = reader->remaining();
+		state.size = -1;
+	    } else {
+		// done but not yet cached
+		state.name = "memory";
+		state.size = reader->size(false);
+	    }
+	    return true;
+	}
+    }
+    state.name = "cold";
+    state.progress = 0;
+    state.remaining = HUGE_VAL;
+    // if the ends of an image were kept we know its size
+    ImageCache::EndsConstPointer ends = imageCache.ends(fileIndex);
+    state.size = ends ? static_cast<ssize_t>(ends->size) : -1;
+    return true;
+}
+
+bool ReaderFactory::fileIndexOf(char const * path, FileIndex & fileIndex)
+	throw() {
+    Transcode::Element transcodeElement;
+    char sourceBuffer[PATH_MAX];
+    char const * source = transcodeMapping->sourceFrom(path,
+	sourceBuffer, sizeof sourceBuffer, &transcodeElement);
+    struct stat st;
+    if (source == path || -1 == fstatat(baseFd, source, &st, 0))
+	return false;
+    fileIndex = FileIndex(st, variantOf(transcodeElement));
+    return true;
+}
+
+bool ReaderFactory::pin(char const * path, bool pin) throw() {
+    FileIndex fileIndex;
+    if (!fileIndexOf(path, fileIndex)) return false;
+    return pin ? imageCache.pin(fileIndex) : imageCache.unpin(fileIndex);
+}
+
+bool ReaderFactory::evict(char const * path) throw() {
+    FileIndex fileIndex;
+    if (!fileIndexOf(path, fileIndex)) return false;
+    return imageCache.evict(fileIndex);
+}
+
+void ReaderFactory::flush() throw() {
+    imageCache.flush();
+}
+
+bool ReaderFactory::roomToReadAhead() throw() {
+    Metrics::TimedLock lock(*this, Metrics::factoryLockSeconds);
+    return readAheadCount < readAheadLimit;
+}
+
+bool ReaderFactory::promote(FileIndex fileIndex, size_t size_) throw() {
+    // an image that would only spill again is better left where it is
+    if (!imageBudget.fits(size_)) return false;
+    // copy the persisted image into memory
+    // (which is not a hit that our metrics should count)
+    Reader * reader = imageCache.open(fileIndex, false);
+    if (!reader) return false;
+    Image * image = new Image(&imageBudget);
+    char buffer[64 * 1024];
+    ssize_t size;
+    for (off_t offset = 0;
+	    0 < (size = reader->read(buffer, sizeof buffer, offset));
+	    offset += size) {
+	image->append(buffer, size);
+	// others may have taken the room since
+	if (image->memory() < image->size()) {
+	    size = -1;
+	    break;
+	}
+    }
+    delete reader;
+    if (0 > size) {
+	delete image;
+	return false;
+    }
+    imageCache.add(fileIndex, image);
+    return true;
+}
+
+void ReaderFactory::popular(Popularity * popularity_, size_t count,
+	unsigned jobs, unsigned long long memory) throw() {
+    popularity = popularity_;
+    if (popularity && count && memory) {
+	warmup = new Warmup(*this, count, jobs, memory);
+    }
+}
+
+void ReaderFactory::adopt(
+	FileIndex fileIndex, int fd, size_t size, bool resident) throw() {
+    imageCache.add(fileIndex, new Image(fd, size, resident, &imageBudget));
+}
+
+void ReaderFactory::handOffTo(Handoff * handoff) throw() {
+    imageCache.handOffTo(handoff);
+}
+
 void ReaderFactory::readAheadIsDone(Reader * reader) throw() {
-    boost::mutex::scoped_lock lock(*this);
-    --readAheadCount;
+    Metrics::TimedLock lock(*this, Metrics::factoryLockSeconds);
     readAheadRelease.push(reader);
 }
 
-void ReaderFactory::nonReadAheadIsDone(Reader * reader) throw() {}
+void ReaderFactory::nonReadAheadIsDone(Reader * reader) throw() {
+    // we may be called while a reader is being destroyed with
+    // a lock on *this so we must not lock *this unless we were left to finish
+    {
+	boost::mutex::scoped_lock lock(finishingMutex);
+	if (!finishing.erase(reader)) return;
+    }
+    readAheadIsDone(reader);
+}
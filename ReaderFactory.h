@@ -11,6 +11,7 @@
 
 #include <deque>
 #include <map>
+#include <ostream>
 #include <set>
 
 #include <boost/shared_ptr.hpp>
@@ -18,7 +19,10 @@
 #include <boost/thread/mutex.hpp>
 
 
+#include "Backoff.h"
+#include "Discoverer.h"
 #include "ImageCache.h"
+#include "Popularity.h"
 #include "Reader.h"
 #include "Synchronizable.h"
 #include "Transcode.h"
@@ -36,6 +40,17 @@
 /// The next time a Reader is acquired for this FileIndex, if the image
 /// is still cached, an ImageReader is created for it instead of a
 /// FileReader.
+/// All images, cached or still being built, are accountable to an
+/// imageBudget which will spill them to files if they would use too much
+/// memory.
+/// The failures of transcodings are recorded by FileIndex and by pipeline
+/// so that we can back off from trying them again, for a while.
+/// While backing off, a file is not read ahead and
+/// opening it fails or, if we are to fall back, passes its source through.
+/// A transcoding may fan out to siblings that share its decoding.
+/// Their images are cached under the variant of the FileIndex for each.
+/// A source that need not be transcoded (the pipeline is the identity or
+/// the source has what the mapping passes) is passed through or remuxed.
 class ReaderFactory : public boost::mutex {
 private:
 
@@ -53,18 +68,105 @@ private:
 	void push(Reader *) throw();
     };
 
+    /// A Reaper destroys released Readers in its own thread so that
+    /// tearing down their pipelines does not block anyone else.
+    /// Its queue is limited and, when full, Readers are destroyed by
+    /// those that push them (but still without our lock).
+    class Reaper : private Synchronizable<boost::mutex> {
+    private:
+	std::deque<Reader *> deque;
+	size_t limit;			///< Queue no more than this
+	bool stop;
+	unsigned long count;		///< Readers reaped
+	double total;			///< Seconds spent reaping them
+	double longest;			///< Longest time to reap one
+	Reader * pop() throw();
+	void run() throw();
+	void reap(Reader *) throw();
+	boost::thread thread;
+    public:
+	Reaper(size_t limit) throw();
+	~Reaper() throw();
+	void push(Reader *) throw();
+	/// Get the number of Readers reaped,
+	/// total and longest seconds spent reaping them
+	/// and the number queued to be reaped.
+	void stats(unsigned long & count, double & total, double & longest,
+	    size_t & queued) throw();
+    };
+
+    /// A Warmup, in its own thread, warms the hottest files of our
+    /// popularity when we are mounted: it reads ahead those that are cold
+    /// and promotes to memory those that are only persisted.
+    /// It yields to others by reading ahead no more than jobs at once and
+    /// only while we are under our readAheadLimit and it skips those
+    /// whose images, with those it has warmed (or is warming), would take
+    /// more than memory bytes.
+    /// The size of an image not yet known is estimated from its source.
+    class Warmup : private Synchronizable<boost::mutex> {
+    private:
+	ReaderFactory & readerFactory;
+	size_t count;			///< Of the hottest to warm
+	unsigned jobs;			///< Read ahead at once
+	unsigned long long memory;	///< Bytes of images to warm
+	bool stop;
+	bool pause() throw();
+	void run() throw();
+	boost::thread thread;
+    public:
+	Warmup(ReaderFactory &, size_t count, unsigned jobs,
+	    unsigned long long memory) throw();
+	~Warmup() throw();
+    };
+
     typedef std::map<FileIndex const, Reader *> Map;
     Map map;
     int baseFd;
     Transcode::Mapping * transcodeMapping;
     bool trueSize;
     size_t readAheadLimit;
+    Image::Budget imageBudget;
     ImageCache::Container imageCache;
     size_t volatile readAheadCount;
+    double finishProgress;
+    double finishRemaining;
+    bool lazy;
+    unsigned lazyGrace;
+    Backoff<FileIndex> fileBackoff;	///< Back off from failed files
+    Backoff<char const *> pipelineBackoff;	///< ... and failed pipelines
+    bool fallback;		///< Pass source through while backing off
+    Discoverer discoverer;	///< Discovers what sources have
+    std::set<Reader *> finishing;	///< Readers left to finish
+    boost::mutex finishingMutex;	///< Guards finishing
+    Reaper reaper;
     ReadAheadRelease readAheadRelease;
+    Popularity * popularity;	///< Of what is opened, if we keep it
+    Warmup * warmup;
 
     void readAheadIsDone(Reader *) throw();
     void nonReadAheadIsDone(Reader *) throw();
+    bool finish(Reader *) throw();
+    void outcome(FileIndex, char const * pipeline, bool success) throw();
+    bool backingOff(FileIndex, Transcode::Element const &) throw();
+    void warm(FileIndex, unsigned variant, ImageConst *) throw();
+    bool pass(Transcode::Element &, char const * source,
+	bool * undecided = 0) throw();
+    bool fileIndexOf(char const * path, FileIndex &) throw();
+    bool roomToReadAhead() throw();
+    bool promote(FileIndex, size_t size) throw();
+
+protected:
+
+    /// Construct a TranscodeFileReader (with our lock)
+    /// whose completion is guaranteed to call done.
+    /// This may be overridden to substitute another kind of Reader
+    /// (see ReaderFactoryStress.cpp).
+    virtual Reader * newTranscodeFileReader(
+	FileIndex fileIndex, int fileFd, char const * source,
+	Transcode::Element const & transcodeElement,
+	boost::shared_ptr<void const> & doneGuarantee,
+	void (ReaderFactory::*done)(Reader *),
+	bool lazy = false) throw();
 
 public:
 
@@ -76,10 +178,22 @@ public:
 	size_t imageCacheCountLimit,
 	size_t imageCacheMemoryLimit,
 	time_t imageCacheTimeLimit,
-	int imageCachePersistFd)
+	int imageCachePersistFd,
+	size_t imageEndsHeadSize,
+	size_t imageEndsTailSize,
+	size_t imageEndsCountLimit,
+	size_t imageSpillSize,
+	int imageSpillFd,
+	double finishProgress,
+	double finishRemaining,
+	bool lazy,
+	unsigned lazyGrace,
+	double backoffLimit,
+	bool fallback,
+	size_t discoveryCountLimit = 4096)
 	throw();
 
-    ~ReaderFactory() throw();
+    virtual ~ReaderFactory() throw();
 
     /// Open a Reader for the file suggested by the target path.
     /// The caller is responsible for releasing the reader when done.
@@ -87,22 +201,108 @@ public:
     /// but won't do the release until readAheadIsDone.
     /// This way the image might be cached even if the opener releases
     /// a TranscodeFileReader before readAheadIsDone.
+    /// If lazy, a new TranscodeFileReader is not read ahead and does not
+    /// start transcoding until it is needed or after lazyGrace milliseconds.
     /// \return The Reader
     Reader * open(char const * path) throw();
 
     /// Every Reader that is opened must be released.
-    /// When the last user of the Reader releases it, the Reader is destroyed.
+    /// When the last user of the Reader releases it, the Reader is destroyed
+    /// (by our reaper, without our lock) unless, subject to our readAheadLimit, it is building an image
+    /// that is at least finishProgress complete or is expected to be
+    /// complete in finishRemaining seconds.
+    /// Such a Reader is left to finish under the responsibility of
+    /// readAheadRelease, just as if it had been read ahead.
     void release(Reader * reader) throw();
 
     /// Get stat for the file suggested by the target path.
     /// Depending on trueSize, accuracy on the true size will be
     /// guaranteed or not.
+    /// The true size is known without transcoding if an image was
+    /// cached or its ends were kept.
+    /// This does not wait for what a source has to be discovered:
+    /// until it has been, the size is that of the source.
     int stat(char const * path, struct stat * st) throw();
 
-    /// Subject to our readAheadLimit and if appropriate,
+    /// Return true if the source path exists and, if the transcodeElement
+    /// probes for what a source has, it has it.
+    /// If undecided is given and what it has is yet to be discovered,
+    /// return false and set it (and discover it in the background).
+    /// This is suitable for use as the select function object of our
+    /// transcodeMapping.
+    bool select(Transcode::Element const & transcodeElement,
+	char const * source, bool * undecided = 0) throw();
+
+    /// Subject to our readAheadLimit (unless forced) and if appropriate,
     /// construct a new TranscodeFileReader to start transcoding the
     /// file and assign ownership to readAheadRelease.
-    void readAhead(char const * path) throw();
+    /// Unless forced, this does not wait for what its source has
+    /// to be discovered (and does nothing until it has been).
+    void readAhead(char const * path, bool force = false) throw();
+
+    /// What is known of the image of a target file without waiting for it.
+    struct State {
+	char const *	name;	///< discovering, cold, transcoding, memory, ...
+	double		progress;	///< From 0 to 1
+	double		remaining;	///< Estimated seconds until complete
+	ssize_t		size;		///< True size or -1 if not known
+	ssize_t		sourceSize;	///< Of the source
+    };
+
+    /// Get the State of the file suggested by the target path
+    /// (without waiting for what its source has to be discovered).
+    /// \return False if the path is not mapped from an existing source.
+    bool state(char const * path, State & state) throw();
+
+    /// Write our metrics (see Metrics) to out.
+    void metrics(std::ostream & out) throw();
+
+    /// Write a line to out for each transcoding in progress with its
+    /// progress, size so far, throughput, estimated time remaining
+    /// and source location.
+    void status(std::ostream & out) throw();
+
+    /// Change our readAheadLimit and the limits of our imageCache
+    /// (and the memory limit of our imageBudget with its).
+    void tune(size_t readAheadLimit,
+	size_t imageCacheCountLimit,
+	unsigned long long imageCacheMemoryLimit,
+	time_t imageCacheTimeLimit) throw();
+
+    /// Get what tune changes.
+    void tuning(size_t & readAheadLimit,
+	size_t & imageCacheCountLimit,
+	unsigned long long & imageCacheMemoryLimit,
+	time_t & imageCacheTimeLimit) throw();
+
+    /// Pin (or unpin) the cached image for the target path
+    /// so that it is not culled from our imageCache.
+    /// \return False if there is none (or it was not pinned).
+    bool pin(char const * path, bool pin = true) throw();
+
+    /// Forget any image for the target path cached, persisted or
+    /// whose ends were kept by our imageCache.
+    /// \return False if there was nothing to forget.
+    bool evict(char const * path) throw();
+
+    /// Cull every image from memory that is not in use
+    /// (persisting what is complete).
+    void flush() throw();
+
+    /// Count what is opened in popularity and, in the background,
+    /// warm (at most) count of the hottest files it had,
+    /// reading ahead no more than jobs of them at once,
+    /// until images of memory bytes have been warmed.
+    void popular(Popularity * popularity, size_t count, unsigned jobs,
+	unsigned long long memory) throw();
+
+    /// Cache an image adopted (see Handoff) from a predecessor
+    /// (accountable to our imageBudget) with the content of size bytes in fd.
+    void adopt(FileIndex, int fd, size_t size, bool resident) throw();
+
+    /// When destroyed, offer our cached images through handoff
+    /// instead of persisting them (see ImageCache::Container::handOffTo).
+    void handOffTo(Handoff * handoff) throw();
 
 };
 
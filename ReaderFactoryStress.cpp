@@ -0,0 +1,442 @@
+/// \file
+/// A stress test and benchmark of the ReaderFactory.
+/// <p>
+/// Many threads open, read, stat, read ahead and release targets
+/// of a few sources at random as fast as they can.
+/// Transcoding is replaced by a MockReader that takes a controllable
+/// (jittered) time to build a synthetic image, so that the lifetimes of
+/// readers (their reference counts, readAheadRelease and the doneGuarantee
+/// hand-off) are exercised without gstreamer.
+/// It reports the throughput and latency of each operation and how long
+/// they waited for the ReaderFactory lock and checks these invariants:
+/// every reader is destroyed once, unreferenced, after it is done and
+/// never used after, and every read returns what is expected.
+/// Build it with SANITIZE=thread to run it under ThreadSanitizer.
+/// <p>
+/// Copyright (c) 2009 Ross Tyler.
+/// This file may be copied under the terms of the
+/// GNU Lesser General Public License (LGPL).
+/// See COPYING file for details.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/bind/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/barrier.hpp>
+
+#include "FileReader.h"
+#include "Metrics.h"
+#include "ReaderFactory.h"
+#include "Synchronizable.h"
+#include "Utility.h"
+
+/// Counts of what happened to MockReaders and invariants violated.
+static std::atomic<unsigned long> created(0);
+static std::atomic<unsigned long> destroyed(0);
+static std::atomic<unsigned long> violations(0);
+
+static void violated(char const * what) throw() {
+    ++violations;
+    std::cerr << "violation: " << what << std::endl;
+}
+
+/// \return The byte expected at offset of the image of fileIndex.
+static char expected(FileIndex const & fileIndex, size_t offset) throw() {
+    return static_cast<char>(fileIndex.inode + offset);
+}
+
+/// A MockReader stands in for a TranscodeFileReader.
+/// Its thread takes latency seconds to build an image of size bytes
+/// (unless aborted) and then fulfills the doneGuarantee it was given.
+class MockReader : public FileReader, private Synchronizable<boost::mutex> {
+private:
+    static unsigned const alive = 0x600dcafe;
+    unsigned magic;		///< alive until destroyed
+    double latency;		///< Seconds to build our image
+    size_t length;		///< Of our image
+    boost::shared_ptr<void const> doneGuarantee;	///< reset when done
+    double began;
+    bool running;
+    bool aborting;
+    Image * image;		///< Built image, until taken
+    boost::thread thread;
+
+    void check(char const * what) throw() {
+	if (alive != magic) violated(what);
+    }
+
+    void run() throw() {
+	{
+	    Synchronized synchronized(*this);
+	    // time passes, unless we are aborted
+	    boost::system_time until = boost::get_system_time()
+		+ boost::posix_time::microseconds(
+		    static_cast<long>(latency * 1e6));
+	    while (!aborting && synchronized.wait(until)) {}
+	    if (!aborting) {
+		image = new Image(0);
+		std::string content(length, 0);
+		for (size_t i = 0; i < length; ++i) {
+		    content[i] = expected(fileIndex, i);
+		}
+		image->append(content.data(), content.size());
+	    }
+	    running = false;
+	    synchronized.notifyAll();
+	}
+	// fulfill our doneGuarantee without our lock
+	doneGuarantee.reset();
+    }
+
+public:
+    MockReader(FileIndex fileIndex_, int fd_,
+	    boost::shared_ptr<void const> & doneGuarantee_,
+	    boost::function<void (Reader *)> done,
+	    double latency_, size_t length_) throw()
+    :
+	FileReader(fileIndex_, fd_),
+	magic(alive),
+	latency(latency_),
+	length(length_),
+	doneGuarantee(),
+	began(Utility::now()),
+	running(true),
+	aborting(false),
+	image(0),
+	thread()
+    {
+	++created;
+	// as a started TranscodeFileReader does
+	doneGuarantee_.reset(static_cast<void const *>(0),
+	    boost::bind(done, this));
+	doneGuarantee = doneGuarantee_;
+	thread = boost::thread(boost::bind(&MockReader::run, this));
+    }
+
+    ~MockReader() throw() {
+	check("reader destroyed twice");
+	if (*this) violated("reader destroyed while referenced");
+	{
+	    Synchronized synchronized(*this);
+	    aborting = true;
+	    synchronized.notifyAll();
+	}
+	thread.join();
+	if (image) delete image;
+	magic = 0;
+	++destroyed;
+    }
+
+    virtual ssize_t read(char * buffer, size_t size, off_t offset) throw() {
+	check("read of destroyed reader");
+	Synchronized synchronized(*this);
+	while (running) synchronized.wait();
+	if (!image) return -EIO;
+	if (static_cast<size_t>(offset) >= image->size()) return 0;
+	size_t available = image->size() - offset;
+	if (size > available) size = available;
+	image->copy(offset, size, buffer);
+	return size;
+    }
+
+    virtual size_t size(bool wait) throw() {
+	check("size of destroyed reader");
+	Synchronized synchronized(*this);
+	if (wait) while (running) synchronized.wait();
+	return image ? image->size() : 0;
+    }
+
+    virtual ImageConst * getImage() throw() {
+	check("image of destroyed reader");
+	Synchronized synchronized(*this);
+	if (running) return 0;
+	ImageConst * image = this->image;
+	this->image = 0;
+	return image;
+    }
+
+    virtual bool building() throw() {
+	check("building of destroyed reader");
+	Synchronized synchronized(*this);
+	return running;
+    }
+
+    virtual double progress() throw() {
+	Synchronized synchronized(*this);
+	if (!running) return 1;
+	double progress = (Utility::now() - began) / latency;
+	return progress < .999 ? progress : .999;
+    }
+
+    virtual double remaining() throw() {
+	Synchronized synchronized(*this);
+	if (!running) return 0;
+	double remaining = began + latency - Utility::now();
+	return remaining > 0 ? remaining : 0;
+    }
+
+    virtual double elapsed() throw() {
+	return Utility::now() - began;
+    }
+
+    virtual bool transcodes() throw() {
+	return true;
+    }
+};
+
+/// A StressReaderFactory makes MockReaders instead of TranscodeFileReaders.
+class StressReaderFactory : public ReaderFactory {
+private:
+    double latency;		///< Mean seconds to build an image
+    size_t length;		///< Of each image
+    std::minstd_rand random;	///< For jitter (guarded by our lock)
+
+protected:
+    virtual Reader * newTranscodeFileReader(
+	    FileIndex fileIndex, int fileFd, char const * source,
+	    Transcode::Element const & transcodeElement,
+	    boost::shared_ptr<void const> & doneGuarantee,
+	    void (ReaderFactory::*done)(Reader *),
+	    bool lazy) throw() {
+	// with our lock, from half to one and a half times our latency
+	double jitter = .5 + static_cast<double>(random() % 1000) / 1000;
+	return new MockReader(fileIndex, fileFd, doneGuarantee,
+	    boost::bind(done, this, boost::placeholders::_1),
+	    latency * jitter, length);
+    }
+
+public:
+    StressReaderFactory(int baseFd, Transcode::Mapping * mapping,
+	    size_t readAheadLimit, size_t cacheCount,
+	    double latency_, size_t length_) throw()
+    :
+	ReaderFactory(baseFd, mapping, false, readAheadLimit,
+	    cacheCount, std::numeric_limits<unsigned long long>::max(),
+	    // no periodic culling (and no waiting for its thread)
+	    std::numeric_limits<time_t>::max(), -1,
+	    0, 0, 0, 0, -1, 1, 0, false, 0, 0, false),
+	latency(latency_),
+	length(length_),
+	random(1)
+    {}
+};
+
+/// The operations that a Worker does.
+enum Operation {Read, Probe, Stat, ReadAhead, Operations};
+static char const * const names[Operations]
+    = {"read", "probe", "stat", "readAhead"};
+
+/// The latencies (in seconds) of the operations measured.
+typedef std::vector<double> Latencies;
+
+/// What each stressing thread does.
+struct Worker {
+    ReaderFactory *	readerFactory;
+    size_t		sources;
+    size_t		length;
+    double		until;
+    boost::barrier *	barrier;
+    Latencies		latencies[Operations];
+
+    void run(unsigned seed) throw() {
+	std::minstd_rand random(seed);
+	std::vector<char> buffer(4096);
+	barrier->wait();
+	while (Utility::now() < until) {
+	    std::ostringstream path;
+	    path << "s" << random() % sources << ".dst";
+	    // read 40%, probe 20%, stat 25%, readAhead 15%
+	    unsigned dice = random() % 100;
+	    Operation operation = dice < 40 ? Read
+		: dice < 60 ? Probe : dice < 85 ? Stat : ReadAhead;
+	    double began = Utility::now();
+	    switch (operation) {
+	    case Read:
+	    case Probe: {
+		Reader * reader = readerFactory->open(path.str().c_str());
+		if (!reader) {
+		    violated("open failed");
+		    break;
+		}
+		// read all (or, to probe, only the head of) the image
+		size_t offset = 0;
+		for (;;) {
+		    ssize_t size = reader->read(&buffer[0], buffer.size(),
+			offset);
+		    if (0 >= size) break;
+		    for (ssize_t i = 0; i < size; ++i) {
+			if (expected(reader->fileIndex, offset + i)
+				!= buffer[i]) {
+			    violated("read unexpected content");
+			    break;
+			}
+		    }
+		    offset += size;
+		    if (Probe == operation) break;
+		}
+		if (Read == operation && offset != length) {
+		    violated("read short");
+		}
+		readerFactory->release(reader);
+		break;
+	    }
+	    case Stat: {
+		struct stat st;
+		if (readerFactory->stat(path.str().c_str(), &st)) {
+		    violated("stat failed");
+		}
+		break;
+	    }
+	    case ReadAhead:
+		readerFactory->readAhead(path.str().c_str());
+		break;
+	    default:
+		break;
+	    }
+	    latencies[operation].push_back(Utility::now() - began);
+	}
+    }
+};
+
+/// Write a line reporting latencies of the operation over seconds.
+static void report(char const * operation, Latencies & latencies,
+	double seconds) throw() {
+    double p50 = 0, p99 = 0;
+    if (!latencies.empty()) {
+	std::sort(latencies.begin(), latencies.end());
+	p50 = latencies[latencies.size() / 2];
+	p99 = latencies[latencies.size() * 99 / 100];
+    }
+    std::cout << std::left << std::setw(10) << operation << std::right
+	<< std::setw(10) << latencies.size()
+	<< std::fixed << std::setprecision(0)
+	<< std::setw(12) << latencies.size() / seconds
+	<< std::setprecision(1)
+	<< std::setw(12) << p50 * 1e6
+	<< std::setw(12) << p99 * 1e6 << std::endl;
+}
+
+/// The main function.
+int main(int argc, char ** argv) throw() {
+    unsigned threads = 16;
+    double seconds = 5;
+    size_t sources = 32;
+    double latency = .01;
+    size_t length = 65536;
+    size_t readAheadLimit = 4;
+    size_t cacheCount = 8;
+    int option;
+    while (-1 != (option = getopt(argc, argv, "t:d:n:l:s:r:c:"))) {
+	switch (option) {
+	case 't': threads = strtoul(optarg, 0, 0); break;
+	case 'd': seconds = strtod(optarg, 0); break;
+	case 'n': sources = strtoul(optarg, 0, 0); break;
+	case 'l': latency = strtod(optarg, 0) / 1000; break;
+	case 's': length = strtoul(optarg, 0, 0); break;
+	case 'r': readAheadLimit = strtoul(optarg, 0, 0); break;
+	case 'c': cacheCount = strtoul(optarg, 0, 0); break;
+	default:
+	    std::cerr << "usage: " << argv[0]
+		<< " [-t threads] [-d seconds] [-n sources]"
+		" [-l latencyMilliseconds] [-s imageSize]"
+		" [-r readAheadLimit] [-c cacheCount]" << std::endl;
+	    return 2;
+	}
+    }
+    if (!threads || !sources || 0 >= latency) return 2;
+
+    // a base directory of (empty) sources
+    char base[] = "/tmp/gstfs-ng.stress.XXXXXX";
+    if (!mkdtemp(base)) {
+	std::cerr << base << ": " << strerror(errno) << std::endl;
+	return 1;
+    }
+    int baseFd = open(base, O_RDONLY);
+    for (size_t i = 0; i < sources; ++i) {
+	std::ostringstream name;
+	name << "s" << i << ".src";
+	close(openat(baseFd, name.str().c_str(), O_CREAT | O_WRONLY, 0600));
+    }
+
+    // mapped to targets that we (pretend to) transcode
+    Transcode::Mapping transcodeMapping;
+    transcodeMapping.builder.option("source=src", FUSE_OPT_KEY_OPT, 0);
+    transcodeMapping.builder.option("target=dst", FUSE_OPT_KEY_OPT, 0);
+    transcodeMapping.builder.option("pipeline=mock", FUSE_OPT_KEY_OPT, 0);
+
+    std::vector<Worker> workers(threads);
+    double elapsed;
+    {
+	StressReaderFactory readerFactory(baseFd, &transcodeMapping,
+	    readAheadLimit, cacheCount, latency, length);
+	transcodeMapping.select = boost::bind(&ReaderFactory::select,
+	    &readerFactory, boost::placeholders::_1, boost::placeholders::_2,
+	    boost::placeholders::_3);
+	boost::barrier barrier(threads + 1);
+	boost::thread_group group;
+	double until = Utility::now() + seconds;
+	for (unsigned i = 0; i < threads; ++i) {
+	    Worker & worker = workers[i];
+	    worker.readerFactory = &readerFactory;
+	    worker.sources = sources;
+	    worker.length = length;
+	    worker.until = until;
+	    worker.barrier = &barrier;
+	    group.create_thread(boost::bind(&Worker::run, &worker, i + 1));
+	}
+	barrier.wait();
+	double began = Utility::now();
+	group.join_all();
+	elapsed = Utility::now() - began;
+	// every reader left is destroyed with our readerFactory
+    }
+
+    std::cout << std::left << std::setw(10) << "op" << std::right
+	<< std::setw(10) << "count"
+	<< std::setw(12) << "ops/s"
+	<< std::setw(12) << "p50(us)"
+	<< std::setw(12) << "p99(us)" << std::endl;
+    for (int operation = 0; operation < Operations; ++operation) {
+	Latencies latencies;
+	for (unsigned i = 0; i < threads; ++i) {
+	    latencies.insert(latencies.end(),
+		workers[i].latencies[operation].begin(),
+		workers[i].latencies[operation].end());
+	}
+	report(names[operation], latencies, elapsed);
+    }
+    std::cout << std::defaultfloat << std::endl;
+    Metrics::factoryLockSeconds.write(std::cout,
+	"gstfs_lock_wait_seconds", "lock=\"factory\"");
+    Metrics::cacheLockSeconds.write(std::cout,
+	"gstfs_lock_wait_seconds", "lock=\"cache\"");
+    std::cout << std::endl
+	<< "readers created " << created
+	<< ", destroyed " << destroyed << std::endl;
+    if (created != destroyed) violated("readers leaked");
+
+    for (size_t i = 0; i < sources; ++i) {
+	std::ostringstream name;
+	name << "s" << i << ".src";
+	unlinkat(baseFd, name.str().c_str(), 0);
+    }
+    close(baseFd);
+    rmdir(base);
+
+    std::cout << "violations " << violations << std::endl;
+    return violations ? 1 : 0;
+}
@@ -0,0 +1,145 @@
+/// \file
+/// Definition of the Recorder class.
+/// <p>
+/// Copyright (c) 2009 Ross Tyler.
+/// This file may be copied under the terms of the
+/// GNU Lesser General Public License (LGPL).
+/// See COPYING file for details.
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/bind/bind.hpp>
+
+#include "Recorder.h"
+#include "Utility.h"
+
+/// Write our buffer when it grows to this size (or a second has passed).
+static size_t const flushSize = 64 * 1024;
+
+/// \return The (64 bit FNV-1a) hash of string.
+static uint64_t hashOf(char const * string) throw() {
+    uint64_t hash = 14695981039346656037ULL;
+    while (*string) {
+	hash ^= static_cast<unsigned char>(*string++);
+	hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/// Write size bytes from buffer to fd, retrying short writes.
+/// \return True if successful.
+static bool writeAll(int fd, char const * buffer, size_t size) throw() {
+    while (size) {
+	ssize_t length = ::write(fd, buffer, size);
+	if (0 >= length) {
+	    if (-1 == length && EINTR == errno) continue;
+	    return false;
+	}
+	buffer += length;
+	size -= length;
+    }
+    return true;
+}
+
+Recorder::Recorder(std::string const & path) throw(Exception::Error)
+:
+    fd(::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)),
+    start(Utility::now()),
+    failed(false),
+    stop(false),
+    buffer(),
+    named(),
+    threads(),
+    thread()
+{
+    if (-1 == fd) throw Exception::Error(": " + path);
+    Header header = {{'g', 's', 't', 'f', 's', 'r', 'e', 'c'},
+	1, sizeof(Record)};
+    if (!writeAll(fd, reinterpret_cast<char const *>(&header), sizeof header)) {
+	int error = errno;
+	close(fd);
+	throw Exception::Error(": " + path, error);
+    }
+    buffer.reserve(flushSize + sizeof(Record) + PATH_MAX);
+    thread = boost::thread(boost::bind(&Recorder::run, this));
+}
+
+Recorder::~Recorder() throw() {
+    {
+	Synchronized synchronized(*this);
+	stop = true;
+	synchronized.notify();
+    }
+    // our thread writes what is left before it returns
+    thread.join();
+    close(fd);
+}
+
+void Recorder::run() throw() {
+    std::string writing;
+    writing.reserve(buffer.capacity());
+    for (;;) {
+	bool stopping;
+	{
+	    // wait for enough to write or a second to pass
+	    // then take what there is, leaving an empty buffer to fill
+	    Synchronized synchronized(*this);
+	    boost::system_time due
+		= boost::get_system_time() + boost::posix_time::seconds(1);
+	    while (!stop && buffer.size() < flushSize
+		    && boost::get_system_time() < due) {
+		synchronized.wait(due);
+	    }
+	    stopping = stop;
+	    buffer.swap(writing);
+	}
+	if (!writing.empty()
+		&& !writeAll(fd, writing.data(), writing.size())) {
+	    // give up rather than record a trace with holes in it
+	    std::cerr << "record: " << strerror(errno) << std::endl;
+	    Synchronized synchronized(*this);
+	    failed = true;
+	    buffer.clear();
+	    return;
+	}
+	writing.clear();
+	if (stopping) return;
+    }
+}
+
+void Recorder::name(uint64_t hash, char const * string) throw() {
+    if (!named.insert(hash).second) return;
+    Record record = {};
+    record.hash = hash;
+    record.size = strlen(string);
+    record.op = NAME;
+    buffer.append(reinterpret_cast<char const *>(&record), sizeof record);
+    buffer.append(string, record.size);
+}
+
+void Recorder::record(Op op, char const * path, double began, int result,
+	uint64_t offset, uint64_t size, uint64_t handle, char const * name_)
+	throw() {
+    Record record;
+    record.time = began > start ? (began - start) * 1e9 : 0;
+    record.hash = hashOf(path);
+    record.offset = offset;
+    record.handle = name_ ? hashOf(name_) : handle;
+    record.size = size;
+    record.op = op;
+    record.error = 0 > result ? -result : 0;
+    Synchronized synchronized(*this);
+    if (failed) return;
+    record.thread = threads.insert(std::make_pair(pthread_self(),
+	static_cast<uint16_t>(threads.size()))).first->second;
+    name(record.hash, path);
+    if (name_) name(record.handle, name_);
+    buffer.append(reinterpret_cast<char const *>(&record), sizeof record);
+    if (flushSize <= buffer.size()) synchronized.notify();
+}
@@ -0,0 +1,95 @@
+/// \file
+/// Declaration of the Recorder class.
+/// <p>
+/// Copyright (c) 2009 Ross Tyler.
+/// This file may be copied under the terms of the
+/// GNU Lesser General Public License (LGPL).
+/// See COPYING file for details.
+
+#ifndef Recorder_h_
+#define Recorder_h_
+
+#include <map>
+#include <set>
+#include <string>
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <boost/thread.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "Exception.h"
+#include "Synchronizable.h"
+
+/// A Recorder writes a compact binary trace of the file system operations
+/// it is told of so that they can be replayed later (see gstfs-ng.replay).
+/// <p>
+/// A trace is a Header followed by Records, in the byte order of the host.
+/// Paths (and extended attribute names) are recorded by their hash.
+/// The first time a hash is recorded it is preceded by a NAME Record
+/// whose size is the length of the string that follows it (unterminated).
+/// Records are buffered and written by a thread of our own
+/// (so that no operation waits for the write) at least once a second,
+/// so what an abrupt exit loses is bounded.
+class Recorder : private Synchronizable<boost::mutex> {
+public:
+    /// What was done.
+    enum Op {
+	NAME,		///< Not done: the string of the hash follows
+	GETATTR,
+	OPEN,
+	READ,
+	RELEASE,
+	READDIR,
+	GETXATTR,
+	LISTXATTR,
+	SETXATTR,
+    };
+
+    struct Header {
+	char magic[8];		///< "gstfsrec"
+	uint32_t version;	///< 1
+	uint32_t recordSize;	///< sizeof(Record)
+    };
+
+    struct Record {
+	uint64_t time;		///< Nanoseconds from the start of the trace
+	uint64_t hash;		///< Of the path
+	uint64_t offset;	///< Read from
+	uint64_t handle;	///< Of the file (or the hash of an xattr name)
+	uint32_t size;		///< Read or, for a NAME, of its string
+	uint16_t thread;	///< Numbered in order of appearance
+	uint8_t op;		///< An Op
+	uint8_t error;		///< errno of a failure, or 0
+    };
+
+private:
+    int fd;			///< Written only by our thread
+    double const start;
+    bool failed;		///< Writing failed so stop recording
+    bool stop;
+    std::string buffer;		///< Recorded but not yet being written
+    std::set<uint64_t> named;	///< Hashes whose strings we have recorded
+    std::map<pthread_t, uint16_t> threads;
+    boost::thread thread;	///< Writes what is buffered
+
+    void name(uint64_t hash, char const * string) throw();
+    void run() throw();
+
+public:
+    /// Create (or truncate) the file at path to record to.
+    Recorder(std::string const & path) throw(Exception::Error);
+
+    /// Write what we have buffered and close our file.
+    ~Recorder() throw();
+
+    /// Record op on path begun (Utility::now()) at began with result
+    /// (a negative errno on failure).
+    /// If name is given, it is recorded and its hash is the handle.
+    void record(Op op, char const * path, double began, int result,
+	uint64_t offset = 0, uint64_t size = 0, uint64_t handle = 0,
+	char const * name = 0) throw();
+};
+
+#endif
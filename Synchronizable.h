@@ -28,6 +28,10 @@ public:
 	    {}
 	~Synchronized() throw() {}
 	void wait() throw() {synchronizable.condition.wait(*this);}
+	/// \return False if until passed before we were notified
+	bool wait(boost::system_time const & until) throw() {
+	    return synchronizable.condition.timed_wait(*this, until);
+	}
 	void notify() throw() {synchronizable.condition.notify_one();}
 	void notifyAll() throw() {synchronizable.condition.notify_all();}
     };
@@ -0,0 +1,47 @@
+/// \file
+/// Definition of tracing macros.
+/// <p>
+/// Copyright (c) 2009 Ross Tyler.
+/// This file may be copied under the terms of the
+/// GNU Lesser General Public License (LGPL).
+/// See COPYING file for details.
+
+#ifndef Trace_h
+#define Trace_h
+
+/// TRACE macros mark static (USDT) probes, in the gstfs provider,
+/// for tools like bpftrace and perf to attach to.
+/// A probe costs a nop until it is attached to.
+/// A FileIndex is traced as its fileSystem, inode, time and variant.
+/// Without sys/sdt.h (HAVE_SYS_SDT_H), the macros do nothing.
+#ifdef HAVE_SYS_SDT_H
+
+#include <sys/sdt.h>
+
+#define TRACE_FILE(name, fileIndex) \
+    DTRACE_PROBE4(gstfs, name, \
+	(fileIndex).fileSystem, (fileIndex).inode, \
+	(fileIndex).time, (fileIndex).variant)
+
+#define TRACE_FILE_BYTES(name, fileIndex, bytes) \
+    DTRACE_PROBE5(gstfs, name, \
+	(fileIndex).fileSystem, (fileIndex).inode, \
+	(fileIndex).time, (fileIndex).variant, \
+	static_cast<unsigned long long>(bytes))
+
+#define TRACE_FILE_BYTES2(name, fileIndex, bytes, more) \
+    DTRACE_PROBE6(gstfs, name, \
+	(fileIndex).fileSystem, (fileIndex).inode, \
+	(fileIndex).time, (fileIndex).variant, \
+	static_cast<unsigned long long>(bytes), \
+	static_cast<unsigned long long>(more))
+
+#else
+
+#define TRACE_FILE(name, fileIndex)
+#define TRACE_FILE_BYTES(name, fileIndex, bytes)
+#define TRACE_FILE_BYTES2(name, fileIndex, bytes, more)
+
+#endif
+
+#endif
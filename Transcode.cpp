@@ -7,8 +7,13 @@
 /// GNU Lesser General Public License (LGPL).
 /// See COPYING file for details.
 
+#include <algorithm>
 #include <cstring>
 #include <iostream>
+#include <sstream>
+
+#include <fnmatch.h>
+#include <stdint.h>
 
 #include <gst/gst.h>
 
@@ -17,7 +22,14 @@
 
 namespace Transcode {
 
-    Element::Element() throw() : source(0), target(0), pipeline(0) {}
+    Element::Element() throw()
+    :
+	source(0), target(0), pipeline(0), window(0), resume(false),
+	directory(0), glob(0),
+	minRate(0), maxRate(0), channels(0), minBitrate(0), maxBitrate(0),
+	decode(0), variant(0), shared(false),
+	passBitrate(0), passCaps(0), remux(0)
+    {}
 
     Element::Element(
 	char const * source_, char const * target_, char const * pipeline_)
@@ -25,155 +37,590 @@ namespace Transcode {
     :
 	source(source_),
 	target(target_),
-	pipeline(pipeline_)
+	pipeline(pipeline_),
+	window(0),
+	resume(false),
+	directory(0),
+	glob(0),
+	minRate(0),
+	maxRate(0),
+	channels(0),
+	minBitrate(0),
+	maxBitrate(0),
+	decode(0),
+	variant(0),
+	shared(false),
+	passBitrate(0),
+	passCaps(0),
+	remux(0)
     {}
 
+    bool Element::admits(char const * source) const throw() {
+	if (directory) {
+	    size_t length = strlen(directory);
+	    if (strncmp(source, directory, length) || '/' != source[length])
+		return false;
+	}
+	return !glob || 0 == fnmatch(glob, source, 0);
+    }
+
+    bool Element::probes() const throw() {
+	return minRate || maxRate || channels || minBitrate || maxBitrate;
+    }
+
+    bool Element::admits(unsigned rate, unsigned channels_, unsigned bitrate)
+	    const throw() {
+	return !(false
+	    || (minRate		&& !(rate >= minRate))
+	    || (maxRate		&& !(rate && rate <= maxRate))
+	    || (channels	&& !(channels_ == channels))
+	    || (minBitrate	&& !(bitrate >= minBitrate))
+	    || (maxBitrate	&& !(bitrate && bitrate <= maxBitrate)));
+    }
+
+    bool Element::identity() const throw() {
+	return !*pipeline && !decode;
+    }
+
+    bool Element::probesPass() const throw() {
+	return passBitrate || passCaps;
+    }
+
+    bool Element::passes(unsigned bitrate, char const * caps) const throw() {
+	if (passBitrate && !(bitrate && bitrate <= passBitrate)) return false;
+	if (!passCaps) return true;
+	if (!*caps) return false;
+	GstCaps * these = gst_caps_from_string(caps);
+	GstCaps * those = gst_caps_from_string(passCaps);
+	bool passes = these && those && gst_caps_is_subset(these, those);
+	if (these) gst_caps_unref(these);
+	if (those) gst_caps_unref(those);
+	return passes;
+    }
+
+    Suffixes::Node::Node() throw() : children(), elements() {}
+
+    Suffixes::Suffixes() throw() : nodes(1) {}
+
+    void Suffixes::add(char const * extension, Element const * element)
+	    throw() {
+	unsigned node = 0;
+	for (char const * p = extension + strlen(extension); p > extension;) {
+	    char c = *--p;
+	    unsigned child = 0;
+	    for (size_t i = 0; i < nodes[node].children.size(); ++i) {
+		if (c == nodes[node].children[i].first) {
+		    child = nodes[node].children[i].second;
+		    break;
+		}
+	    }
+	    if (!child) {
+		child = nodes.size();
+		nodes.push_back(Node());
+		nodes[node].children.push_back(std::make_pair(c, child));
+	    }
+	    node = child;
+	}
+	nodes[node].elements.push_back(element);
+    }
+
+    size_t Suffixes::find(char const * name, size_t length,
+	    Match * matches, size_t size) const throw() {
+	size_t count = 0;
+	unsigned node = 0;
+	for (char const * p = name + length; p > name;) {
+	    char c = *--p;
+	    if ('/' == c) break;
+	    // the root is never a child so 0 means there is none
+	    unsigned child = 0;
+	    std::vector<std::pair<char, unsigned> > const & children
+		= nodes[node].children;
+	    for (size_t i = 0; i < children.size(); ++i) {
+		if (c == children[i].first) {
+		    child = children[i].second;
+		    break;
+		}
+	    }
+	    if (!child) break;
+	    node = child;
+	    if (nodes[node].elements.size() && p > name && '.' == p[-1]) {
+		// keep looking for a longer one
+		matches[count].extension = p;
+		matches[count].elements = &nodes[node].elements;
+		if (++count == size) break;
+	    }
+	}
+	return count;
+    }
+
     Mapping::Builder::Builder(Mapping & mapping_) throw()
-    : mapping(mapping_), source(0), target(0), pipeline(0)
+    : mapping(mapping_), element()
     {}
 
+    /// Free what the Element references.
+    static void freeReferences(Element & element) throw() {
+	if (element.source)	free(const_cast<char *>(element.source));
+	if (element.target)	free(const_cast<char *>(element.target));
+	if (element.pipeline)	free(const_cast<char *>(element.pipeline));
+	if (element.directory)	free(const_cast<char *>(element.directory));
+	if (element.glob)	free(const_cast<char *>(element.glob));
+	if (element.decode)	free(const_cast<char *>(element.decode));
+	if (element.passCaps)	free(const_cast<char *>(element.passCaps));
+	if (element.remux)	free(const_cast<char *>(element.remux));
+    }
+
     Mapping::Builder::~Builder() throw(){
-	if (source)	free(const_cast<char *>(source));
-	if (target)	free(const_cast<char *>(target));
-	if (pipeline)	free(const_cast<char *>(pipeline));
+	freeReferences(element);
     }
 
     bool Mapping::Builder::pending() throw() {
-	return source || target || pipeline;
+	return element.source || element.target || element.pipeline;
     }
 
     void Mapping::Builder::build() throw() {
-	if (source && target && pipeline) {
-	    mapping.add(source, target, pipeline);
-	    free(const_cast<char *>(source));
-	    free(const_cast<char *>(target));
-	    free(const_cast<char *>(pipeline));
-	    source = target = pipeline = 0;
+	if (element.source && element.target && element.pipeline) {
+	    mapping.add(element);
+	    freeReferences(element);
+	    element = Element();
 	}
     }
 
+    /// Return the Element that optional attributes should apply to:
+    /// the pending one or, if none, the one most recently built.
+    Element * Mapping::Builder::attributed() throw() {
+	if (pending() || mapping.last == mapping.end()) {
+	    return &element;
+	}
+	return &*mapping.last;
+    }
+
+    /// Parse a rate (or bitrate) with an optional k suffix
+    /// (to multiply by 1000).
+    /// \return True if successful.
+    static bool parseRate(char const * arg, unsigned & rate) throw() {
+	std::istringstream in(arg);
+	if (!(in >> rate)) return false;
+	char multiplier;
+	if (in >> multiplier && 'k' == tolower(multiplier)) rate *= 1000;
+	return true;
+    }
+
     int Mapping::Builder::option(
 	    char const * arg, int key, fuse_args * args) throw() {
 	size_t length;
 	if ((length = Utility::match(arg, "source=", "src_ext=", 0))) {
-	    source = strdup(arg + length);
+	    element.source = strdup(arg + length);
 	    build();
 	    return 0;
 	}
 	if ((length = Utility::match(arg, "target=", "dst_ext=", 0))) {
-	    target = strdup(arg + length);
+	    element.target = strdup(arg + length);
 	    build();
 	    return 0;
 	}
 	if ((length = Utility::match(arg, "pipeline=", 0))) {
-	    pipeline = strdup(arg + length);
+	    element.pipeline = strdup(arg + length);
 	    build();
 	    return 0;
 	}
+	if ((length = Utility::match(arg, "window=", 0))) {
+	    std::istringstream in(arg + length);
+	    size_t window;
+	    if (in >> window) {
+		char multiplier;
+		if (in >> multiplier) {
+		    switch (tolower(multiplier)) {
+		    case 'k': window *= 1024; break;
+		    case 'm': window *= 1024 * 1024; break;
+		    case 'g': window *= 1024 * 1024 * 1024; break;
+		    }
+		}
+		// the window must hold (at least) a few maximum sized
+		// reads at once
+		if (window < 1024 * 1024) window = 1024 * 1024;
+		attributed()->window = window;
+		return 0;
+	    }
+	}
+	if (Utility::match(arg, "resume", 0)) {
+	    attributed()->resume = true;
+	    return 0;
+	}
+	if ((length = Utility::match(arg, "directory=", 0))) {
+	    // a directory is relative to the base, without surrounding '/'
+	    char const * directory = arg + length;
+	    while ('/' == *directory) ++directory;
+	    length = strlen(directory);
+	    while (length && '/' == directory[length - 1]) --length;
+	    Element * attributed = this->attributed();
+	    if (attributed->directory)
+		free(const_cast<char *>(attributed->directory));
+	    attributed->directory = length ? strndup(directory, length) : 0;
+	    return 0;
+	}
+	if ((length = Utility::match(arg, "glob=", 0))) {
+	    Element * attributed = this->attributed();
+	    if (attributed->glob) free(const_cast<char *>(attributed->glob));
+	    attributed->glob = strdup(arg + length);
+	    return 0;
+	}
+	if ((length = Utility::match(arg, "decode=", 0))) {
+	    Element * attributed = this->attributed();
+	    if (attributed->decode)
+		free(const_cast<char *>(attributed->decode));
+	    attributed->decode = strdup(arg + length);
+	    return 0;
+	}
+	if ((length = Utility::match(arg, "passBitrate=", 0))) {
+	    if (parseRate(arg + length, attributed()->passBitrate)) return 0;
+	}
+	if ((length = Utility::match(arg, "passCaps=", 0))) {
+	    Element * attributed = this->attributed();
+	    if (attributed->passCaps)
+		free(const_cast<char *>(attributed->passCaps));
+	    attributed->passCaps = strdup(arg + length);
+	    return 0;
+	}
+	if ((length = Utility::match(arg, "remux=", 0))) {
+	    Element * attributed = this->attributed();
+	    if (attributed->remux)
+		free(const_cast<char *>(attributed->remux));
+	    attributed->remux = strdup(arg + length);
+	    return 0;
+	}
+	if ((length = Utility::match(arg, "minRate=", 0))) {
+	    if (parseRate(arg + length, attributed()->minRate)) return 0;
+	}
+	if ((length = Utility::match(arg, "maxRate=", 0))) {
+	    if (parseRate(arg + length, attributed()->maxRate)) return 0;
+	}
+	if ((length = Utility::match(arg, "channels=", 0))) {
+	    if (parseRate(arg + length, attributed()->channels)) return 0;
+	}
+	if ((length = Utility::match(arg, "minBitrate=", 0))) {
+	    if (parseRate(arg + length, attributed()->minBitrate)) return 0;
+	}
+	if ((length = Utility::match(arg, "maxBitrate=", 0))) {
+	    if (parseRate(arg + length, attributed()->maxBitrate)) return 0;
+	}
 	return 1;
     }
 
-    Mapping::Mapping() throw() : builder(*this) {}
+    Mapping::Mapping() throw()
+    : last(end()), builder(*this) {}
 
     Mapping::~Mapping() throw() {
-	BySourceIndex & bySourceIndex = get<SourceIndex>();
-	for (BySourceIndex::iterator it = bySourceIndex.begin();
-		it != bySourceIndex.end(); ++it) {
-	    free(const_cast<char *>(it->source));
-	    free(const_cast<char *>(it->target));
-	    free(const_cast<char *>(it->pipeline));
+	for (iterator it = begin(); it != end(); ++it) {
+	    freeReferences(*it);
 	}
     }
 
     size_t Mapping::size() throw () {
-	return get<SourceIndex>().size();
+	return std::list<Element>::size();
     }
 
-    void Mapping::add(
-	    char const * source_, char const * target_, char const * pipeline_)
-	    throw() {
-	char * source	= strdup(source_);
-	char * target	= strdup(target_);
-	// put pipeline_ in a fdsrc/fdsink sandwich
-	char * pipeline	= strdup(
-	    (std::string(
-		    #if GST_CHECK_VERSION(1,0,0)
-			// this is the more elegant solution
-			// which will allow us to use an fd directly
-			// but will cause FLAC tags to be lost in old versions
-			"fdsrc name=fdsrc ! "
-		    #else
-			// this is a kludgy solution
-			// which will cause us to derive a location from an fd
-			// but will not cause FLAC tags to be lost
-			"filesrc name=filesrc ! "
-		    #endif
-		    )
-		+ pipeline_
-		+ (*pipeline_ ? " ! " : "")
-		+ "fdsink name=fdsink"
-	    ).c_str());
-	if (!get<SourceIndex>().insert(Element(source, target, pipeline))
-		.second) {
-	    std::cerr
-		<< "mapping from source extension \""
-		<< source
-		<< "\" or to target extension \""
-		<< target
-		<< "\" already specified - ignoring"
-		<< std::endl;
-	    free(source);
-	    free(target);
-	    free(pipeline);
-	}
-    }
-
-    static char const * newConcatenation(
-	char const * base, char const * end, char const * extension) throw() {
-	size_t baseLength = end - base;
+    /// Return true if one extension is the other or ends with it
+    /// (after a '.').
+    static bool overlaps(char const * a, char const * b) throw() {
+	size_t aLength = strlen(a);
+	size_t bLength = strlen(b);
+	if (aLength < bLength) {
+	    std::swap(a, b);
+	    std::swap(aLength, bLength);
+	}
+	char const * end = a + aLength - bLength;
+	return 0 == strcmp(end, b) && (end == a || '.' == end[-1]);
+    }
+
+    /// \return The (32 bit FNV-1a) hash continued over string
+    /// (and its terminator, so that "ab" "c" and "a" "bc" differ).
+    static uint32_t hashOf(uint32_t hash, char const * string) throw() {
+	if (!string) string = "";
+	do {
+	    hash ^= static_cast<unsigned char>(*string);
+	    hash *= 16777619U;
+	} while (*string++);
+	return hash;
+    }
+
+    /// \return A variant for the element that depends only on what
+    /// makes its images and what it selects them for
+    /// (not on where it is in its Mapping)
+    /// so that what was persisted with it (cached images, discoveries
+    /// and popularity) still refers to the same thing the next time.
+    static unsigned variantOf(Element const & element) throw() {
+	uint32_t hash = 2166136261U;
+	hash = hashOf(hash, element.source);
+	hash = hashOf(hash, element.target);
+	hash = hashOf(hash, element.decode);
+	hash = hashOf(hash, element.pipeline);
+	hash = hashOf(hash, element.remux);
+	hash = hashOf(hash, element.passCaps);
+	std::ostringstream passBitrate;
+	passBitrate << element.passBitrate;
+	hash = hashOf(hash, passBitrate.str().c_str());
+	// those that select nothing keep the variants they had before
+	// selectors were hashed
+	if (!(element.directory || element.glob || element.probes())) {
+	    return hash;
+	}
+	hash = hashOf(hash, element.directory);
+	hash = hashOf(hash, element.glob);
+	std::ostringstream probes;
+	probes << element.minRate << ' ' << element.maxRate
+	    << ' ' << element.channels << ' ' << element.minBitrate
+	    << ' ' << element.maxBitrate;
+	return hashOf(hash, probes.str().c_str());
+    }
+
+    void Mapping::add(Element const & element_) throw() {
+	// the pipeline is put in a fdsrc/fdsink sandwich when described
+	Element element(element_);
+	element.source		= strdup(element_.source);
+	element.target		= strdup(element_.target);
+	element.pipeline	= strdup(element_.pipeline);
+	element.directory	= element_.directory
+				    ? strdup(element_.directory) : 0;
+	element.glob		= element_.glob ? strdup(element_.glob) : 0;
+	element.decode		= element_.decode
+				    ? strdup(element_.decode) : 0;
+	element.passCaps	= element_.passCaps
+				    ? strdup(element_.passCaps) : 0;
+	element.remux		= element_.remux
+				    ? strdup(element_.remux) : 0;
+	element.shared		= false;
+	// a variant must be unique (and not 0).
+	// one that collides is moved (for as long as it does).
+	element.variant		= variantOf(element);
+	for (iterator it = begin(); it != end();) {
+	    if (element.variant && it->variant != element.variant) {
+		++it;
+	    } else {
+		++element.variant;
+		it = begin();
+	    }
+	}
+	if (!element.variant) element.variant = 1;	// (we were empty)
+	// the targets of elements whose source extensions overlap
+	// may be made from the same source file
+	for (iterator it = begin(); it != end(); ++it) {
+	    if (overlaps(it->source, element.source)) {
+		it->shared = element.shared = true;
+	    }
+	}
+	last = insert(end(), element);
+	// the Element in our container is stable as long as we are
+	sources.add(last->source, &*last);
+	targets.add(last->target, &*last);
+    }
+
+    bool Mapping::selects(Element const & element, char const * source,
+	    bool ambiguous, bool * undecided) throw() {
+	if (!element.admits(source)) return false;
+	if (!(ambiguous || element.probes())) return true;
+	return select ? select(element, source, undecided) : !element.probes();
+    }
+
+    /// Return the path with the extension (at end) replaced in the buffer
+    /// of size or 0 if it would not fit.
+    static char const * replaceExtension(char const * path, char const * end,
+	    char const * extension, char * buffer, size_t size) throw() {
+	size_t baseLength = end - path;
 	size_t extensionLength = strlen(extension) + 1;
-	char * result = new char[baseLength + extensionLength];
-	memcpy(baseLength + static_cast<char *>(memcpy(result,
-	    base, baseLength)),
-	    extension, extensionLength);
-	return result;
-    }
-
-    /// For use as a custom deleter for a boost::shared_ptr
-    /// when we want nothing to happen.
-    struct Noop {
-	void operator()(void const *) const {}
-    };
-
-    boost::shared_ptr<char const> Mapping::sourceFrom(
-	    char const * path, Element * elementReturn) throw() {
-	ByTargetIndex & byTargetIndex = get<TargetIndex>();
-	char const * extension = path;
-	while ((extension = strchr(extension, '.'))) {
-	    ByTargetIndex::iterator it = byTargetIndex.find(++extension);
-	    if (it != byTargetIndex.end()) {
-		Element const element = *it;
-		if (elementReturn) *elementReturn = element;
-		return boost::shared_ptr<char const>(
-		    newConcatenation(path, extension, element.source));
+	if (baseLength + extensionLength > size) return 0;
+	memcpy(buffer, path, baseLength);
+	memcpy(buffer + baseLength, extension, extensionLength);
+	return buffer;
+    }
+
+    char const * Mapping::sourceFrom(char const * path,
+	    char * buffer, size_t size, Element * elementReturn,
+	    bool * undecided) throw() {
+	Suffixes::Match matches[8];
+	size_t count = targets.find(path, strlen(path),
+	    matches, sizeof matches / sizeof *matches);
+	// try the longest extension first
+	while (count--) {
+	    std::vector<Element const *> const & elements
+		= *matches[count].elements;
+	    for (size_t i = 0; i < elements.size(); ++i) {
+		Element const & element = *elements[i];
+		char const * result = replaceExtension(
+		    path, matches[count].extension, element.source,
+		    buffer, size);
+		// the source of this target may not be the one that exists
+		// if there are others that it could be
+		bool pending = false;
+		if (result && (selects(element, result, 1 < elements.size(),
+			    undecided ? &pending : 0)
+			|| pending)) {
+		    if (pending) *undecided = true;
+		    if (elementReturn) *elementReturn = element;
+		    return result;
+		}
 	    }
 	}
-	return boost::shared_ptr<char const>(path, Noop());
+	return path;
+    }
+
+    /// Return true if the target of an element made from the base
+    /// (of baseLength) of path is result.
+    static bool makes(char const * path, size_t baseLength,
+	    Element const & element, char const * result) throw() {
+	return 0 == strncmp(path, result, baseLength)
+	    && 0 == strcmp(result + baseLength, element.target);
     }
 
-    boost::shared_ptr<char const> Mapping::targetFrom(
-	    char const * path, Element * elementReturn) throw() {
-	BySourceIndex & bySourceIndex = get<SourceIndex>();
-	char const * extension = path;
-	while ((extension = strchr(extension, '.'))) {
-	    BySourceIndex::iterator it = bySourceIndex.find(++extension);
-	    if (it != bySourceIndex.end()) {
-		Element const element = *it;
+    char const * Mapping::targetFrom(char const * path,
+	    char * buffer, size_t size, Element * elementReturn,
+	    size_t * position) throw() {
+	Suffixes::Match matches[8];
+	size_t count = sources.find(path, strlen(path),
+	    matches, sizeof matches / sizeof *matches);
+	// each Element is at a position, in the order they are tried.
+	// we continue from the one after the last target made.
+	size_t from = position ? *position : 0;
+	size_t at = 0;
+	// try the longest extension first
+	for (size_t match = count; match--;) {
+	    std::vector<Element const *> const & elements
+		= *matches[match].elements;
+	    for (size_t i = 0; i < elements.size(); ++i, ++at) {
+		if (at < from) continue;
+		Element const & element = *elements[i];
+		bool pending;
+		if (!selects(element, path, false, &pending)) continue;
+		char const * result = replaceExtension(
+		    path, matches[match].extension, element.target,
+		    buffer, size);
+		if (!result) {
+		    if (!from) return path;
+		    continue;
+		}
+		// skip a target (distinct by name) made before.
+		// this is rare so we look for one without remembering them.
+		bool before = false;
+		size_t earlier = 0;
+		for (size_t m = count; !before && m-- > match;) {
+		    std::vector<Element const *> const & others
+			= *matches[m].elements;
+		    size_t baseLength = matches[m].extension - path;
+		    for (size_t j = 0; !before && j < others.size()
+			    && earlier < at; ++j, ++earlier) {
+			before = makes(path, baseLength, *others[j], result)
+			    && selects(*others[j], path, false, &pending);
+		    }
+		}
+		if (before) continue;
 		if (elementReturn) *elementReturn = element;
-		return boost::shared_ptr<char const>(
-		    newConcatenation(path, extension, element.target));
+		if (position) *position = at + 1;
+		return result;
+	    }
+	}
+	return path;
+    }
+
+    std::vector<Element> Mapping::fanOut(Element const & element,
+	    char const * source) throw() {
+	std::vector<Element> elements(1, element);
+	if (!element.decode) return elements;
+	for (iterator it = begin(); it != end(); ++it) {
+	    if (it->variant == element.variant
+		    || !it->decode || strcmp(it->decode, element.decode)
+		    || strcmp(it->source, element.source)
+		    || it->probes() || !it->admits(source))
+		continue;
+	    elements.push_back(*it);
+	}
+	return elements;
+    }
+
+    /// Return the pipeline description of the element,
+    /// ending with an fdsink of name.
+    static std::string branch(Element const & element, char const * name)
+	    throw() {
+	return std::string(element.pipeline)
+	    + (*element.pipeline ? " ! " : "")
+	    + "fdsink name=" + name;
+    }
+
+    std::string Mapping::describe(std::vector<Element> const & elements)
+	    throw() {
+	std::string description(
+	    #if GST_CHECK_VERSION(1,0,0)
+		// this is the more elegant solution
+		// which will allow us to use an fd directly
+		// but will cause FLAC tags to be lost in old versions
+		"fdsrc name=fdsrc ! "
+	    #else
+		// this is a kludgy solution
+		// which will cause us to derive a location from an fd
+		// but will not cause FLAC tags to be lost
+		"filesrc name=filesrc ! "
+	    #endif
+	    );
+	Element const & element = elements.front();
+	if (element.decode && *element.decode) {
+	    description += element.decode;
+	    description += " ! ";
+	}
+	if (1 == elements.size()) {
+	    return description + branch(element, "fdsink");
+	}
+	// tee the decoding to a queued branch for each element
+	description += "tee name=tee";
+	for (size_t i = 0; i < elements.size(); ++i) {
+	    std::ostringstream name;
+	    name << "fdsink";
+	    if (i) name << elements[i].variant;
+	    description += " tee. ! queue ! ";
+	    description += branch(elements[i], name.str().c_str());
+	}
+	return description;
+    }
+
+    /// Parse the pipeline description,
+    /// reporting failure and, if timing, how long it took to out.
+    /// \return True if successful.
+    static bool prepare(std::string const & description,
+	    std::ostream & out, bool timing) throw() {
+	double began = Utility::now();
+	GError * error = 0;
+	// without fatal errors, a pipeline that is missing elements
+	// might still be built
+	GstElement * pipeline = gst_parse_launch_full(description.c_str(),
+	    0, GST_PARSE_FLAG_FATAL_ERRORS, &error);
+	double elapsed = Utility::now() - began;
+	if (error) {
+	    out << description << ": " << error->message << std::endl;
+	    g_error_free(error);
+	} else if (timing) {
+	    out << description << ": parsed in "
+		<< elapsed * 1000 << " ms" << std::endl;
+	}
+	if (!pipeline) return false;
+	gst_object_unref(pipeline);
+	return !error;
+    }
+
+    size_t Mapping::prepare(std::ostream & out, bool timing) throw() {
+	double began = Utility::now();
+	size_t failures = 0;
+	for (iterator it = begin(); it != end(); ++it) {
+	    std::vector<Element> elements(1, *it);
+	    if (!Transcode::prepare(describe(elements), out, timing))
+		++failures;
+	    if (it->remux) {
+		elements.front().pipeline = it->remux;
+		elements.front().decode = 0;
+		if (!Transcode::prepare(describe(elements), out, timing))
+		    ++failures;
 	    }
 	}
-	return boost::shared_ptr<char const>(path, Noop());
+	if (timing) {
+	    out << size() << " mappings prepared in "
+		<< (Utility::now() - began) * 1000 << " ms" << std::endl;
+	}
+	return failures;
     }
 }
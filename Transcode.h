@@ -10,12 +10,13 @@
 #ifndef Transcode_h
 #define Transcode_h
 
-#include <boost/multi_index_container.hpp>
-#include <boost/multi_index/ordered_index.hpp>
-#include <boost/multi_index/member.hpp>
-#include <boost/multi_index/tag.hpp>
+#include <list>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
 
-#include <boost/shared_ptr.hpp>
+#include <boost/function.hpp>
 
 #include <fuse.h>
 
@@ -25,67 +26,148 @@ namespace Transcode {
 
     /// A Transcode::Element associates a source, target and pipeline with
     /// one another.
+    /// Optional attributes qualify how the pipeline output is to be used
+    /// and which source files (beyond their extension) it applies to.
+    /// Those that are to be probed for (0 means any) are only known
+    /// by discovering the content of a source file.
     class Element {
     public:
 	char const *	source;
 	char const *	target;
 	char const *	pipeline;
+	size_t		window;	///< If not 0, stream through a window this big
+	bool		resume;	///< Retain and resume from abandoned prefixes
+	char const *	directory;	///< If not 0, source must be under it
+	char const *	glob;	///< If not 0, source path must match it
+	unsigned	minRate;	///< Minimum sample rate to probe for
+	unsigned	maxRate;	///< Maximum sample rate to probe for
+	unsigned	channels;	///< Number of channels to probe for
+	unsigned	minBitrate;	///< Minimum bitrate to probe for
+	unsigned	maxBitrate;	///< Maximum bitrate to probe for
+	char const *	decode;	///< If not 0, decoding shared with others
+	unsigned	variant;	///< Unique and stable in our Mapping
+	bool		shared;	///< Source extension overlaps another's
+	unsigned	passBitrate;	///< Maximum bitrate to pass through
+	char const *	passCaps;	///< If not 0, capabilities to pass
+	char const *	remux;	///< If not 0, pipeline instead of passing
+
 	Element() throw();
 	Element(
 	    char const * source, char const * target, char const * pipeline)
 	    throw();
+
+	/// Return true if the source path is under our directory and
+	/// matches our glob.
+	bool admits(char const * source) const throw();
+
+	/// Return true if we must probe for what a source file has.
+	bool probes() const throw();
+
+	/// Return true if what a source file has is what we probe for.
+	bool admits(unsigned rate, unsigned channels, unsigned bitrate) const
+	    throw();
+
+	/// Return true if our pipeline is the identity
+	/// (the source is always passed through).
+	bool identity() const throw();
+
+	/// Return true if we must probe for what a source file has
+	/// to decide if it should be passed through (or remuxed).
+	bool probesPass() const throw();
+
+	/// Return true if a source file with the bitrate and caps
+	/// should be passed through (or remuxed).
+	bool passes(unsigned bitrate, char const * caps) const throw();
     };
 
-    struct SourceIndex {};	///< Used only for multi_index::tag
-    struct TargetIndex {};	///< Used only for multi_index::tag
+    /// A Transcode::Suffixes is a trie of extensions, each reversed,
+    /// that finds the longest extension ending a name in a single
+    /// backward pass over it.
+    class Suffixes {
+    private:
+	struct Node {
+	    /// Child Node indexes by the character that precedes ours
+	    std::vector<std::pair<char, unsigned> > children;
+	    /// Elements of our extension, in the order they were added
+	    std::vector<Element const *> elements;
+	    Node() throw();
+	};
+	std::vector<Node> nodes;	///< nodes[0] is the root
+    public:
+	/// A Suffixes::Match is an extension found at the end of a name
+	/// and the Elements that have it.
+	struct Match {
+	    char const *			extension;
+	    std::vector<Element const *> const *	elements;
+	};
 
-    /// Transcode::Mapping uses both
-    /// &Element::source and &Element::target Element members
-    /// to order its Element objects.
+	Suffixes() throw();
+
+	/// Add the extension of the element.
+	/// The element must outlive us.
+	void add(char const * extension, Element const * element) throw();
+
+	/// Find, up to size, the extensions that follow a '.'
+	/// at the end of the name (or its last path component) of length.
+	/// \return The number of matches found, shortest extension first.
+	size_t find(char const * name, size_t length,
+	    Match * matches, size_t size) const throw();
+    };
+
+    /// Transcode::Mapping keeps its Element objects in the order that
+    /// they were added and finds them by their source and target
+    /// extensions.
+    /// The first Element (with the longest extension) that admits a
+    /// source path is the one used for it
+    /// but each of the others that admit it makes a target of its own.
+    /// Elements with the same source extension and decode
+    /// attribute may fan out from a single decoding of a source.
     /// Elements (added) to the mapping
     /// will be deleted upon mapping destruction.
-    class Mapping : private boost::multi_index_container<
-	    Element,
-	    boost::multi_index::indexed_by<
-		boost::multi_index::ordered_unique<
-		    boost::multi_index::tag<SourceIndex>,
-		    boost::multi_index::member<
-			Element, char const *, &Element::source>,
-		    Utility::LessThan<char const *>
-		>,
-		boost::multi_index::ordered_unique<
-		    boost::multi_index::tag<TargetIndex>,
-		    boost::multi_index::member<
-			Element, char const *, &Element::target>,
-		    Utility::LessThan<char const *>
-		>
-	    >
-	>
-    {
+    class Mapping : private std::list<Element> {
 
     private:
 
-	typedef index<SourceIndex>::type BySourceIndex;
-	typedef index<TargetIndex>::type ByTargetIndex;
+	iterator last;			///< Element most recently added
+	Suffixes sources;		///< Source extensions
+	Suffixes targets;		///< Target extensions
 
-	void add(
-	    char const * source, char const * target, char const * pipeline)
-	    throw();
+	/// Add a copy of the element (and what it references).
+	void add(Element const & element) throw();
+
+	/// Return true if the element should be used for the source path.
+	/// If ambiguous, the source may not exist.
+	/// If undecided is given, don't wait for what the source has to be
+	/// discovered (setting it instead).
+	bool selects(Element const & element, char const * source,
+	    bool ambiguous, bool * undecided) throw();
 
     public:
 
+	/// If set, select is called to decide if an Element should be used
+	/// for a source path that may not exist (because others could be)
+	/// or that must be probed.
+	/// It should return true only if the source file exists and,
+	/// if probed, has what the Element probes for.
+	/// If undecided is given, it should not wait for that to be discovered
+	/// but return false and set undecided until it has been.
+	/// Otherwise, Elements that probe are never used.
+	boost::function<bool (Element const &, char const * source,
+	    bool * undecided)> select;
+
 	/// The option method of a Transcode::Mapping::Builder can be
 	/// called while parsing fuse_args to collect source, target and
 	/// pipeline associations and add them to its mapping.
 	/// Each Mapping has a public Builder that should be so-used to
 	/// build the Transcode mapping.
+	/// Options for optional Element attributes apply to the Element
+	/// being built or, if none is pending, the one most recently built.
 	class Builder {
 	private:
 	    Mapping &		mapping;
-	    char const *	source;
-	    char const *	target;
-	    char const *	pipeline;
+	    Element		element;	///< Pending Element
 	    void build() throw();
+	    Element * attributed() throw();
 	public:
 	    Builder(Mapping & mapping) throw();
 	    ~Builder() throw();
@@ -99,21 +181,52 @@ namespace Transcode {
 	~Mapping() throw();
 	size_t size() throw();
 
-	/// Return argument if no mapping from target path to source;
-	/// otherwise, new char[] with mapped result
+	/// Return argument if no mapping from target path to source
+	/// (or if the mapped result would not fit in the buffer of size);
+	/// otherwise, buffer with mapped result
 	/// and, if requested, the Element of the mapping.
-	/// Result wrapped in smart pointer to destroy allocated memory if/when
-	/// needed.
-	boost::shared_ptr<char const> sourceFrom(
-	    char const * path, Element * element = 0) throw();
-
-	/// Return argument if no mapping from source path to target;
-	/// otherwise, new char[] with mapped result
+	/// If undecided is given, this does not wait for what a source has
+	/// to be discovered: the first whose Element must wait for it
+	/// is returned (with that Element) and undecided is set.
+	char const * sourceFrom(char const * path,
+	    char * buffer, size_t size, Element * element = 0,
+	    bool * undecided = 0) throw();
+
+	/// Return argument if no mapping from source path to target
+	/// (or if the mapped result would not fit in the buffer of size);
+	/// otherwise, buffer with mapped result
 	/// and, if requested, the Element of the mapping.
-	/// Result wrapped in smart pointer to destroy allocated memory if/when
-	/// needed.
-	boost::shared_ptr<char const> targetFrom(
-	    char const * path, Element * element = 0) throw();
+	/// A source path may map to more than one target, the first being
+	/// the one used for the source.
+	/// If a position is given, the next is looked for from there
+	/// (0 for the first) and it is advanced past the one returned,
+	/// so that each is visited once.
+	/// This does not wait for what the source has to be discovered:
+	/// until it has been, Elements that probe for it are not used.
+	char const * targetFrom(char const * path,
+	    char * buffer, size_t size, Element * element = 0,
+	    size_t * position = 0) throw();
+
+	/// Return the element followed by the others that
+	/// could fan out from its decoding of the source path.
+	/// Others that probe for what a source has are not included.
+	std::vector<Element> fanOut(Element const & element,
+	    char const * source) throw();
+
+	/// Return the pipeline description that transcodes with
+	/// the elements (from a fanOut, or just one) from an fdsrc
+	/// (or filesrc) to an fdsink for the first and an fdsinkVARIANT
+	/// for each of the others.
+	static std::string describe(std::vector<Element> const & elements)
+	    throw();
+
+	/// Parse the pipeline description of each Element (and its remux),
+	/// which loads the plugins that they need so that they are ready
+	/// when first used.
+	/// Failures are reported to out and, if timing,
+	/// so is how long each took.
+	/// \return The number of pipeline descriptions that failed to parse.
+	size_t prepare(std::ostream & out, bool timing) throw();
     };
 }
 
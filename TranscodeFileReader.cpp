@@ -6,8 +6,10 @@
 /// GNU Lesser General Public License (LGPL).
 /// See COPYING file for details.
 
+#include <cmath>
 #include <iostream>
 #include <map>
+#include <sstream>
 
 #include <gst/gst.h>
 #include <glib.h>
@@ -18,23 +20,120 @@
 
 #include "readlink.h"
 #include "Cwd.h"
+#include "Metrics.h"
+#include "Trace.h"
 #include "TranscodeFileReader.h"
 #include "Utility.h"
 
 TranscodeFileReader::TranscodeFileReader(
     FileIndex fileIndex_, int fd_,
-    char const * pipelineDescription,
+    Transcode::Element const & transcodeElement_,
     boost::shared_ptr<void const> & doneGuarantee,
-    boost::function<void (Reader *)> done) throw()
+    boost::function<void (Reader *)> done_,
+    Image::Budget * imageBudget_,
+    ImageConstPointer prefix_,
+    boost::function<void (ImageConst *)> retain_,
+    boost::function<void (bool)> outcome_,
+    ImageCache::EndsConstPointer ends_,
+    boost::function<void ()> forgetEnds_,
+    bool lazy,
+    unsigned grace_,
+    std::vector<Transcode::Element> const & siblings_,
+    boost::function<void (unsigned, ImageConst *)> warm_) throw()
 :
     FileReader(fileIndex_, fd_),
+    transcodeElement(transcodeElement_),
+    imageBudget(imageBudget_),
+    prefix(prefix_),
+    prefixRead(false),
+    ends(ends_),
+    endsRead(false),
+    forgetEnds(forgetEnds_),
+    done(done_),
+    started(!lazy),
+    abandoned(false),
+    guard(new Guard),
+    began(Utility::now()),
     pipeline(0),
     bus(0),
-    imageBuilderThread(0)
+    imageBuilderThread(0),
+    siblings(siblings_),
+    siblingThreads(),
+    warm(warm_),
+    retain(retain_),
+    outcome(outcome_),
+    reportMutex(),
+    reported(false),
+    failure(false),
+    usageMutex(),
+    entered(),
+    cpuSeconds(0)
 {
+    ++Metrics::transcodes;
+    TRACE_FILE(transcode__create, fileIndex);
+    guard->reader = this;
+    if (started) {
+	// guarantee a call to the done function object until
+	// we transfer the guarantee to our imageBuilderThread
+	doneGuarantee.reset(static_cast<void const *>(0),
+	    boost::bind(done, this));
+	launch(doneGuarantee);
+    } else if (grace_) {
+	// start after our grace period from the glib main loop
+	// unless we are started or destroyed first.
+	g_timeout_add_full(G_PRIORITY_DEFAULT, grace_,
+	    reinterpret_cast<GSourceFunc>(start_),
+	    new boost::shared_ptr<Guard>(guard),
+	    reinterpret_cast<GDestroyNotify>(unref_));
+    }
+}
+
+void TranscodeFileReader::start(bool graceful) throw() {
+    boost::mutex::scoped_lock lock(startMutex);
+    if (started || (graceful && abandoned)) return;
+    started = true;
     // guarantee a call to the done function object until
     // we transfer the guarantee to our imageBuilderThread
-    doneGuarantee.reset(static_cast<void const *>(0), boost::bind(done, this));
+    boost::shared_ptr<void const> doneGuarantee(
+	static_cast<void const *>(0), boost::bind(done, this));
+    launch(doneGuarantee);
+}
+
+/*static*/ gboolean TranscodeFileReader::start_(
+	boost::shared_ptr<Guard> * guard) throw() {
+    boost::mutex::scoped_lock lock((*guard)->mutex);
+    if ((*guard)->reader) (*guard)->reader->start(true);
+    return FALSE;	// don't call us again
+}
+
+/*static*/ void TranscodeFileReader::unref_(
+	boost::shared_ptr<Guard> * guard) throw() {
+    delete guard;
+}
+
+/*static*/ void TranscodeFileReader::unrefClosure_(
+	boost::shared_ptr<Guard> * guard, GClosure *) throw() {
+    delete guard;
+}
+
+void TranscodeFileReader::connect(char const * signal, GCallback callback)
+	throw() {
+    // the handler is called with (and releases) its own share of our guard
+    g_signal_connect_data(bus, signal, callback,
+	new boost::shared_ptr<Guard>(guard),
+	reinterpret_cast<GClosureNotify>(unrefClosure_),
+	static_cast<GConnectFlags>(0));
+}
+
+void TranscodeFileReader::launch(
+	boost::shared_ptr<void const> & doneGuarantee) throw() {
+    std::vector<Transcode::Element> elements(1, transcodeElement);
+    elements.insert(elements.end(), siblings.begin(), siblings.end());
+    std::string description = Transcode::Mapping::describe(elements);
+    char const * pipelineDescription = description.c_str();
+    began = Utility::now();
+    ++Metrics::transcodesStarted;
+    TRACE_FILE(transcode__launch, fileIndex);
 
     // resolve the location of/from fd
     boost::shared_ptr<char const> locationShared = readlink(fd);
@@ -54,12 +153,18 @@ TranscodeFileReader::TranscodeFileReader(
 
     // construct our GstPipeline from the pipelineDescription
     GError * error = 0;
-    pipeline = gst_parse_launch(pipelineDescription, &error);
+    {
+	Metrics::Timer timer(Metrics::parseSeconds);
+	pipeline = gst_parse_launch(pipelineDescription, &error);
+    }
     if (error) {
 	std::cerr << error->message << std::endl;
 	g_error_free(error);
     }
-    if (!pipeline) return;
+    if (!pipeline) {
+	fail();
+	return;
+    }
 
     {
 	boost::shared_ptr<GstElement> fdsrc(
@@ -81,6 +186,7 @@ TranscodeFileReader::TranscodeFileReader(
 	    } else {
 		std::cerr << pipelineDescription
 		    << ": no element named fdsrc or filesrc" << std::endl;
+		fail();
 		return;
 	    }
 	}
@@ -95,6 +201,7 @@ TranscodeFileReader::TranscodeFileReader(
 	if (!fdsink) {
 	    std::cerr << pipelineDescription
 		<< ": no element named fdsink" << std::endl;
+	    fail();
 	    return;
 	}
 	g_object_set(G_OBJECT(fdsink.get()), "sync", 0, NULL);
@@ -102,6 +209,7 @@ TranscodeFileReader::TranscodeFileReader(
 	// create a pipe for consuming the output of the pipeline
 	if (-1 == ::pipe(pipe)) {
 	    std::cerr << "pipe failed" << std::endl;
+	    fail();
 	    return;
 	}
 
@@ -113,27 +221,101 @@ TranscodeFileReader::TranscodeFileReader(
     // create an ImageBuilderThread to consume what is output through the pipe,
     // transfer pipe ownership and our doneGuarantee to it
     // and responsibility to close the pipe ends when done
-    imageBuilderThread = new ImageBuilderThread(pipe[0], pipe[1],
-	doneGuarantee);
+    imageBuilderThread = new ImageBuilderThread(fileIndex, pipe[0], pipe[1],
+	doneGuarantee, imageBudget, transcodeElement.window, prefix, prefixRead,
+	ends, endsRead, forgetEnds, began);
+    prefix.reset();
+
+    // each sibling has its own fdsink (named fdsinkVARIANT)
+    // and ImageBuilderThread, whose image is always whole
+    for (size_t i = 0; i < siblings.size(); ++i) {
+	std::ostringstream name;
+	name << "fdsink" << siblings[i].variant;
+	boost::shared_ptr<GstElement> fdsink(
+	    gst_bin_get_by_name(GST_BIN(pipeline), name.str().c_str()),
+	    gst_object_unref);
+	if (!fdsink) {
+	    std::cerr << pipelineDescription
+		<< ": no element named " << name.str() << std::endl;
+	    stop();
+	    return;
+	}
+	if (-1 == ::pipe(pipe)) {
+	    std::cerr << "pipe failed" << std::endl;
+	    stop();
+	    return;
+	}
+	g_object_set(G_OBJECT(fdsink.get()), "sync", 0, NULL);
+	g_object_set(G_OBJECT(fdsink.get()), "fd", pipe[1], NULL);
+	FileIndex sibling(fileIndex);
+	sibling.variant = siblings[i].variant;
+	siblingThreads.push_back(new ImageBuilderThread(sibling,
+	    pipe[0], pipe[1], boost::shared_ptr<void const>(), imageBudget, 0,
+	    ImageConstPointer()));
+    }
 
     // make sure that we are notified when interesting things happen
     {
 	bus = gst_pipeline_get_bus(GST_PIPELINE(pipeline));
 	gst_bus_add_signal_watch(bus);
-	g_signal_connect(bus, "message::warning",
-	    G_CALLBACK(warning_), this);
-	g_signal_connect(bus, "message::error",
-	    G_CALLBACK(error_), this);
-	g_signal_connect(bus, "message::eos",
-	    G_CALLBACK(ImageBuilderThread::eos_), this->imageBuilderThread);
+	// these are handled in the glib main loop, through our guard
+	connect("message::warning", G_CALLBACK(warning_));
+	connect("message::error", G_CALLBACK(error_));
+	connect("message::eos", G_CALLBACK(eos_));
+	// stream status is handled in the streaming thread that posts it
+	// (and our pipeline is stopped, without any, before we are destroyed)
+	gst_bus_enable_sync_message_emission(bus);
+	g_signal_connect(bus, "sync-message::stream-status",
+	    G_CALLBACK(streamStatus_), this);
     }
 
     // start the pipeline
-    if (GST_STATE_CHANGE_ASYNC
-	    == gst_element_set_state(pipeline, GST_STATE_PLAYING)) {
+    double playing = Utility::now();
+    switch (gst_element_set_state(pipeline, GST_STATE_PLAYING)) {
+    case GST_STATE_CHANGE_ASYNC:
 	// block until async state change completes
+	if (GST_STATE_CHANGE_FAILURE
+		!= gst_element_get_state(pipeline, 0, 0, GST_CLOCK_TIME_NONE)) {
+	    Metrics::playSeconds.record(Utility::now() - playing);
+	    break;
+	}
+	// fall through
+    case GST_STATE_CHANGE_FAILURE:
+	std::cerr << pipelineDescription << ": failed to start" << std::endl;
+	stop();
+	break;
+    default:
+	Metrics::playSeconds.record(Utility::now() - playing);
+	break;
+    }
+}
+
+void TranscodeFileReader::fail() throw() {
+    failure = true;
+    report(false);
+}
+
+void TranscodeFileReader::report(bool success) throw() {
+    boost::mutex::scoped_lock lock(reportMutex);
+    if (reported) return;
+    reported = true;
+    if (outcome) outcome(success);
+}
+
+void TranscodeFileReader::stop() throw() {
+    // a pipeline that has failed will not stream to its end.
+    // stop it (without our imageBuilderThread blocking it)
+    // and then our imageBuilderThread.
+    fail();
+    imageBuilderThread->abort();
+    if (GST_STATE_CHANGE_ASYNC
+	    == gst_element_set_state(pipeline, GST_STATE_NULL)) {
 	gst_element_get_state(pipeline, 0, 0, GST_CLOCK_TIME_NONE);
     }
+    imageBuilderThread->stopRunning();
+    for (size_t i = 0; i < siblingThreads.size(); ++i) {
+	siblingThreads[i]->stopRunning();
+    }
 }
 
 gboolean TranscodeFileReader::warning(GstBus * bus, GstMessage * message) throw() {
@@ -146,8 +328,10 @@ gboolean TranscodeFileReader::warning(GstBus * bus, GstMessage * message) throw(
     return TRUE;	// call us again
 }
 /*static*/ gboolean TranscodeFileReader::warning_(
-	GstBus * bus, GstMessage * message, TranscodeFileReader * that) throw() {
-    return that->warning(bus, message);
+	GstBus * bus, GstMessage * message, boost::shared_ptr<Guard> * guard)
+	throw() {
+    boost::mutex::scoped_lock lock((*guard)->mutex);
+    return (*guard)->reader ? (*guard)->reader->warning(bus, message) : FALSE;
 }
 
 gboolean TranscodeFileReader::error(GstBus * bus, GstMessage * message) throw() {
@@ -157,21 +341,109 @@ gboolean TranscodeFileReader::error(GstBus * bus, GstMessage * message) throw()
     std::cerr << "error=" << error->message << ", debug=" << debug << std::endl;
     g_error_free(error);
     g_free(debug);
+    stop();
     return TRUE;	// call us again
 }
 /*static*/ gboolean TranscodeFileReader::error_(
-	GstBus * bus, GstMessage * message, TranscodeFileReader * that) throw() {
-    return that->error(bus, message);
+	GstBus * bus, GstMessage * message, boost::shared_ptr<Guard> * guard)
+	throw() {
+    boost::mutex::scoped_lock lock((*guard)->mutex);
+    return (*guard)->reader ? (*guard)->reader->error(bus, message) : FALSE;
+}
+
+gboolean TranscodeFileReader::eos(GstBus * bus, GstMessage * message)
+	throw() {
+    imageBuilderThread->eos();
+    for (size_t i = 0; i < siblingThreads.size(); ++i) {
+	siblingThreads[i]->eos();
+    }
+    return TRUE;	// call us again
+}
+/*static*/ gboolean TranscodeFileReader::eos_(
+	GstBus * bus, GstMessage * message, boost::shared_ptr<Guard> * guard)
+	throw() {
+    boost::mutex::scoped_lock lock((*guard)->mutex);
+    return (*guard)->reader ? (*guard)->reader->eos(bus, message) : FALSE;
+}
+
+void TranscodeFileReader::streamStatus(GstBus * bus, GstMessage * message)
+	throw() {
+    // account for the CPU used by each streaming thread
+    // between when it enters and leaves its task for us.
+    GstStreamStatusType type;
+    GstElement * owner;
+    gst_message_parse_stream_status(message, &type, &owner);
+    boost::mutex::scoped_lock lock(usageMutex);
+    switch (type) {
+    case GST_STREAM_STATUS_TYPE_ENTER:
+	entered[pthread_self()] = Utility::threadCpu();
+	break;
+    case GST_STREAM_STATUS_TYPE_LEAVE: {
+	std::map<pthread_t, double>::iterator it = entered.find(pthread_self());
+	if (it != entered.end()) {
+	    cpuSeconds += Utility::threadCpu() - it->second;
+	    entered.erase(it);
+	}
+	break;
+    }
+    default:
+	break;
+    }
+}
+/*static*/ void TranscodeFileReader::streamStatus_(
+	GstBus * bus, GstMessage * message, TranscodeFileReader * that)
+	throw() {
+    that->streamStatus(bus, message);
+}
+
+void TranscodeFileReader::account(double mediaSeconds) throw() {
+    // called when our pipeline is stopped and our threads are done
+    Metrics::Usage usage;
+    usage.mediaSeconds = mediaSeconds;
+    imageBuilderThread->usage(usage);
+    for (size_t i = 0; i < siblingThreads.size(); ++i) {
+	siblingThreads[i]->usage(usage);
+    }
+    {
+	boost::mutex::scoped_lock lock(usageMutex);
+	usage.cpuSeconds += cpuSeconds;
+    }
+    // our source is read sequentially by fdsrc
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (0 < offset) usage.sourceBytes = offset;
+    std::ostringstream labels;
+    labels << "mapping=\"" << transcodeElement.variant
+	<< "\",source=\"" << transcodeElement.source
+	<< "\",target=\"" << transcodeElement.target << '"';
+    Metrics::account(labels.str(), usage);
 }
 
 /*virtual*/ TranscodeFileReader::~TranscodeFileReader() throw() {
+    --Metrics::transcodes;
+    TRACE_FILE(transcode__destroy, fileIndex);
+    // make sure that no glib callback (our grace timeout or bus signal
+    // handlers) will call us, waiting for any that is (e.g. to stop us)
+    {
+	boost::mutex::scoped_lock lock(guard->mutex);
+	guard->reader = 0;
+    }
+    // make sure our imageBuilderThread does not block the pipeline
+    // while it is being stopped
+    if (imageBuilderThread) imageBuilderThread->abort();
+    double mediaSeconds = 0;
     if (pipeline) {
+	// how much media was transcoded, while the pipeline still knows
+	gint64 position;
+	if (gst_element_query_position(pipeline, GST_FORMAT_TIME, &position)
+		&& 0 < position)
+	    mediaSeconds = static_cast<double>(position) / GST_SECOND;
 	if (GST_STATE_CHANGE_ASYNC
 		== gst_element_set_state(pipeline, GST_STATE_NULL)) {
 	    // block until async state change completes
 	    gst_element_get_state(pipeline, 0, 0, GST_CLOCK_TIME_NONE);
 	}
 	if (bus) {
+	    gst_bus_disable_sync_message_emission(bus);
 	    gst_bus_remove_signal_watch(bus);
 	    gst_object_unref(bus);
 	}
@@ -179,7 +451,22 @@ gboolean TranscodeFileReader::error(GstBus * bus, GstMessage * message) throw()
     }
     if (imageBuilderThread) {
 	imageBuilderThread->stopRunning();
+	for (size_t i = 0; i < siblingThreads.size(); ++i) {
+	    siblingThreads[i]->stopRunning();
+	}
+	account(mediaSeconds);
+	// what a failed pipeline built is not worth retaining
+	ImageConst * prefix = retain && !failure
+	    ? imageBuilderThread->getPrefix() : 0;
 	delete imageBuilderThread;
+	if (prefix) retain(prefix);
+    }
+    for (size_t i = 0; i < siblingThreads.size(); ++i) {
+	// a sibling image is complete only if the pipeline got to its end
+	ImageConst * image = warm && !failure
+	    ? siblingThreads[i]->awaitImage() : 0;
+	delete siblingThreads[i];
+	if (image) warm(siblings[i].variant, image);
     }
 }
 
@@ -187,16 +474,159 @@ gboolean TranscodeFileReader::error(GstBus * bus, GstMessage * message) throw()
 	char * buffer, size_t size, off_t offset_) throw() {
     if (0 > offset_) return -EINVAL;
     size_t offset = offset_;
+    {
+	boost::mutex::scoped_lock lock(startMutex);
+	if (ends) {
+	    // a probe of our ends need not wait for (or start) the pipeline.
+	    // once started, our imageBuilderThread checks them.
+	    ssize_t length = -1;
+	    if (!started) {
+		length = ends->read(buffer, size, offset);
+		if (0 <= length) endsRead = true;
+	    } else if (imageBuilderThread) {
+		length = imageBuilderThread->readEnds(buffer, size, offset);
+	    }
+	    if (0 <= length) {
+		Metrics::transcodeFileReaderBytes += length;
+		return length;
+	    }
+	}
+	// until we are started, what is in our prefix need not start us
+	if (!started && prefix && offset + size <= prefix->size()) {
+	    prefix->copy(offset, size, buffer);
+	    prefixRead = true;
+	    Metrics::transcodeFileReaderBytes += size;
+	    return size;
+	}
+    }
+    start();
     if (!imageBuilderThread) return -EIO;
-    return imageBuilderThread->read(buffer, size, offset);
+    ssize_t length = imageBuilderThread->read(buffer, size, offset);
+    // a failed pipeline did not get to the end
+    if (!length && failure) return -EIO;
+    if (0 < length) Metrics::transcodeFileReaderBytes += length;
+    return length;
 }
 
 /*virtual*/ size_t TranscodeFileReader::size(bool wait) throw() {
+    {
+	// our ends know the size unless the transcoding proves them wrong
+	boost::mutex::scoped_lock lock(startMutex);
+	if (ends) {
+	    ssize_t size = started
+		? imageBuilderThread ? imageBuilderThread->endsSize() : -1
+		: ends->size;
+	    if (0 <= size) return size;
+	}
+    }
+    if (wait) start();
+    // waiting for the image to be complete can take as long as the
+    // transcoding so don't hold startMutex (others need it) while we do.
+    // once launched, our imageBuilderThread lasts as long as we do.
+    ImageBuilderThread * imageBuilderThread;
+    {
+	boost::mutex::scoped_lock lock(startMutex);
+	imageBuilderThread = this->imageBuilderThread;
+    }
     return imageBuilderThread ? imageBuilderThread->size(wait) : 0;
 }
 
 /* virtual*/ ImageConst * TranscodeFileReader::getImage() throw() {
-    return imageBuilderThread->getImage();
+    boost::mutex::scoped_lock lock(startMutex);
+    ImageConst * image = imageBuilderThread && !failure
+	? imageBuilderThread->getImage() : 0;
+    if (image) report(true);
+    return image;
+}
+
+/*virtual*/ bool TranscodeFileReader::transcodes() throw() {
+    return true;
+}
+
+/*virtual*/ void TranscodeFileReader::abandon() throw() {
+    boost::mutex::scoped_lock lock(startMutex);
+    abandoned = true;
+}
+
+/*virtual*/ bool TranscodeFileReader::building() throw() {
+    boost::mutex::scoped_lock lock(startMutex);
+    return imageBuilderThread && imageBuilderThread->building();
+}
+
+/*virtual*/ double TranscodeFileReader::progress() throw() {
+    boost::mutex::scoped_lock lock(startMutex);
+    if (!imageBuilderThread) return 0;
+    if (!imageBuilderThread->isRunning()) return 1;
+    // our source is read sequentially so its offset reflects our progress.
+    // even when it has all been read, the pipeline is not done until
+    // what has been read is transcoded.
+    struct stat st;
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (-1 == offset || -1 == fstat(fd, &st) || !st.st_size) return 0;
+    double progress = static_cast<double>(offset) / st.st_size;
+    return progress < .999 ? progress : .999;
+}
+
+/*virtual*/ double TranscodeFileReader::remaining() throw() {
+    double progress = this->progress();
+    if (1 <= progress) return 0;
+    if (0 >= progress) return HUGE_VAL;
+    return (Utility::now() - began) * (1 - progress) / progress;
+}
+
+/*virtual*/ double TranscodeFileReader::elapsed() throw() {
+    boost::mutex::scoped_lock lock(startMutex);
+    return imageBuilderThread ? Utility::now() - began : 0;
+}
+
+void TranscodeFileReader::ImageBuilderThread::usage(Metrics::Usage & usage)
+	throw() {
+    Synchronized synchronized(*this);
+    while (running) synchronized.wait();
+    usage.cpuSeconds += cpuSeconds;
+    // only the first of those fanned out to was timed
+    if (began) usage.wallSeconds = ended - began;
+    usage.imageBytes += built;
+    // (as if the peaks of those fanned out to coincided)
+    usage.peakBytes += peak;
+}
+
+ImageConst * TranscodeFileReader::ImageBuilderThread::awaitImage() throw() {
+    {
+	Synchronized synchronized(*this);
+	while (running) synchronized.wait();
+    }
+    return getImage();
+}
+
+ImageConst * TranscodeFileReader::ImageBuilderThread::getPrefix() throw() {
+    Synchronized synchronized(*this);
+    while (running) synchronized.wait();
+    if (!streaming || window || !image || !image->size()) {
+	// image is complete (offered by getImage), not whole or empty
+	return 0;
+    } else {
+	// transfer ownership of our incomplete image to the caller.
+	ImageConst * image = this->image;
+	this->image = 0;
+	return image;
+    }
+}
+
+bool TranscodeFileReader::ImageBuilderThread::isRunning() throw() {
+    Synchronized synchronized(*this);
+    return running;
+}
+
+bool TranscodeFileReader::ImageBuilderThread::building() throw() {
+    Synchronized synchronized(*this);
+    return running && !window;
+}
+
+void TranscodeFileReader::ImageBuilderThread::abort() throw() {
+    Synchronized synchronized(*this);
+    aborting = true;
+    synchronized.notifyAll();
 }
 
 void TranscodeFileReader::ImageBuilderThread::stopRunning() throw() {
@@ -207,30 +637,64 @@ void TranscodeFileReader::ImageBuilderThread::stopRunning() throw() {
     }
 }
 
-gboolean TranscodeFileReader::ImageBuilderThread::eos(
-	GstBus * bus, GstMessage * message) throw() {
+void TranscodeFileReader::ImageBuilderThread::eos() throw() {
+    if (began) Metrics::eosSeconds.record(Utility::now() - began);
+    TRACE_FILE(transcode__eos, fileIndex);
     streaming = false;
     stopRunning();
-    return TRUE;	// call us again
-}
-/*static*/ gboolean TranscodeFileReader::ImageBuilderThread::eos_(
-	GstBus * bus, GstMessage * message, ImageBuilderThread * that) throw() {
-    return that->eos(bus, message);
 }
 
 ssize_t TranscodeFileReader::ImageBuilderThread::read(
 	char * buffer, size_t size, size_t offset) throw() {
-    // wait until we can answer the request
     Synchronized synchronized(*this);
-    while (running && offset + size > image->size()) synchronized.wait();
+    // what was read from an abandoned prefix cannot be continued
+    if (diverged) return -EIO;
+    // answer the request from our prefix if we can
+    if (prefix && offset + size <= prefix->size()) {
+	prefix->copy(offset, size, buffer);
+	prefixRead = true;
+	return size;
+    }
+    // wait until we can answer the request
+    if (window) {
+	// anything before this offset can be dropped to make room for it
+	if (offset > furthest) {
+	    furthest = offset;
+	    synchronized.notifyAll();
+	}
+    }
+    if (running && offset + size > image->size()) {
+	while (running && offset + size > image->size()) synchronized.wait();
+	TRACE_FILE_BYTES2(image__wakeup, fileIndex, offset, size);
+    }
     // answer the request the best we can
+    if (diverged) return -EIO;
+    if (offset < image->begin()) return -ESPIPE;
     if (offset >= image->size()) return 0;
     size_t available = image->size() - offset;
     size_t copy = size < available ? size : available;
     image->copy(offset, copy, buffer);
+    if (window && offset + copy > furthest) {
+	furthest = offset + copy;
+	synchronized.notifyAll();
+    }
     return copy;
 }
 
+ssize_t TranscodeFileReader::ImageBuilderThread::readEnds(
+	char * buffer, size_t size, size_t offset) throw() {
+    Synchronized synchronized(*this);
+    if (!ends) return -1;
+    ssize_t length = ends->read(buffer, size, offset);
+    if (0 <= length) endsRead = true;
+    return length;
+}
+
+ssize_t TranscodeFileReader::ImageBuilderThread::endsSize() throw() {
+    Synchronized synchronized(*this);
+    return ends ? static_cast<ssize_t>(ends->size) : -1;
+}
+
 size_t TranscodeFileReader::ImageBuilderThread::size(bool wait) throw() {
     // wait until we can answer the request
     Synchronized synchronized(*this);
@@ -241,7 +705,7 @@ size_t TranscodeFileReader::ImageBuilderThread::size(bool wait) throw() {
 
 ImageConst * TranscodeFileReader::ImageBuilderThread::getImage() throw() {
     Synchronized synchronized(*this);
-    if (streaming) {
+    if (streaming || running || window) {
 	// image is not complete
 	return 0;
     } else {
@@ -253,6 +717,39 @@ ImageConst * TranscodeFileReader::ImageBuilderThread::getImage() throw() {
     }
 }
 
+/// \return False if length bytes of tile at offset of our image
+/// are beyond or do not agree with our ends.
+bool TranscodeFileReader::ImageBuilderThread::agrees(
+	size_t offset, char const * tile, size_t length) const throw() {
+    if (offset + length > ends->size) return false;
+    std::string const & head = ends->head;
+    if (offset < head.size()) {
+	size_t size = head.size() - offset;
+	if (size > length) size = length;
+	if (memcmp(head.data() + offset, tile, size)) return false;
+    }
+    std::string const & tail = ends->tail;
+    size_t tailOffset = ends->size - tail.size();
+    if (offset + length > tailOffset) {
+	size_t from = offset > tailOffset ? offset : tailOffset;
+	if (memcmp(tail.data() + from - tailOffset, tile + from - offset,
+		offset + length - from))
+	    return false;
+    }
+    return true;
+}
+
+void TranscodeFileReader::ImageBuilderThread::disagree(size_t offset)
+	throw() {
+    // callers should have already obtained a lock on *this!
+    std::cerr << "transcoding differs from its ends at "
+	<< offset << " - forgetting them" << std::endl;
+    ends.reset();
+    // those that read from them would get a splice of the two
+    if (endsRead) diverged = true;
+    if (forgetEnds) forgetEnds();
+}
+
 void TranscodeFileReader::ImageBuilderThread::run() throw() {
     char tile[8192];
     ssize_t length;
@@ -260,28 +757,102 @@ void TranscodeFileReader::ImageBuilderThread::run() throw() {
 	// append the tile to the image that has already been transcoded
 	// and notifyAll that might be waiting for this in read().
 	Synchronized synchronized(*this);
+	if (window) {
+	    // make room in the window for the tile by dropping what has been
+	    // read, waiting (and blocking the pipeline) until there is.
+	    for (;;) {
+		size_t need = image->size() + length;
+		need = need > window ? need - window : 0;
+		if (need <= image->begin()) break;
+		if (aborting) break;
+		if (need <= furthest) {
+		    image->drop(need);
+		    break;
+		}
+		synchronized.wait();
+	    }
+	}
+	if (prefix) {
+	    // make sure that what we append is what was expected
+	    size_t offset = image->size();
+	    if (offset < prefix->size()) {
+		size_t size = prefix->size() - offset;
+		if (size > static_cast<size_t>(length)) size = length;
+		char expected[sizeof tile];
+		prefix->copy(offset, size, expected);
+		if (memcmp(expected, tile, size)) {
+		    std::cerr << "transcoding differs from its prefix at "
+			<< offset << " - abandoning prefix" << std::endl;
+		    prefix.reset();
+		    // those that read from it would get a splice of the two
+		    if (prefixRead) diverged = true;
+		}
+	    }
+	}
+	if (ends && !agrees(image->size(), tile, length)) {
+	    disagree(image->size());
+	}
+	if (began && !image->size()) {
+	    Metrics::firstByteSeconds.record(Utility::now() - began);
+	}
 	image->append(tile, length);
+	TRACE_FILE_BYTES2(image__append, fileIndex, length, image->size());
+	if (peak < image->size() - image->begin()) {
+	    peak = image->size() - image->begin();
+	}
+	if (prefix && image->size() >= prefix->size()) {
+	    // we no longer need the prefix
+	    prefix.reset();
+	}
 	synchronized.notifyAll();
     }
     // there is nothing more to be transcoded so close our input
     // and notifyAll that might be waiting for this in read().
-    Synchronized synchronized(*this);
-    close(in);
-    running = false;
-    synchronized.notifyAll();
-    // fulfill our doneGuarantee now
+    {
+	Synchronized synchronized(*this);
+	close(in);
+	prefix.reset();
+	ended = Utility::now();
+	cpuSeconds = Utility::threadCpu();
+	built = image->size();
+	// a complete image must be as large as our ends say
+	if (ends && !streaming && built != ends->size) disagree(built);
+	running = false;
+	synchronized.notifyAll();
+    }
+    // fulfill our doneGuarantee now,
+    // without a lock that those we notify might need.
     doneGuarantee.reset();
 }
 
 TranscodeFileReader::ImageBuilderThread::ImageBuilderThread(
-    int in_, int out_, boost::shared_ptr<void const> doneGuarantee_) throw()
+    FileIndex fileIndex_,
+    int in_, int out_, boost::shared_ptr<void const> doneGuarantee_,
+    Image::Budget * imageBudget, size_t window_, ImageConstPointer prefix_,
+    bool prefixRead_, ImageCache::EndsConstPointer ends_, bool endsRead_,
+    boost::function<void ()> forgetEnds_, double began_) throw()
 :
+    fileIndex(fileIndex_),
     in(in_),
     out(out_),
     doneGuarantee(doneGuarantee_),
     running(true),
     streaming(true),
-    image(new Image()),
+    aborting(false),
+    window(window_),
+    furthest(0),
+    prefix(window_ ? ImageConstPointer() : prefix_),
+    prefixRead(prefixRead_),
+    diverged(false),
+    ends(ends_),
+    endsRead(endsRead_),
+    forgetEnds(forgetEnds_),
+    began(began_),
+    ended(0),
+    cpuSeconds(0),
+    peak(0),
+    built(0),
+    image(new Image(imageBudget)),
     thread(boost::bind(&ImageBuilderThread::run, this))
 {}
 
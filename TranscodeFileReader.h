@@ -9,6 +9,11 @@
 #ifndef TranscodeFileReader_h
 #define TranscodeFileReader_h
 
+#include <map>
+#include <vector>
+
+#include <pthread.h>
+
 #include <boost/thread.hpp>
 #include <boost/multi_index_container.hpp>
 #include <boost/multi_index/member.hpp>
@@ -16,7 +21,10 @@
 #include <gst/gst.h>
 
 #include "Image.h"
+#include "ImageCache.h"
+#include "Metrics.h"
 #include "Synchronizable.h"
+#include "Transcode.h"
 
 #include "FileReader.h"
 
@@ -28,6 +36,46 @@
 /// created.
 /// The overidden #stat method returns the size of the transcoded image,
 /// potentially blocking until it is complete.
+///
+/// If the transcoding is to be streamed through a window, only so much of
+/// the image is retained.
+/// What the readers have consumed is dropped to make room for more and,
+/// if there is no room, the pipeline is blocked until there is.
+/// Such an image is never complete and reads before what was dropped fail.
+///
+/// A TranscodeFileReader may be given the prefix of an image that was
+/// retained from an earlier transcoding.
+/// Reads within the prefix are answered from it immediately.
+/// The transcoding is expected to reproduce the prefix and,
+/// if it does not, the prefix is abandoned.
+/// If anything was read from an abandoned prefix, reads fail from then on
+/// rather than splice what was read to a different transcoding.
+/// If the TranscodeFileReader is destroyed before its image is complete
+/// it may offer what it has built so far to be retained.
+///
+/// The outcome of a transcoding is reported when its pipeline fails
+/// (it cannot be constructed or started or it posts an error) or
+/// its image is taken (complete).
+/// A failed pipeline is stopped and reads beyond what it built fail.
+///
+/// Reads within the ends of an image that was completed earlier
+/// are answered from them without blocking or starting the pipeline.
+/// Once started, what the pipeline produces is compared with them and,
+/// if it differs (or its size does), they are forgotten and reads that
+/// follow one answered from them fail.
+///
+/// A lazy TranscodeFileReader does not start its pipeline until it is
+/// needed (to read beyond any prefix or for its true size) or,
+/// if given a grace period, after that.
+/// One that is released before then costs nothing.
+///
+/// A TranscodeFileReader may be given siblings that fan out from
+/// the decoding of its source in the same pipeline.
+/// Their images are offered to be warmed (cached) when it is destroyed.
+///
+/// The resources that a started TranscodeFileReader used (the CPU of its
+/// pipeline's streaming threads and its ImageBuilderThreads and what they
+/// read and built) are accounted for by its mapping when it is destroyed.
 class TranscodeFileReader : public FileReader {
 private:
 
@@ -35,48 +83,159 @@ private:
     /// gstreamer pipeline.
     class ImageBuilderThread : public Synchronizable<boost::mutex> {
     private:
+	FileIndex fileIndex;	///< What we are building an image of
 	int in;			///< Input from gstreamer pipeline
 	int out;		///< Output from gstreamer pipeline
 	boost::shared_ptr<void const> doneGuarantee;	///< reset when done
 	bool running;		///< This thread is still running
 	bool streaming;		///< GstPipeline is still streaming
+	bool aborting;		///< Stop waiting for room in the window
+	size_t window;		///< If not 0, retain only this much image
+	size_t furthest;	///< Furthest offset read or to be read
+	ImageConstPointer prefix;	///< Expected prefix of our image
+	bool prefixRead;	///< Something was read from our prefix
+	bool diverged;		///< ... and the transcoding did not reproduce it
+	ImageCache::EndsConstPointer ends;	///< Expected ends of our image
+	bool endsRead;		///< Something was read from our ends
+	boost::function<void ()> forgetEnds;	///< When they prove wrong
+	double began;		///< If not 0, time phases from this
+	double ended;		///< When we stopped running
+	double cpuSeconds;	///< Used by this thread
+	size_t peak;		///< Most image bytes retained at once
+	size_t built;		///< Size of image built
 	Image * image;		///< Built image
 	boost::thread thread;	///< This thread
 	void run() throw();	///< What this thread runs
+	bool agrees(size_t offset, char const * tile, size_t length) const
+	    throw();
+	void disagree(size_t offset) throw();
     public:
-	ImageBuilderThread(int in, int out,
-	    boost::shared_ptr<void const>) throw();
+	ImageBuilderThread(FileIndex, int in, int out,
+	    boost::shared_ptr<void const>, Image::Budget *, size_t window,
+	    ImageConstPointer prefix, bool prefixRead = false,
+	    ImageCache::EndsConstPointer ends = ImageCache::EndsConstPointer(),
+	    bool endsRead = false,
+	    boost::function<void ()> forgetEnds = boost::function<void ()>(),
+	    double began = 0)
+	    throw();
 	~ImageBuilderThread() throw();
 	ssize_t read(char * buffer, size_t size, size_t offset) throw();
+	ssize_t readEnds(char * buffer, size_t size, size_t offset) throw();
+	ssize_t endsSize() throw();
 	size_t size(bool wait) throw();
 	ImageConst * getImage() throw();
+	ImageConst * awaitImage() throw();
+	ImageConst * getPrefix() throw();
+	bool isRunning() throw();
+	bool building() throw();
+	void abort() throw();
 	void stopRunning() throw();
-	gboolean eos(GstBus *, GstMessage *) throw();
-	static gboolean eos_(GstBus *, GstMessage *, ImageBuilderThread *) throw();
+	void usage(Metrics::Usage &) throw();	///< Add ours when done
+	void eos() throw();
+    };
+
+    /// A Guard for a TranscodeFileReader is shared with the glib callbacks
+    /// that may call it from the glib main loop (the grace timeout that
+    /// will start a lazy one and its pipeline's bus signal handlers).
+    /// Each callback holds its mutex while it calls the reader and
+    /// the TranscodeFileReader disowns it when destroyed, under the mutex,
+    /// so that it is not destroyed while a callback is in progress.
+    struct Guard {
+	boost::mutex mutex;		///< Guards reader
+	TranscodeFileReader * reader;	///< Reader to call, if any
     };
 
+    Transcode::Element transcodeElement;	///< What to transcode with
+    Image::Budget * imageBudget;	///< Image is accountable to this
+    ImageConstPointer prefix;	///< Until started, prefix retained earlier
+    bool prefixRead;		///< Until started, something was read from it
+    ImageCache::EndsConstPointer ends;	///< Ends of image completed earlier
+    bool endsRead;		///< Until started, something was read from them
+    boost::function<void ()> forgetEnds;	///< Forget them if wrong
+    boost::function<void (Reader *)> done;	///< Until started, when done
+    boost::mutex startMutex;	///< Guards started and what it starts
+    bool started;		///< Pipeline has been started
+    bool abandoned;		///< Not to be started after our grace period
+    boost::shared_ptr<Guard> guard;	///< Shared with glib callbacks
+    double began;		///< When we began (Utility::now())
     GstElement * pipeline;	///< Gstreamer pipeline to build image
     GstBus * bus;		///< Gstreamer pipeline bus
     ImageBuilderThread * imageBuilderThread;	///< Thread to build image
+    std::vector<Transcode::Element> siblings;	///< Fan out with these
+    std::vector<ImageBuilderThread *> siblingThreads;	///< ... to these
+    boost::function<void (unsigned, ImageConst *)> warm;	///< Warm sibling
+    boost::function<void (ImageConst *)> retain;	///< Retain a prefix
+    boost::function<void (bool)> outcome;	///< Report success or failure
+    boost::mutex reportMutex;	///< Guards reported
+    bool reported;		///< Outcome has been reported
+    bool volatile failure;	///< Pipeline failed
+    boost::mutex usageMutex;	///< Guards entered and cpuSeconds
+    std::map<pthread_t, double> entered;	///< Streaming threads' CPU then
+    double cpuSeconds;		///< Used by streaming threads that left
+
+    void launch(boost::shared_ptr<void const> & doneGuarantee) throw();
+    void fail() throw();
+    void report(bool success) throw();
+    void stop() throw();
+    void start(bool graceful = false) throw();
+    static gboolean start_(boost::shared_ptr<Guard> *) throw();
+    static void unref_(boost::shared_ptr<Guard> *) throw();
+    static void unrefClosure_(boost::shared_ptr<Guard> *, GClosure *) throw();
+    void connect(char const * signal, GCallback) throw();
 
     gboolean warning(GstBus *, GstMessage *) throw();
-    static gboolean warning_(GstBus *, GstMessage *, TranscodeFileReader *) throw();
+    static gboolean warning_(GstBus *, GstMessage *, boost::shared_ptr<Guard> *)
+	throw();
     gboolean error(GstBus *, GstMessage *) throw();
-    static gboolean error_(GstBus *, GstMessage *, TranscodeFileReader *) throw();
+    static gboolean error_(GstBus *, GstMessage *, boost::shared_ptr<Guard> *)
+	throw();
+    gboolean eos(GstBus *, GstMessage *) throw();
+    static gboolean eos_(GstBus *, GstMessage *, boost::shared_ptr<Guard> *)
+	throw();
+    void streamStatus(GstBus *, GstMessage *) throw();
+    static void streamStatus_(GstBus *, GstMessage *, TranscodeFileReader *)
+	throw();
+    void account(double mediaSeconds) throw();
 
 public:
 
     /// Construct a TranscodeFileReader on the file identified by fileIndex
-    /// and fd, using the parseable pipeline description and notify the
-    /// done function object when done successfully or otherwise.
+    /// and fd, using the transcodeElement's parseable pipeline description
+    /// and notify the done function object when done successfully or
+    /// otherwise.
+    /// The image built is accountable to the imageBudget
+    /// and is expected to begin with the prefix, if any,
+    /// and to have the ends, if any (which forgetEnds forgets if not).
+    /// The outcome function object, if any, is told of success or failure.
+    /// If lazy, the pipeline is not started until needed or until
+    /// grace milliseconds have passed (if not 0) and the doneGuarantee is
+    /// not used.
+    /// The complete image of each of the siblings, if any,
+    /// is offered to the warm function object with its variant.
     TranscodeFileReader(
 	FileIndex fileIndex, int fd,
-	char const * pipeline,
+	Transcode::Element const & transcodeElement,
 	boost::shared_ptr<void const> & doneGuarantee,
-	boost::function<void (Reader *)> done)
+	boost::function<void (Reader *)> done,
+	Image::Budget * imageBudget,
+	ImageConstPointer prefix,
+	boost::function<void (ImageConst *)> retain,
+	boost::function<void (bool)> outcome,
+	ImageCache::EndsConstPointer ends = ImageCache::EndsConstPointer(),
+	boost::function<void ()> forgetEnds = boost::function<void ()>(),
+	bool lazy = false,
+	unsigned grace = 0,
+	std::vector<Transcode::Element> const & siblings
+	    = std::vector<Transcode::Element>(),
+	boost::function<void (unsigned, ImageConst *)> warm
+	    = boost::function<void (unsigned, ImageConst *)>())
 	throw();
 
-    /// Destroy the TranscodeFileReader by aborting any transcoding in process
+    /// Destroy the TranscodeFileReader by aborting any transcoding in process.
+    /// If there is a retain function object, offer it ownership of
+    /// an incomplete image.
+    /// If there is a warm function object, offer it ownership of
+    /// each complete sibling image.
     ~TranscodeFileReader() throw();
 
     virtual ssize_t read(char * buffer, size_t size, off_t offset) throw();
@@ -84,6 +243,24 @@ public:
     virtual size_t size(bool wait) throw();
 
     virtual ImageConst * getImage() throw();
+
+    virtual bool building() throw();
+
+    /// Return the fraction of the source that the pipeline has consumed.
+    virtual double progress() throw();
+
+    /// Return the number of seconds that it should take the pipeline to
+    /// consume the rest of the source at the rate it has so far.
+    virtual double remaining() throw();
+
+    /// Return the number of seconds since the pipeline was started
+    /// (0 if it has not been).
+    virtual double elapsed() throw();
+
+    virtual bool transcodes() throw();
+
+    /// Don't let our grace period start a pipeline that no one will read.
+    virtual void abandon() throw();
 };
 
 #endif
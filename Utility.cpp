@@ -8,6 +8,7 @@
 
 #include <cstdarg>
 #include <cstring>
+#include <ctime>
 
 #include "Utility.h"
 
@@ -28,6 +29,18 @@ namespace Utility {
 	return 0;
     }
 
+    double now() throw() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    double threadCpu() throw() {
+	struct timespec ts;
+	if (-1 == clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts)) return 0;
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
     /// LessThan<T>::operator(T a, T b) specialization
     /// for the char const * type T.
     /// Unless this is used for the Compare template argument of an STL
@@ -18,6 +18,12 @@ namespace Utility {
     /// \return the length of the first match
     size_t match(char const * a, char const * b, ...) throw();
 
+    /// Return the time, in seconds, according to a monotonic clock.
+    double now() throw();
+
+    /// Return the CPU time, in seconds, used by the calling thread.
+    double threadCpu() throw();
+
     /// For use as a custom deleter for a boost::shared_ptr
     /// when we want nothing to happen when the last shared copy
     /// is destroyed